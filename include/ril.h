@@ -101,6 +101,7 @@ enum
 };
 
 struct _ril_compile;
+struct _ril_incremental;
 struct _ril_vm;
 struct _ril_state;
 struct _ril_var;
@@ -120,6 +121,7 @@ typedef uint32_t ril_crc_t;
 typedef ril_crc_t ril_signature_t;
 typedef struct {uint8_t buf[16];} ril_md5_t;
 typedef struct _ril_compile ril_compile_t;
+typedef struct _ril_incremental ril_incremental_t;
 typedef struct _ril_vm ril_vm_t;
 typedef struct _ril_state ril_state_t;
 typedef ril_vm_t* RILVM;
@@ -132,6 +134,7 @@ typedef void (*RILERROR)(RILVM, const char*);
 typedef int (*RILFUNCTION)(RILVM);
 typedef RILRESULT (*RILCOMPILEFUNCTION)(ril_compile_t*);
 typedef RILRESULT (*RILSAVEFUNCTION)(RILVM vm, ril_buffer_t *dest);
+typedef int (*RILREADFUNCTION)(void *userdata, char *dest, int size);
 typedef int (*RILLOADFUNCTION)(RILVM vm, const void *src);
 typedef int (*RILDELETEFUNCTION)(RILVM);
 
@@ -140,6 +143,48 @@ typedef struct
   int id;
 } ril_cmdid_t;
 
+/* counters of the VM's slab pool for vars, strings, arrays and keys */
+typedef struct
+{
+  unsigned int allocs, frees;
+  unsigned int pages; /* pages of the pool */
+  unsigned int large; /* allocations too large for the pool */
+} ril_allocstats_t;
+
+/* counters of the results cache of a pure macro */
+typedef struct
+{
+  unsigned int hits, misses;
+  unsigned int evictions;
+  unsigned int entries; /* results held */
+} ril_memostats_t;
+
+/* counters of the output kept by [cache] */
+typedef struct
+{
+  unsigned int hits, misses;
+  unsigned int evictions;
+  unsigned int entries; /* fragments held */
+  unsigned int bytes; /* their keys and output */
+} ril_cachestats_t;
+
+/* levels of the pass over compiled commands */
+enum
+{
+  RIL_OPTIMIZE_NONE = 0,
+  RIL_OPTIMIZE_LOCAL, /* [let] without effect, [if] of literal conditions */
+  RIL_OPTIMIZE_FLOW, /* also goto chains and unreachable commands */
+};
+
+/* counters of the commands the pass took out or rewrote */
+typedef struct
+{
+  unsigned int lets;
+  unsigned int branches; /* commands of folded [if] chains */
+  unsigned int gotos; /* gotos threaded or falling into their label */
+  unsigned int unreachable; /* commands after goto, return or exit */
+} ril_optimizestats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -152,6 +197,7 @@ RIL_API RILRESULT ril_setdelimiter(RILVM vm, const char *left, const char *right
 RIL_API bool ril_isleftdelimiter(RILVM vm, const char *src);
 RIL_API bool ril_isrightdelimiter(RILVM vm, const char *src);
 RIL_API RILRESULT ril_load(RILVM vm, const void *src, int size);
+RIL_API RILRESULT ril_reload(RILVM vm, const void *src, int size);
 RIL_API RILRESULT ril_loadfile(RILVM vm, const char *file);
 RIL_API RILRESULT ril_loadbytefile(RILVM vm, const char *file);
 RIL_API int ril_docmd(RILVM vm, ril_cmdid_t cmd);
@@ -163,6 +209,7 @@ RIL_API ril_signature_t ril_signature(ril_tag_t *tag);
 RIL_API const char* ril_getparametername(const ril_buffer_t *buffer, int index);
 RIL_API const char* ril_getparametervalue(const ril_buffer_t *buffer, int index);
 RIL_API RILRESULT ril_parseparameters(ril_buffer_t *buffer, const char *args);
+RIL_API void ril_closeparameters(ril_buffer_t *buffer);
 RIL_API ril_signature_t ril_makesignature(const char *name, const char *args);
 RIL_API ril_signature_t ril_makesignature2(const char *name, const ril_buffer_t *parameterbuffer);
 RIL_API void ril_makesignaturestring(ril_buffer_t *dest, const char *name, const ril_buffer_t *parameter);
@@ -185,6 +232,13 @@ RIL_API void ril_setnextcmdbyid(RILVM vm, ril_cmdid_t cmdid);
 RIL_API void* ril_malloc(int size);
 RIL_API void* ril_realloc(void *ptr, int size);
 RIL_API void ril_free(void *ptr);
+RIL_API void ril_getallocstats(RILVM vm, ril_allocstats_t *stats);
+RIL_API RILRESULT ril_getmemostats(ril_tag_t *tag, ril_memostats_t *stats);
+RIL_API void ril_setcachebudget(RILVM vm, int bytes);
+RIL_API void ril_uncache(RILVM vm, const char *key);
+RIL_API void ril_getcachestats(RILVM vm, ril_cachestats_t *stats);
+RIL_API void ril_setoptimize(RILVM vm, int level);
+RIL_API void ril_getoptimizestats(RILVM vm, ril_optimizestats_t *stats);
 RIL_API void ril_setfilename(RILVM vm, const char *file);
   
 RIL_API void ril_ch(RILVM vm, ril_var_t *var);
@@ -225,7 +279,9 @@ RIL_API int ril_countarguments(RILVM vm);
 RIL_API RILRESULT ril_setarguments(RILVM vm, ril_cmdid_t cmd);
 RIL_API ril_var_t* ril_getargument(RILVM vm, int index);
 RIL_API const void* ril_getptr(RILVM vm, int index);
+/* the text may be a literal of the loaded code, kept until the running tag returns even if it loads other code */
 RIL_API const char* ril_getstring(RILVM vm, int index);
+RIL_API const char* ril_getstringlen(RILVM vm, int index, int *length);
 RIL_API bool ril_getbool(RILVM vm, int index);
 RIL_API int ril_getinteger(RILVM vm, int index);
 RIL_API float ril_getfloat(RILVM vm, int index);
@@ -260,10 +316,16 @@ RIL_API RIL_FUNC(if, vm);
 RIL_API RIL_FUNC(else, vm);
 RIL_API RIL_FUNC(elseif, vm);
 RIL_API RIL_FUNC(endif, vm);
+RIL_API RIL_FUNC(switch, vm);
+RIL_API RIL_COMPILEFUNC(case, context);
+RIL_API RIL_FUNC(case, vm);
+RIL_API RIL_FUNC(default, vm);
+RIL_API RIL_FUNC(endswitch, vm);
 RIL_API RIL_FUNC(let, vm);
 RIL_API RIL_COMPILEFUNC(macro, context);
 RIL_API RIL_FUNC(macro, vm);
 RIL_API RIL_FUNC(endmacro, vm);
+RIL_API RIL_FUNC(returnvalue, vm);
 RIL_API RIL_FUNC(callmacro, vm);
 RIL_API RIL_SAVEFUNC(callmacro, dest, src);
 RIL_API RIL_LOADFUNC(callmacro, dest, src);
@@ -281,9 +343,19 @@ RIL_API RIL_FUNC(do, vm);
 RIL_API RIL_FUNC(dowhile, vm);
 RIL_API RIL_FUNC(foreach, vm);
 RIL_API RIL_FUNC(endforeach, vm); 
+RIL_API RIL_COMPILEFUNC(endloop, context);
+RIL_API RIL_FUNC(hoistwhile, vm);
+RIL_API RIL_FUNC(hoistdo, vm);
+RIL_API RIL_FUNC(hoistforeach, vm);
 RIL_API RIL_SAVEFUNC(foreach, dest, src);
 RIL_API RIL_LOADFUNC(foreach, dest, src);
 RIL_API RIL_DELETEFUNC(foreach, vm);
+RIL_API RIL_FUNC(for, vm);
+RIL_API RIL_FUNC(endfor, vm);
+RIL_API RIL_FUNC(hoistfor, vm);
+RIL_API RIL_SAVEFUNC(for, dest, src);
+RIL_API RIL_LOADFUNC(for, dest, src);
+RIL_API RIL_DELETEFUNC(for, vm);
 RIL_API RIL_FUNC(const, vm);
 RIL_API RIL_COMPILEFUNC(include, context);
 RIL_API RIL_FUNC(stream, vm);
@@ -291,6 +363,13 @@ RIL_API RIL_FUNC(endstream, vm);
 RIL_API RIL_SAVEFUNC(stream, dest, src);
 RIL_API RIL_LOADFUNC(stream, dest, src);
 RIL_API RIL_DELETEFUNC(stream, vm);
+RIL_API RIL_FUNC(cache, vm);
+RIL_API RIL_FUNC(endcache, vm);
+RIL_API RIL_SAVEFUNC(cache, dest, src);
+RIL_API RIL_LOADFUNC(cache, dest, src);
+RIL_API RIL_DELETEFUNC(cache, vm);
+RIL_API RIL_FUNC(uncache, vm);
+RIL_API RIL_FUNC(uncacheall, vm);
 RIL_API RIL_SAVEFUNC(null, dest, src);
 RIL_API RIL_LOADFUNC(null, dest, src);
 RIL_API RIL_DELETEFUNC(null, vm);
@@ -310,22 +389,34 @@ RIL_FUNC(readvar, vm);
 /* compiler */
 RIL_API RILRESULT ril_compile(RILVM vm, const char *text, ril_buffer_t *dest);
 RIL_API RILRESULT ril_compilefile(RILVM vm, const char *file, ril_buffer_t *dest);
+RIL_API RILRESULT ril_compilestream(RILVM vm, RILREADFUNCTION read, void *userdata, ril_buffer_t *dest);
+RIL_API void ril_clearincludecache(RILVM vm);
+RIL_API RILRESULT ril_compilefiles(RILVM vm, const char **files, ril_buffer_t **dests, RILRESULT *results, int count, int threadnum);
+RIL_API ril_incremental_t* ril_openincremental(void);
+RIL_API void ril_closeincremental(ril_incremental_t *incremental);
+RIL_API RILRESULT ril_recompile(RILVM vm, ril_incremental_t *incremental, const char *src, ril_buffer_t *dest);
 RIL_API const char* rilc_getstring(ril_compile_t *context, uint32_t argid);
 RIL_API void rilc_eraselastcmd(ril_compile_t *context);;
 RIL_API void rilc_addarg(ril_compile_t *context);
 RIL_API void rilc_addbytes(ril_compile_t *context, const void *value, int size);
 RIL_API void rilc_addstring(ril_compile_t *context, const char *value);
 RIL_API RILRESULT rilc_compile(const char *src, ril_compile_t *context);
+RIL_API RILRESULT rilc_compilestream(RILREADFUNCTION read, void *userdata, ril_compile_t *context);
+RIL_API bool rilc_readahead(ril_compile_t *context, const char *terminator);
 
 /* variable */
 RIL_API ril_var_t* ril_getvar(RILVM vm, ril_var_t *parent, const char *name);
 RIL_API ril_var_t* ril_getvarbyhash(RILVM vm, ril_var_t *parent, ril_crc_t name_hash);
+RIL_API ril_var_t* ril_getvarbyindex(RILVM vm, ril_var_t *parent, int index);
 RIL_API ril_var_t* ril_newvar(RILVM vm);
 RIL_API ril_var_t* ril_createvarbyhash(RILVM vm, ril_var_t *parent, const char *name, ril_crc_t hashkey);
+RIL_API ril_var_t* ril_createvarbyindex(RILVM vm, ril_var_t *parent, int index);
 RIL_API ril_var_t* ril_createvar(RILVM vm, ril_var_t *parent, const char *name);
 RIL_API ril_var_t* ril_set2arraybyhash(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name, ril_crc_t hashkey);
+RIL_API ril_var_t* ril_set2arraybyindex(RILVM vm, ril_var_t *parent, ril_var_t *var, int index);
 RIL_API ril_var_t* ril_set2array(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name);
 RIL_API void ril_unset2array(RILVM vm, ril_var_t *parent, ril_crc_t hashkey);
+RIL_API void ril_unset2arraybyindex(RILVM vm, ril_var_t *parent, int index);
 RIL_API void ril_initvar(RILVM vm, ril_var_t *var);
 RIL_API void ril_retainvar(ril_var_t *var);
 RIL_API void ril_deletevar(RILVM vm, ril_var_t *var);
@@ -338,6 +429,7 @@ RIL_API void ril_setstringbysize(RILVM vm, ril_var_t *var, const char *value, in
 RIL_API void ril_copyvar(RILVM vm, ril_var_t *dest, ril_var_t *src);
 RIL_API void ril_setconst(ril_var_t *var);
 RIL_API const char* ril_var2string(RILVM vm, ril_var_t *var);
+RIL_API const char* ril_var2stringlen(RILVM vm, ril_var_t *var, int *length);
 RIL_API int ril_var2integer(RILVM vm, ril_var_t *var);
 RIL_API float ril_var2float(RILVM vm, ril_var_t *var);
 RIL_API bool ril_var2bool(RILVM vm, ril_var_t *var);
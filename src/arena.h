@@ -0,0 +1,171 @@
+/**
+ * arena - The bump allocator.
+ *
+ * MIT License
+ * Copyright (C) 2011 Nothan
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Nothan
+ * nothan@t-denrai.net
+ *
+ * Tsuioku Denrai
+ * http://t-denrai.net/
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+
+struct _arena_block
+{
+  struct _arena_block *next;
+  int size;
+  int used;
+};
+typedef struct _arena_block arena_block_t;
+
+struct _arena
+{
+  int blocksize;
+  arena_block_t *first;
+  arena_block_t *current;
+};
+typedef struct _arena arena_t;
+
+typedef struct
+{
+  arena_block_t *block;
+  int used;
+} arena_mark_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static __inline arena_block_t* arena_newblock(int size)
+{
+  arena_block_t *block = (arena_block_t*)malloc(sizeof(arena_block_t) + size);
+
+  if (NULL == block) return NULL;
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+
+  return block;
+}
+
+static __inline arena_t* arena_open(int blocksize)
+{
+  arena_t *arena = (arena_t*)malloc(sizeof(arena_t));
+
+  if (NULL == arena) return NULL;
+  arena->blocksize = blocksize;
+  arena->first = arena_newblock(blocksize);
+  arena->current = arena->first;
+
+  return arena;
+}
+
+static __inline void arena_close(arena_t *arena)
+{
+  arena_block_t *block = arena->first, *next;
+
+  for (; NULL != block; block = next)
+  {
+    next = block->next;
+    free(block);
+  }
+  free(arena);
+}
+
+static __inline void* arena_malloc(arena_t *arena, int size)
+{
+  arena_block_t *block = arena->current, *next;
+  void *ptr;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (block->used + size > block->size)
+  {
+    /* reuse the kept block, otherwise insert a larger one */
+    next = block->next;
+    if (NULL == next || size > next->size)
+    {
+      while (arena->blocksize < size) arena->blocksize *= 2;
+      next = arena_newblock(arena->blocksize);
+      if (NULL == next) return NULL;
+      arena->blocksize *= 2;
+      next->next = block->next;
+      block->next = next;
+    }
+    next->used = 0;
+    block = arena->current = next;
+  }
+
+  ptr = (int8_t*)(block + 1) + block->used;
+  block->used += size;
+
+  return ptr;
+}
+
+static __inline void* arena_realloc(arena_t *arena, void *ptr, int oldsize, int size)
+{
+  void *dest;
+
+  if (size <= oldsize) return ptr;
+  dest = arena_malloc(arena, size);
+  if (NULL != dest && NULL != ptr) memcpy(dest, ptr, oldsize);
+
+  return dest;
+}
+
+static __inline arena_mark_t arena_mark(const arena_t *arena)
+{
+  arena_mark_t mark;
+
+  mark.block = arena->current;
+  mark.used = arena->current->used;
+
+  return mark;
+}
+
+static __inline void arena_release(arena_t *arena, arena_mark_t mark)
+{
+  arena->current = mark.block;
+  arena->current->used = mark.used;
+}
+
+static __inline void arena_clear(arena_t *arena)
+{
+  arena->current = arena->first;
+  arena->current->used = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,316 @@
+#include "hamt.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 5 bits of the key per level from the top, the last level takes the remaining 2 */
+#define HAMT_LASTLEVEL 6
+
+struct _hamt_node
+{
+  int refcount;
+  uint32_t datamap; /* digits holding a leaf */
+  uint32_t nodemap; /* digits holding a subnode */
+  hamt_leaf_t leaves[1]; /* the leaves, then the subnode pointers */
+};
+
+static __inline uint32_t _digit(uint32_t key, int level)
+{
+  return HAMT_LASTLEVEL > level ? (key >> (27 - 5 * level)) & 31 : key & 3;
+}
+
+static __inline int _popcount(uint32_t x)
+{
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0F0F0F0F;
+  return (int)((x * 0x01010101) >> 24);
+}
+
+static __inline int _index(uint32_t map, uint32_t bit)
+{
+  return _popcount(map & (bit - 1));
+}
+
+static __inline hamt_node_t** _nodes(hamt_node_t *node)
+{
+  return (hamt_node_t**)(node->leaves + _popcount(node->datamap));
+}
+
+static hamt_node_t* _newnode(uint32_t datamap, uint32_t nodemap)
+{
+  hamt_node_t *node = (hamt_node_t*)malloc(offsetof(hamt_node_t, leaves)
+    + sizeof(hamt_leaf_t) * _popcount(datamap) + sizeof(hamt_node_t*) * _popcount(nodemap));
+
+  node->refcount = 1;
+  node->datamap = datamap;
+  node->nodemap = nodemap;
+
+  return node;
+}
+
+/* a node of a single owner is changed in place, a shared one is copied first */
+static hamt_node_t* _unique(hamt_node_t **slot, const hamt_ops_t *ops, void *userdata)
+{
+  hamt_node_t *node = *slot, *copy;
+  int i, leaves, nodes;
+
+  if (1 == node->refcount) return node;
+
+  copy = _newnode(node->datamap, node->nodemap);
+  leaves = _popcount(node->datamap);
+  nodes = _popcount(node->nodemap);
+  memcpy(copy->leaves, node->leaves, sizeof(hamt_leaf_t) * leaves);
+  memcpy(_nodes(copy), _nodes(node), sizeof(hamt_node_t*) * nodes);
+  for (i = 0; NULL != ops && i < leaves; ++i) ops->copy(&copy->leaves[i], userdata);
+  for (i = 0; i < nodes; ++i) ++_nodes(copy)[i]->refcount;
+  --node->refcount;
+
+  return *slot = copy;
+}
+
+/* a node with new maps, keeping the entries of the digits in both */
+static hamt_node_t* _rebuild(hamt_node_t *node, uint32_t datamap, uint32_t nodemap, const hamt_leaf_t *leaf, hamt_node_t *sub)
+{
+  hamt_node_t *copy = _newnode(datamap, nodemap);
+  hamt_leaf_t *destleaf = copy->leaves, *srcleaf = node->leaves;
+  hamt_node_t **destnode = _nodes(copy), **srcnode = _nodes(node);
+  uint32_t bit;
+
+  for (bit = 1; 0 != bit; bit <<= 1)
+  {
+    if (node->datamap & bit)
+    {
+      if (datamap & bit) *destleaf++ = *srcleaf;
+      ++srcleaf;
+    }
+    else if (datamap & bit) *destleaf++ = *leaf;
+
+    if (node->nodemap & bit)
+    {
+      if (nodemap & bit) *destnode++ = *srcnode;
+      ++srcnode;
+    }
+    else if (nodemap & bit) *destnode++ = sub;
+  }
+  free(node);
+
+  return copy;
+}
+
+static hamt_node_t* _pair(const hamt_leaf_t *a, const hamt_leaf_t *b, int level)
+{
+  uint32_t digita = _digit(a->key, level), digitb = _digit(b->key, level);
+  hamt_node_t *node;
+
+  if (digita == digitb)
+  {
+    node = _newnode(0, 1u << digita);
+    _nodes(node)[0] = _pair(a, b, level + 1);
+    return node;
+  }
+
+  node = _newnode((1u << digita) | (1u << digitb), 0);
+  node->leaves[digita < digitb ? 0 : 1] = *a;
+  node->leaves[digita < digitb ? 1 : 0] = *b;
+
+  return node;
+}
+
+static hamt_leaf_t* _find(hamt_node_t *node, uint32_t key, int level)
+{
+  hamt_leaf_t *leaf;
+  uint32_t bit;
+
+  for (; NULL != node; ++level)
+  {
+    bit = 1u << _digit(key, level);
+    if (node->datamap & bit)
+    {
+      leaf = &node->leaves[_index(node->datamap, bit)];
+      return key == leaf->key ? leaf : NULL;
+    }
+    if (!(node->nodemap & bit)) return NULL;
+    node = _nodes(node)[_index(node->nodemap, bit)];
+  }
+
+  return NULL;
+}
+
+hamt_node_t* hamt_retain(hamt_node_t *root)
+{
+  if (NULL != root) ++root->refcount;
+
+  return root;
+}
+
+void hamt_release(hamt_node_t *root, const hamt_ops_t *ops, void *userdata)
+{
+  int i;
+
+  if (NULL == root || 0 < --root->refcount) return;
+
+  for (i = _popcount(root->datamap) - 1; NULL != ops && 0 <= i; --i) ops->release(&root->leaves[i], userdata);
+  for (i = _popcount(root->nodemap) - 1; 0 <= i; --i) hamt_release(_nodes(root)[i], ops, userdata);
+  free(root);
+}
+
+hamt_leaf_t* hamt_get(hamt_node_t *root, uint32_t key)
+{
+  return _find(root, key, 0);
+}
+
+/* the leaf after copying every shared node on its path, so it can be changed */
+hamt_leaf_t* hamt_getunique(hamt_node_t **root, uint32_t key, const hamt_ops_t *ops, void *userdata)
+{
+  hamt_node_t *node, **slot = root;
+  uint32_t bit;
+  int level;
+
+  if (NULL == _find(*root, key, 0)) return NULL;
+
+  for (level = 0;; ++level)
+  {
+    node = _unique(slot, ops, userdata);
+    bit = 1u << _digit(key, level);
+    if (node->datamap & bit) return &node->leaves[_index(node->datamap, bit)];
+    slot = &_nodes(node)[_index(node->nodemap, bit)];
+  }
+}
+
+hamt_leaf_t* hamt_insert(hamt_node_t **root, const hamt_leaf_t *leaf, const hamt_ops_t *ops, void *userdata)
+{
+  hamt_node_t *node, *sub, **slot = root;
+  hamt_leaf_t *old;
+  uint32_t bit;
+  int level;
+
+  if (NULL == *root)
+  {
+    node = *root = _newnode(1u << _digit(leaf->key, 0), 0);
+    node->leaves[0] = *leaf;
+    return node->leaves;
+  }
+
+  for (level = 0;; ++level)
+  {
+    node = _unique(slot, ops, userdata);
+    bit = 1u << _digit(leaf->key, level);
+    if (node->nodemap & bit)
+    {
+      slot = &_nodes(node)[_index(node->nodemap, bit)];
+      continue;
+    }
+    if (node->datamap & bit)
+    {
+      old = &node->leaves[_index(node->datamap, bit)];
+      if (old->key == leaf->key)
+      {
+        if (NULL != ops) ops->release(old, userdata);
+        *old = *leaf;
+        return old;
+      }
+      // both leaves go one level down
+      sub = _pair(old, leaf, level + 1);
+      *slot = _rebuild(node, node->datamap & ~bit, node->nodemap | bit, NULL, sub);
+      return _find(sub, leaf->key, level + 1);
+    }
+    node = *slot = _rebuild(node, node->datamap | bit, node->nodemap, leaf, NULL);
+    return &node->leaves[_index(node->datamap, bit)];
+  }
+}
+
+static void _remove(hamt_node_t **slot, uint32_t key, int level, const hamt_ops_t *ops, void *userdata)
+{
+  hamt_node_t *node = _unique(slot, ops, userdata), *child, **childslot;
+  uint32_t bit = 1u << _digit(key, level);
+  hamt_leaf_t leaf;
+
+  if (node->datamap & bit)
+  {
+    if (NULL != ops) ops->release(&node->leaves[_index(node->datamap, bit)], userdata);
+    if (bit == node->datamap && 0 == node->nodemap)
+    {
+      free(node);
+      *slot = NULL;
+      return;
+    }
+    *slot = _rebuild(node, node->datamap & ~bit, node->nodemap, NULL, NULL);
+    return;
+  }
+
+  childslot = &_nodes(node)[_index(node->nodemap, bit)];
+  _remove(childslot, key, level + 1, ops, userdata);
+  child = *childslot;
+  if (NULL == child)
+  {
+    if (bit == node->nodemap && 0 == node->datamap)
+    {
+      free(node);
+      *slot = NULL;
+      return;
+    }
+    *slot = _rebuild(node, node->datamap, node->nodemap & ~bit, NULL, NULL);
+  }
+  else if (0 == child->nodemap && 1 == _popcount(child->datamap))
+  {
+    // a lone leaf moves up
+    leaf = child->leaves[0];
+    free(child);
+    *slot = _rebuild(node, node->datamap | bit, node->nodemap & ~bit, &leaf, NULL);
+  }
+}
+
+int hamt_remove(hamt_node_t **root, uint32_t key, const hamt_ops_t *ops, void *userdata)
+{
+  if (NULL == _find(*root, key, 0)) return 0;
+
+  _remove(root, key, 0, ops, userdata);
+
+  return 1;
+}
+
+static hamt_leaf_t* _first(hamt_node_t *node)
+{
+  uint32_t map, bit;
+
+  for (;;)
+  {
+    map = node->datamap | node->nodemap;
+    bit = map & (~map + 1);
+    if (node->datamap & bit) return &node->leaves[_index(node->datamap, bit)];
+    node = _nodes(node)[_index(node->nodemap, bit)];
+  }
+}
+
+static hamt_leaf_t* _seek(hamt_node_t *node, uint32_t key, int level)
+{
+  uint32_t bit = 1u << _digit(key, level), rest;
+  hamt_leaf_t *leaf;
+
+  if (node->datamap & bit)
+  {
+    leaf = &node->leaves[_index(node->datamap, bit)];
+    if (leaf->key >= key) return leaf;
+  }
+  else if (node->nodemap & bit)
+  {
+    leaf = _seek(_nodes(node)[_index(node->nodemap, bit)], key, level + 1);
+    if (NULL != leaf) return leaf;
+  }
+
+  // the higher digits hold greater keys only
+  rest = (node->datamap | node->nodemap) & ~(bit | (bit - 1));
+  if (0 == rest) return NULL;
+  bit = rest & (~rest + 1);
+  if (node->datamap & bit) return &node->leaves[_index(node->datamap, bit)];
+
+  return _first(_nodes(node)[_index(node->nodemap, bit)]);
+}
+
+/* the leaf of the least key not below the given one, walking the keys in order */
+hamt_leaf_t* hamt_seek(hamt_node_t *root, uint32_t key)
+{
+  return NULL != root ? _seek(root, key, 0) : NULL;
+}
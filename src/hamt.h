@@ -0,0 +1,41 @@
+#ifndef _HAMT_H_
+#define _HAMT_H_
+
+#include <stdint.h>
+
+/* persistent hash array mapped trie of 32-bit keys, nodes are shared by refcount */
+
+typedef struct
+{
+  uint32_t key;
+  uint32_t aux;
+  void *value;
+  const void *extra;
+} hamt_leaf_t;
+
+typedef struct _hamt_node hamt_node_t;
+
+/* copy makes a leaf its own when a shared node is copied, release drops a leaf */
+typedef struct
+{
+  void (*copy)(hamt_leaf_t *leaf, void *userdata);
+  void (*release)(hamt_leaf_t *leaf, void *userdata);
+} hamt_ops_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+hamt_node_t* hamt_retain(hamt_node_t *root);
+void hamt_release(hamt_node_t *root, const hamt_ops_t *ops, void *userdata);
+hamt_leaf_t* hamt_get(hamt_node_t *root, uint32_t key);
+hamt_leaf_t* hamt_getunique(hamt_node_t **root, uint32_t key, const hamt_ops_t *ops, void *userdata);
+hamt_leaf_t* hamt_insert(hamt_node_t **root, const hamt_leaf_t *leaf, const hamt_ops_t *ops, void *userdata);
+int hamt_remove(hamt_node_t **root, uint32_t key, const hamt_ops_t *ops, void *userdata);
+hamt_leaf_t* hamt_seek(hamt_node_t *root, uint32_t key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,12 +1,31 @@
 #include "hashmap.h"
 #include "crc.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <math.h>
 
-#define TABLESIZE 503
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#define HASHMAP_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define TABLESIZE 16
+#define GROUPSIZE 16
+#define SMALLSIZE 8
+/* old slots moved into the new table by each add or delete while resizing */
+#define MIGRATESIZE 32
+
+/*
+ * control bytes, a full slot holds the top 7 bits of the hash with the sign bit.
+ * empty is zero, so that a large table comes from calloc without touching pages.
+ */
+#define CTRL_EMPTY ((int8_t)0)
+#define CTRL_DELETED ((int8_t)1)
 
 struct _hashmap_entry
 {
@@ -16,91 +35,270 @@ struct _hashmap_entry
   hashmap_entry_t *next, *prev;
 };
 
-struct _hashmap
+struct _hashmap_chunk
 {
-  hashmap_entry_t *table, *first, *last;
-  unsigned int size, count;
+  struct _hashmap_chunk *next;
+  unsigned int size;
+  hashmap_entry_t entries[1];
 };
+typedef struct _hashmap_chunk hashmap_chunk_t;
 
-static __inline unsigned int _primenumber(unsigned int start)
+struct _hashmap_table
 {
-  int i, j, isnot;
+  int8_t *ctrl; /* size + GROUPSIZE - 1, the first group is cloned at the end */
+  hashmap_entry_t **slots;
+  unsigned int size, used;
+};
+typedef struct _hashmap_table hashmap_table_t;
 
-  for (i = start + 1; i < 0xFFFFFFFF; i += 2)
-  {
-    isnot = 0;
-    for (j = 3; j <= sqrt(i); j += 2)
-    {
-      if (i % j == 0)
-      {
-        isnot = 1;
-        break;
-      }
-    }
+struct _hashmap
+{
+  /* the old table is drained into the new one while resizing */
+  hashmap_table_t table, old;
+  unsigned int migrated, count, loadfactor;
+  hashmap_entry_t *first, *last, *freeentry;
+  /* entries never move, a new map fills the inline ones and scans them */
+  hashmap_entry_t *bump, *bumpend;
+  hashmap_chunk_t *chunks, *chunk;
+  hashmap_entry_t small[SMALLSIZE];
+};
 
-    if(isnot == 0) return i;
-  }
+static __inline unsigned int _mix(hashmap_key_t hash)
+{
+  return hash * 0x9E3779B1u;
+}
 
-  return 0;
+static __inline int8_t _h2(unsigned int mixed)
+{
+  return (int8_t)((mixed >> 25) | 0x80);
 }
 
-hashmap_key_t hashmap_makekey(const char *str)
+static __inline unsigned int _lowbit(unsigned int mask)
 {
-  return crc(str, strlen(str), 0);
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#elif defined(__GNUC__)
+  return __builtin_ctz(mask);
+#else
+  unsigned int index = 0;
+  while (!(mask & 1)) mask >>= 1, ++index;
+  return index;
+#endif
 }
 
-static __inline int hashmap_extend(hashmap_t *hashmap)
+/* full slots before the last empty one of a group */
+static __inline unsigned int _highzeros(unsigned int mask)
 {
-  int size;
-  void *buf;
-  
-  size = _primenumber(hashmap->size * 2);
-  
-  buf = (hashmap_entry_t*)realloc(hashmap->table, sizeof(hashmap_entry_t) * size);
-  if (NULL == buf) return -1;
-  
-  hashmap->size = size;
-  hashmap->table = buf;
+  unsigned int count = 0;
   
-  return 0;
+  for (; !(mask & (1 << (GROUPSIZE - 1))); mask <<= 1) ++count;
+  return count;
 }
 
-static __inline hashmap_key_t hashmap_rehash(hashmap_t *hashmap, const hashmap_key_t firsthash)
+/* bit i is set when ctrl[i] equals the byte */
+static __inline unsigned int _match(const int8_t *ctrl, int8_t byte)
 {
-  hashmap_key_t tablehash = firsthash % hashmap->size;
-  unsigned int k, size = hashmap->size / 2;
-  
-  for (k = 1; k <= size; ++k)
+#ifdef HASHMAP_SSE2
+  __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+  unsigned int i, mask = 0;
+  for (i = 0; i < GROUPSIZE; ++i) if (byte == ctrl[i]) mask |= 1 << i;
+  return mask;
+#endif
+}
+
+/* bit i is set when ctrl[i] is empty or deleted */
+static __inline unsigned int _matchfree(const int8_t *ctrl)
+{
+#ifdef HASHMAP_SSE2
+  __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+  return ~_mm_movemask_epi8(group) & ((1 << GROUPSIZE) - 1);
+#else
+  unsigned int i, mask = 0;
+  for (i = 0; i < GROUPSIZE; ++i) if (0 <= ctrl[i]) mask |= 1 << i;
+  return mask;
+#endif
+}
+
+static __inline void _setctrl(hashmap_table_t *table, unsigned int index, int8_t byte)
+{
+  table->ctrl[index] = byte;
+  if (index < GROUPSIZE - 1) table->ctrl[table->size + index] = byte;
+}
+
+static void _alloctable(hashmap_table_t *table, unsigned int size)
+{
+  table->size = size;
+  table->ctrl = (int8_t*)calloc(size + GROUPSIZE - 1, 1);
+  table->slots = (hashmap_entry_t**)malloc(sizeof(hashmap_entry_t*) * size);
+  table->used = 0;
+}
+
+static void _freetable(hashmap_table_t *table)
+{
+  free(table->ctrl);
+  free(table->slots);
+  table->ctrl = NULL;
+  table->slots = NULL;
+}
+
+/* first empty or deleted slot on the probe sequence */
+static __inline unsigned int _findfree(const hashmap_table_t *table, unsigned int mixed)
+{
+  unsigned int mask = table->size - 1, pos = (mixed ^ (mixed >> 15)) & mask, step = 0, bits;
+
+  for (;;)
   {
-    tablehash += k + (k - 1);
-    if (hashmap->size <= tablehash) tablehash %= hashmap->size;
-    
-    if (NULL == hashmap->table[tablehash].data)
+    bits = _matchfree(table->ctrl + pos);
+    if (bits) return (pos + _lowbit(bits)) & mask;
+    step += GROUPSIZE;
+    pos = (pos + step) & mask;
+  }
+}
+
+/* index of the slot holding the key, or -1 */
+static __inline int _find(const hashmap_table_t *table, hashmap_key_t hash)
+{
+  unsigned int mixed = _mix(hash), mask = table->size - 1;
+  unsigned int pos = (mixed ^ (mixed >> 15)) & mask, step = 0, bits, index;
+  int8_t h2 = _h2(mixed);
+
+  for (;;)
+  {
+    for (bits = _match(table->ctrl + pos, h2); bits; bits &= bits - 1)
     {
-      return tablehash;
+      index = (pos + _lowbit(bits)) & mask;
+      if (hash == table->slots[index]->hashkey) return (int)index;
     }
+    if (_match(table->ctrl + pos, CTRL_EMPTY)) return -1;
+    step += GROUPSIZE;
+    pos = (pos + step) & mask;
   }
-  
-  return -1;
 }
 
-void hashmap_add(hashmap_t *hashmap, const hashmap_key_t hash, const void *rawkey, const void *data)
+static __inline void _place(hashmap_table_t *table, hashmap_entry_t *entry)
 {
-  hashmap_key_t tablehash = hash % hashmap->size;
-  hashmap_entry_t *entry;
-  
-  if (NULL != hashmap->table[tablehash].data)
+  unsigned int mixed = _mix(entry->hashkey), index = _findfree(table, mixed);
+
+  if (CTRL_EMPTY == table->ctrl[index]) ++table->used;
+  _setctrl(table, index, _h2(mixed));
+  table->slots[index] = entry;
+}
+
+static __inline void _deleteslot(hashmap_table_t *table, unsigned int index)
+{
+  unsigned int before, after;
+
+  before = _match(table->ctrl + ((index - GROUPSIZE) & (table->size - 1)), CTRL_EMPTY);
+  after = _match(table->ctrl + index, CTRL_EMPTY);
+
+  // a probe never passed the slot when every group around it has an empty slot
+  if (before && after && _lowbit(after) + _highzeros(before) < GROUPSIZE)
+  {
+    _setctrl(table, index, CTRL_EMPTY);
+    --table->used;
+  }
+  else
+  {
+    _setctrl(table, index, CTRL_DELETED);
+  }
+}
+
+static hashmap_entry_t* _newentry(hashmap_t *hashmap)
+{
+  hashmap_entry_t *entry = hashmap->freeentry;
+  hashmap_chunk_t *chunk;
+  unsigned int size;
+
+  // freed entries are chained by prev, next stays for iterating
+  if (NULL != entry)
   {
-    tablehash = hashmap_rehash(hashmap, tablehash);
-    
-    if (-1 == tablehash) 
+    hashmap->freeentry = entry->prev;
+    return entry;
+  }
+
+  if (hashmap->bump == hashmap->bumpend)
+  {
+    chunk = NULL != hashmap->chunk ? hashmap->chunk->next : hashmap->chunks;
+    if (NULL == chunk)
     {
-      if (hashmap_extend(hashmap)) return;
-      hashmap_add(hashmap, hash, rawkey, data);
-      return;
+      size = NULL != hashmap->chunk ? hashmap->chunk->size * 2 : SMALLSIZE * 2;
+      chunk = (hashmap_chunk_t*)malloc(sizeof(hashmap_chunk_t) + sizeof(hashmap_entry_t) * (size - 1));
+      chunk->next = NULL;
+      chunk->size = size;
+      if (NULL != hashmap->chunk) hashmap->chunk->next = chunk;
+      else hashmap->chunks = chunk;
     }
+    hashmap->chunk = chunk;
+    hashmap->bump = chunk->entries;
+    hashmap->bumpend = chunk->entries + chunk->size;
+  }
+
+  return hashmap->bump++;
+}
+
+/* moves up to limit slots of the old table, and drops it when drained */
+static __inline void _migrate(hashmap_t *hashmap, unsigned int limit)
+{
+  hashmap_table_t *old = &hashmap->old;
+  unsigned int index = hashmap->migrated, end = index + limit;
+
+  if (NULL == old->ctrl) return;
+  if (end > old->size) end = old->size;
+
+  for (; index < end; ++index)
+  {
+    if (0 <= old->ctrl[index]) continue;
+    _place(&hashmap->table, old->slots[index]);
+    _setctrl(old, index, CTRL_DELETED);
   }
-  entry = &hashmap->table[tablehash];
+  hashmap->migrated = end;
+
+  if (end == old->size) _freetable(old);
+}
+
+/* the smallest size keeping count under half of the load factor */
+static __inline unsigned int _tablesize(const hashmap_t *hashmap, unsigned int size)
+{
+  while (hashmap->count * 200 >= size * hashmap->loadfactor) size *= 2;
+  return size;
+}
+
+/*
+ * starts a new table, which drops the tombstones and doubles the size when crowded.
+ * the old table is drained by the following adds and deletes, and what is left
+ * of it when the new table fills up is moved at once.
+ */
+static void _resize(hashmap_t *hashmap)
+{
+  if (NULL != hashmap->old.ctrl) _migrate(hashmap, hashmap->old.size);
+
+  hashmap->old = hashmap->table;
+  hashmap->migrated = 0;
+  _alloctable(&hashmap->table, _tablesize(hashmap, hashmap->table.size));
+}
+
+/* a small map outgrows the inline scan, the entries stay where they are */
+static void _promote(hashmap_t *hashmap)
+{
+  hashmap_entry_t *entry = hashmap->first;
+
+  _alloctable(&hashmap->table, _tablesize(hashmap, TABLESIZE));
+  for (; NULL != entry; entry = entry->next) _place(&hashmap->table, entry);
+}
+
+hashmap_key_t hashmap_makekey(const char *str)
+{
+  return crc(str, strlen(str), 0);
+}
+
+void hashmap_add(hashmap_t *hashmap, const hashmap_key_t hash, const void *rawkey, const void *data)
+{
+  hashmap_entry_t *entry = _newentry(hashmap);
+
   entry->hashkey = hash;
   entry->rawkey = rawkey;
   entry->data = data;
@@ -110,6 +308,18 @@ void hashmap_add(hashmap_t *hashmap, const hashmap_key_t hash, const void *rawke
   if (NULL != entry->prev) entry->prev->next = entry;
   hashmap->last = entry;
   ++hashmap->count;
+
+  if (NULL == hashmap->table.ctrl)
+  {
+    if (SMALLSIZE < hashmap->count) _promote(hashmap);
+    return;
+  }
+
+  _migrate(hashmap, MIGRATESIZE);
+  // keep an empty slot in every probe sequence
+  if ((hashmap->table.used + 1) * 100 > hashmap->table.size * hashmap->loadfactor) _resize(hashmap);
+
+  _place(&hashmap->table, entry);
 }
 
 void* hashmap_getdata(hashmap_t *hashmap, const hashmap_key_t hash)
@@ -120,86 +330,116 @@ void* hashmap_getdata(hashmap_t *hashmap, const hashmap_key_t hash)
 
 void* hashmap_delete(hashmap_t *hashmap, const hashmap_key_t hash)
 {
-  hashmap_key_t tablehash = hash % hashmap->size;
-  unsigned int k = 0, size = hashmap->size / 2;
   hashmap_entry_t *entry;
-  const void *data;
-  
-  while (k <= size)
-  {
-    entry = &hashmap->table[tablehash];
-    if (hash != entry->hashkey)
-    {
-      ++k;
-      if (k) tablehash += k + (k - 1);
-      if (hashmap->size <= tablehash) tablehash %= hashmap->size;
-      continue;
-    }
+  int index;
 
-    --hashmap->count;
-    data = entry->data;
-    entry->data = NULL;
-    if (NULL != entry->prev)
-    {
-      entry->prev->next = entry->next;
-    }
-    if (NULL != entry->next)
-    {
-      entry->next->prev = entry->prev;
-    }
-    if (hashmap->first == entry)
+  if (NULL == hashmap->table.ctrl)
+  {
+    entry = hashmap_getentry(hashmap, hash);
+    if (NULL == entry) return NULL;
+  }
+  else
+  {
+    _migrate(hashmap, MIGRATESIZE);
+    if (0 <= (index = _find(&hashmap->table, hash)))
     {
-      hashmap->first = entry->next;
+      entry = hashmap->table.slots[index];
+      _deleteslot(&hashmap->table, index);
     }
-    if (hashmap->last == entry)
+    else if (NULL != hashmap->old.ctrl && 0 <= (index = _find(&hashmap->old, hash)))
     {
-      hashmap->last = entry->prev;
+      entry = hashmap->old.slots[index];
+      _setctrl(&hashmap->old, index, CTRL_DELETED);
     }
+    else return NULL;
+  }
+  --hashmap->count;
 
-    return (void*)data;
+  // the entry keeps its next pointer, so that deleting while iterating works
+  if (NULL != entry->prev)
+  {
+    entry->prev->next = entry->next;
   }
-  
-  return NULL;
+  if (NULL != entry->next)
+  {
+    entry->next->prev = entry->prev;
+  }
+  if (hashmap->first == entry)
+  {
+    hashmap->first = entry->next;
+  }
+  if (hashmap->last == entry)
+  {
+    hashmap->last = entry->prev;
+  }
+  entry->prev = hashmap->freeentry;
+  hashmap->freeentry = entry;
+
+  return (void*)entry->data;
 }
 
 void hashmap_clear(hashmap_t *hashmap)
 {
-  hashmap_entry_t *entry = hashmap_firstentry(hashmap);
-
-  for (; NULL != entry; entry = hashmap_nextentry(entry))
+  if (NULL != hashmap->table.ctrl)
   {
-    entry->data = NULL;
+    memset(hashmap->table.ctrl, CTRL_EMPTY, hashmap->table.size + GROUPSIZE - 1);
+    hashmap->table.used = 0;
   }
-  
+  if (NULL != hashmap->old.ctrl) _freetable(&hashmap->old);
+
   hashmap->count = 0;
   hashmap->first = NULL;
   hashmap->last = NULL;
+  hashmap->freeentry = NULL;
+  hashmap->bump = hashmap->small;
+  hashmap->bumpend = hashmap->small + SMALLSIZE;
+  hashmap->chunk = NULL;
 }
 
 hashmap_t* hashmap_open(void)
 {
   hashmap_t *hashmap = (hashmap_t*)malloc(sizeof(hashmap_t));
-  hashmap_entry_t *entry;
-  unsigned int i;
 
-  hashmap->size = TABLESIZE;
-  hashmap->count = 0;
-  hashmap->first = NULL;
-  hashmap->last = NULL;
-  hashmap->table = (hashmap_entry_t*)malloc(sizeof(hashmap_entry_t) * hashmap->size);
+  hashmap->table.ctrl = NULL;
+  hashmap->table.slots = NULL;
+  hashmap->table.size = 0;
+  hashmap->table.used = 0;
+  hashmap->old = hashmap->table;
+  hashmap->migrated = 0;
+  hashmap->loadfactor = HASHMAP_LOADFACTOR;
+  hashmap->chunks = NULL;
+  hashmap_clear(hashmap);
 
-  entry = hashmap->table;
-  for (i = 0; i < hashmap->size; ++i, ++entry) entry->data = NULL;
-  
   return hashmap;
 }
 
 void hashmap_close(hashmap_t *hashmap)
 {
-  free(hashmap->table);
+  hashmap_chunk_t *chunk = hashmap->chunks, *next;
+
+  if (NULL != hashmap->table.ctrl) _freetable(&hashmap->table);
+  if (NULL != hashmap->old.ctrl) _freetable(&hashmap->old);
+  for (; NULL != chunk; chunk = next)
+  {
+    next = chunk->next;
+    free(chunk);
+  }
   free(hashmap);
 }
 
+void hashmap_setloadfactor(hashmap_t *hashmap, unsigned int percent)
+{
+  if (percent < HASHMAP_MINLOADFACTOR) percent = HASHMAP_MINLOADFACTOR;
+  if (percent > HASHMAP_MAXLOADFACTOR) percent = HASHMAP_MAXLOADFACTOR;
+  hashmap->loadfactor = percent;
+}
+
+/* moves what is left of the old table, so the map holds a single table */
+void hashmap_finishresize(hashmap_t *hashmap)
+{
+  _migrate(hashmap, hashmap->old.size);
+}
+
 unsigned int hashmap_count(hashmap_t *hashmap)
 {
   return hashmap->count;
@@ -217,19 +457,22 @@ hashmap_entry_t* hashmap_lastentry(hashmap_t *hashmap)
 
 hashmap_entry_t* hashmap_getentry(hashmap_t *hashmap, hashmap_key_t hash)
 {
-  hashmap_key_t tablehash = hash % hashmap->size;
-  unsigned int k = 0, size = hashmap->size / 2;
   hashmap_entry_t *entry;
-  
-  while (k <= size)
+  int index;
+
+  if (NULL == hashmap->table.ctrl)
   {
-    entry = &hashmap->table[tablehash];
-    if (hash == entry->hashkey) return entry;
-    ++k;
-    if (k) tablehash += k + (k - 1);
-    if (hashmap->size <= tablehash) tablehash %= hashmap->size;
+    for (entry = hashmap->first; NULL != entry; entry = entry->next)
+    {
+      if (hash == entry->hashkey) return entry;
+    }
+    return NULL;
   }
-  
+
+  // a lookup only reads, so a map nobody changes can be read by several threads
+  if (0 <= (index = _find(&hashmap->table, hash))) return hashmap->table.slots[index];
+  if (NULL != hashmap->old.ctrl && 0 <= (index = _find(&hashmap->old, hash))) return hashmap->old.slots[index];
+
   return NULL;
 }
 
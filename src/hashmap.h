@@ -4,6 +4,13 @@
 struct _hashmap;
 struct _hashmap_entry;
 
+/* percentage of the table filled before it is resized */
+#ifndef HASHMAP_LOADFACTOR
+#define HASHMAP_LOADFACTOR 87
+#endif
+#define HASHMAP_MINLOADFACTOR 10
+#define HASHMAP_MAXLOADFACTOR 95
+
 typedef unsigned int  hashmap_key_t;
 typedef struct _hashmap hashmap_t;
 typedef struct _hashmap_entry hashmap_entry_t;
@@ -21,6 +28,8 @@ void hashmap_clear(hashmap_t *hashtable);
 hashmap_t* hashmap_open(void);
 void hashmap_close(hashmap_t *hashmap);
 unsigned int hashmap_count(hashmap_t *hashmap);
+void hashmap_setloadfactor(hashmap_t *hashmap, unsigned int percent);
+void hashmap_finishresize(hashmap_t *hashmap);
   
 hashmap_entry_t* hashmap_firstentry(hashmap_t *hashmap);
 hashmap_entry_t* hashmap_lastentry(hashmap_t *hashmap);
@@ -8,6 +8,7 @@
 #include "ril_compiler.h"
 #include "ril_utils.h"
 #include "stack.h"
+#include "crc.h"
 
 #define CALC_BUFFER_SIZE 1024
 
@@ -16,7 +17,7 @@ static buffer_t* _parameter_open(int size)
   return buffer_open(sizeof(ril_parameter_t), size);
 }
 
-static void _parameter_close(buffer_t *buffer)
+static void _parameter_clear(buffer_t *buffer)
 {
   int i;
   ril_parameter_t *param;
@@ -26,6 +27,12 @@ static void _parameter_close(buffer_t *buffer)
     param = (ril_parameter_t*)buffer_index(buffer, i);
     buffer_close(param->valuebuffer);
   }
+  buffer_clear(buffer);
+}
+
+static void _parameter_close(buffer_t *buffer)
+{
+  _parameter_clear(buffer);
   buffer_close(buffer);
 }
 
@@ -59,11 +66,52 @@ void ril_free(void *ptr)
   free(ptr);
 }
 
+void ril_getallocstats(RILVM vm, ril_allocstats_t *stats)
+{
+  stats->allocs = vm->slab->stats.allocs;
+  stats->frees = vm->slab->stats.frees;
+  stats->pages = vm->slab->stats.pages;
+  stats->large = vm->slab->stats.large;
+}
+
+// the boolean names, read by calcs at compile time too
+static void _setconstants(RILVM vm)
+{
+  ril_var_t *var;
+  
+  var = ril_createvar(vm, NULL, "TRUE");
+  ril_setinteger(vm, var, 1);
+  ril_setconst(var);
+  var = ril_createvar(vm, NULL, "true");
+  ril_setinteger(vm, var, 1);
+  ril_setconst(var);
+  
+  var = ril_createvar(vm, NULL, "YES");
+  ril_setinteger(vm, var, 1);
+  ril_setconst(var);
+  var = ril_createvar(vm, NULL, "yes");
+  ril_setinteger(vm, var, 1);
+  ril_setconst(var);
+  
+  var = ril_createvar(vm, NULL, "FALSE");
+  ril_setinteger(vm, var, 0);
+  ril_setconst(var);
+  var = ril_createvar(vm, NULL, "false");
+  ril_setinteger(vm, var, 0);
+  ril_setconst(var);
+  
+  var = ril_createvar(vm, NULL, "NO");
+  ril_setinteger(vm, var, 0);
+  ril_setconst(var);
+  var = ril_createvar(vm, NULL, "no");
+  ril_setinteger(vm, var, 0);
+  ril_setconst(var);
+}
+
 RILVM ril_open(void)
 {
   RILVM vm = (RILVM)ril_malloc(sizeof(ril_vm_t));
   ril_tag_t *t, *t2, *t3, *t4;
-  ril_var_t *var;
   
   ril_seterrorhandler(vm, ril_errorhandler);
   
@@ -71,12 +119,28 @@ RILVM ril_open(void)
   vm->loadfile[0] = '\0';
   
   vm->code.hascode = false;
+  vm->code.literals = hashmap_open();
+  vm->code.literaltexts = hashmap_open();
+  vm->code.running = 0;
+  vm->code.retired = buffer_open(sizeof(void*), 4);
   vm->paircmds = NULL;
 
   ril_initvar(vm, &vm->globalvar);
   ril_fetchglobalvar(vm);
 
   vm->tagmap = hashmap_open();
+  vm->basetagmap = NULL;
+  vm->includecache = hashmap_open();
+  vm->keymap = hashmap_open();
+  vm->indexkeys = hashmap_open();
+  vm->indexkeysize = 0;
+  vm->slab = slab_open();
+  vm->cmdmap = NULL;
+  vm->cmdmap_size = 0;
+  vm->memoid = 0;
+  ril_opencache(vm);
+  vm->optimize.level = RIL_OPTIMIZE_FLOW;
+  memset(&vm->optimize.stats, 0, sizeof(vm->optimize.stats));
   
   vm->calc = calc_open(CALC_BUFFER_SIZE);
 
@@ -119,8 +183,22 @@ RILVM ril_open(void)
   ril_setpairtag(t3, t4);
   RIL_SETSTORAGE(t, int);
   
+  t = RIL_REGISTERTAG(vm, switch, "value");
+  t2 = RIL_REGISTERTAG(vm, case, "value");
+  t3 = RIL_REGISTERTAG(vm, default, NULL);
+  t4 = RIL_REGISTERTAG(vm, endswitch, NULL);
+  RIL_SETCOMPILEHANDLER(t2, case);
+  ril_setpairtag(t, t2);
+  ril_setpairtag(t, t3);
+  ril_setpairtag(t, t4);
+  ril_setpairtag(t2, t2);
+  ril_setpairtag(t2, t3);
+  ril_setpairtag(t2, t4);
+  ril_setpairtag(t3, t4);
+  
   t2 = RIL_REGISTERTAG(vm, endmacro, NULL);
-  t = RIL_REGISTERTAG(vm, macro, "name, params = \"\", vars = \"\"");
+  RIL_REGISTERTAG(vm, returnvalue, "value");
+  t = RIL_REGISTERTAG(vm, macro, "name, params = \"\", vars = \"\", pure = false");
   RIL_SETCOMPILEHANDLER(t, macro);
   RIL_SETSTORAGE(t, null);
   ril_setpairtag(t, t2);
@@ -130,6 +208,13 @@ RILVM ril_open(void)
   
   t = RIL_REGISTERTAG(vm, while, "value");
   t2 = RIL_REGISTERTAG(vm, endwhile, NULL);
+  RIL_SETCOMPILEHANDLER(t2, endloop);
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, null);
+  /* a loop with invariant calcs hoisted out of its body */
+  t = ril_registertag(vm, "while", "value, hoist", RIL_CALLFUNC(hoistwhile));
   ril_setpairtag(t, t2);
   ril_setchildtag(t, t3);
   ril_setchildtag(t, t4);
@@ -137,6 +222,12 @@ RILVM ril_open(void)
   
   t = RIL_REGISTERTAG(vm, do, NULL);
   t2 = RIL_REGISTERTAG(vm, dowhile, "value");
+  RIL_SETCOMPILEHANDLER(t2, endloop);
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, null);
+  t = ril_registertag(vm, "do", "hoist", RIL_CALLFUNC(hoistdo));
   ril_setpairtag(t, t2);
   ril_setchildtag(t, t3);
   ril_setchildtag(t, t4);
@@ -144,6 +235,7 @@ RILVM ril_open(void)
   
   t = RIL_REGISTERTAG(vm, foreach, "&from, &item, &key");
   t2 = RIL_REGISTERTAG(vm, endforeach, NULL);
+  RIL_SETCOMPILEHANDLER(t2, endloop);
   ril_setpairtag(t, t2);
   ril_setchildtag(t, t3);
   ril_setchildtag(t, t4);
@@ -153,6 +245,40 @@ RILVM ril_open(void)
   ril_setchildtag(t, t3);
   ril_setchildtag(t, t4);
   RIL_SETSTORAGE(t, foreach);
+  t = ril_registertag(vm, "foreach", "&from, &item, &key, hoist", RIL_CALLFUNC(hoistforeach));
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, foreach);
+  t = ril_registertag(vm, "foreach", "&from, &item, hoist", RIL_CALLFUNC(hoistforeach));
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, foreach);
+  /* a range of integers, counted like [for] */
+  t = ril_registertag(vm, "foreach", "&item, from, to, step = 1", RIL_CALLFUNC(for));
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, for);
+  t = ril_registertag(vm, "foreach", "&item, from, to, step = 1, hoist", RIL_CALLFUNC(hoistfor));
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, for);
+  
+  t = RIL_REGISTERTAG(vm, for, "&var, from, to, step = 1");
+  t2 = RIL_REGISTERTAG(vm, endfor, NULL);
+  RIL_SETCOMPILEHANDLER(t2, endloop);
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, for);
+  t = ril_registertag(vm, "for", "&var, from, to, step = 1, hoist", RIL_CALLFUNC(hoistfor));
+  ril_setpairtag(t, t2);
+  ril_setchildtag(t, t3);
+  ril_setchildtag(t, t4);
+  RIL_SETSTORAGE(t, for);
   
   t = ril_registertag(vm, "include", "file", NULL);
   RIL_SETCOMPILEHANDLER(t, include);
@@ -162,6 +288,13 @@ RILVM ril_open(void)
   ril_setpairtag(t, t2);
   RIL_SETSTORAGE(t, stream);
   
+  t = RIL_REGISTERTAG(vm, cache, "key");
+  t2 = RIL_REGISTERTAG(vm, endcache, NULL);
+  ril_setpairtag(t, t2);
+  RIL_SETSTORAGE(t, cache);
+  RIL_REGISTERTAG(vm, uncache, "key");
+  ril_registertag(vm, "uncache", NULL, RIL_CALLFUNC(uncacheall));
+  
   t = ril_registertag(vm, "literal", NULL, NULL);
   t2 = ril_registertag(vm, "endliteral", NULL, NULL);
   RIL_SETCOMPILEHANDLER(t, literal);
@@ -179,33 +312,7 @@ RILVM ril_open(void)
   vm->mainstate = ril_newstate(vm);
   ril_setmainstate(vm);
 
-  var = ril_createvar(vm, NULL, "TRUE");
-  ril_setinteger(vm, var, 1);
-  ril_setconst(var);
-  var = ril_createvar(vm, NULL, "true");
-  ril_setinteger(vm, var, 1);
-  ril_setconst(var);
-  
-  var = ril_createvar(vm, NULL, "YES");
-  ril_setinteger(vm, var, 1);
-  ril_setconst(var);
-  var = ril_createvar(vm, NULL, "yes");
-  ril_setinteger(vm, var, 1);
-  ril_setconst(var);
-  
-  var = ril_createvar(vm, NULL, "FALSE");
-  ril_setinteger(vm, var, 0);
-  ril_setconst(var);
-  var = ril_createvar(vm, NULL, "false");
-  ril_setinteger(vm, var, 0);
-  ril_setconst(var);
-  
-  var = ril_createvar(vm, NULL, "NO");
-  ril_setinteger(vm, var, 0);
-  ril_setconst(var);
-  var = ril_createvar(vm, NULL, "no");
-  ril_setinteger(vm, var, 0);
-  ril_setconst(var);
+  _setconstants(vm);
   
   ril_setdelimiter(vm, "[", "]");
   
@@ -216,10 +323,74 @@ void ril_close(RILVM vm)
 {
   ril_deletestate(vm->mainstate);
   ril_freecode(vm);
+  ril_closecache(vm);
+  hashmap_close(vm->code.literals);
+  hashmap_close(vm->code.literaltexts);
+  ril_freeretiredcode(vm);
+  buffer_close(vm->code.retired);
   ril_free(vm->paircmds);
   calc_close(vm->calc);
   ril_clearvar(vm, &vm->globalvar);
   ril_deletetags(vm);
+  ril_clearincludecache(vm);
+  hashmap_close(vm->includecache);
+  ril_detachkeys(vm);
+  hashmap_close(vm->keymap);
+  hashmap_close(vm->indexkeys);
+  slab_close(vm->slab);
+  ril_free(vm);
+}
+
+RILVM ril_openoverlay(RILVM vm)
+{
+  RILVM overlay = (RILVM)ril_malloc(sizeof(ril_vm_t));
+  
+  memcpy(overlay, vm, sizeof(ril_vm_t));
+  
+  overlay->basetagmap = vm->tagmap;
+  // the free lists have no lock, each worker allocates from its own
+  overlay->slab = slab_open();
+  overlay->tagmap = hashmap_open();
+  overlay->includecache = hashmap_open();
+  overlay->keymap = hashmap_open();
+  overlay->indexkeys = hashmap_open();
+  overlay->indexkeysize = 0;
+  overlay->calc = calc_open(CALC_BUFFER_SIZE);
+  overlay->code.hascode = false;
+  overlay->code.literals = hashmap_open();
+  overlay->code.literaltexts = hashmap_open();
+  overlay->code.running = 0;
+  overlay->code.retired = buffer_open(sizeof(void*), 4);
+  overlay->paircmds = NULL;
+  ril_opencache(overlay);
+  
+  ril_initvar(overlay, &overlay->globalvar);
+  ril_fetchglobalvar(overlay);
+  
+  overlay->mainstate = ril_newstate(overlay);
+  ril_setmainstate(overlay);
+  _setconstants(overlay);
+  
+  return overlay;
+}
+
+void ril_closeoverlay(RILVM vm)
+{
+  ril_deletestate(vm->mainstate);
+  ril_closecache(vm);
+  calc_close(vm->calc);
+  ril_clearvar(vm, &vm->globalvar);
+  ril_releaseliterals(vm);
+  hashmap_close(vm->code.literals);
+  hashmap_close(vm->code.literaltexts);
+  buffer_close(vm->code.retired);
+  ril_deletetags(vm);
+  ril_clearincludecache(vm);
+  hashmap_close(vm->includecache);
+  ril_detachkeys(vm);
+  hashmap_close(vm->keymap);
+  hashmap_close(vm->indexkeys);
+  slab_close(vm->slab);
   ril_free(vm);
 }
 
@@ -244,18 +415,374 @@ void ril_deletetags(RILVM vm)
   hashmap_close(vm->tagmap);
 }
 
-void ril_deletemacros(RILVM vm)
+ril_tag_t* ril_registermacro(RILVM vm, const char *name, const char *args)
+{
+  ril_tag_t *t = ril_getregisteredtag(vm, name, args);
+  
+  if (NULL == t)
+  {
+    t = ril_registertag(vm, name, args, RIL_CALLFUNC(callmacro));
+    RIL_SETSTORAGE(t, callmacro);
+  }
+  
+  return t;
+}
+
+/* the results cache of a pure macro, emptied when the tag is bound to another definition */
+ril_memo_t* ril_setmemo(RILVM vm, ril_tag_t *tag)
+{
+  ril_memo_t *memo = tag->memo;
+  
+  if (NULL != memo)
+  {
+    if (memo->macro != ril_getshareddata(tag)) ril_clearmemo(memo);
+    memo->macro = ril_getshareddata(tag);
+    return memo;
+  }
+  
+  memo = tag->memo = (ril_memo_t*)ril_malloc(sizeof(ril_memo_t));
+  memo->vm = vm;
+  memo->id = ++vm->memoid;
+  memo->macro = ril_getshareddata(tag);
+  memo->entries = hashmap_open();
+  memo->front = memo->back = NULL;
+  memo->key = buffer_open(1, 256);
+  memset(&memo->stats, 0, sizeof(memo->stats));
+  
+  return memo;
+}
+
+static __inline void _unlinkmemo(ril_memo_t *memo, ril_memoentry_t *entry)
+{
+  if (NULL != entry->prev) entry->prev->next = entry->next;
+  else memo->front = entry->next;
+  if (NULL != entry->next) entry->next->prev = entry->prev;
+  else memo->back = entry->prev;
+}
+
+static __inline void _pushmemo(ril_memo_t *memo, ril_memoentry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = memo->front;
+  if (NULL != memo->front) memo->front->prev = entry;
+  else memo->back = entry;
+  memo->front = entry;
+}
+
+void ril_clearmemo(ril_memo_t *memo)
+{
+  ril_memoentry_t *entry, *next;
+  
+  for (entry = memo->front; NULL != entry; entry = next)
+  {
+    next = entry->next;
+    ril_deletememoentry(memo->vm, entry);
+  }
+  memo->front = memo->back = NULL;
+  hashmap_clear(memo->entries);
+  memo->stats.entries = 0;
+  // the calls still running belong to the old results
+  memo->id = ++memo->vm->memoid;
+}
+
+void ril_closememo(ril_memo_t *memo)
+{
+  ril_clearmemo(memo);
+  hashmap_close(memo->entries);
+  buffer_close(memo->key);
+  ril_free(memo);
+}
+
+/* the result of the same arguments, or NULL with the key of the arguments left for ril_newmemoentry */
+ril_memoentry_t* ril_findmemo(RILVM vm, ril_tag_t *tag)
+{
+  ril_memo_t *memo = tag->memo;
+  ril_memoentry_t *entry;
+  int32_t argc = vm->state->argc;
+  int i;
+  
+  buffer_clear(memo->key);
+  buffer_write(memo->key, &argc, sizeof(argc));
+  for (i = 0; i < argc; ++i) ril_writevar(memo->key, ril_getargument(vm, i));
+  
+  entry = (ril_memoentry_t*)hashmap_getdata(memo->entries, crc(buffer_front(memo->key), buffer_size(memo->key), 0));
+  if (NULL == entry || entry->size != buffer_size(memo->key) || 0 != memcmp(entry->key, buffer_front(memo->key), entry->size))
+  {
+    ++memo->stats.misses;
+    return NULL;
+  }
+  
+  ++memo->stats.hits;
+  if (memo->front != entry)
+  {
+    _unlinkmemo(memo, entry);
+    _pushmemo(memo, entry);
+  }
+  
+  return entry;
+}
+
+/* the call of the missed key, owned by the caller until its result is stored */
+ril_memoentry_t* ril_newmemoentry(RILVM vm, ril_tag_t *tag)
+{
+  ril_memo_t *memo = tag->memo;
+  int size = buffer_size(memo->key);
+  ril_memoentry_t *entry = (ril_memoentry_t*)ril_malloc(offsetof(ril_memoentry_t, key) + size);
+  
+  entry->prev = entry->next = NULL;
+  entry->signature = ril_signature(tag);
+  entry->memoid = memo->id;
+  entry->hash = crc(buffer_front(memo->key), size, 0);
+  ril_initvar(vm, &entry->value);
+  entry->size = size;
+  memcpy(entry->key, buffer_front(memo->key), size);
+  
+  return entry;
+}
+
+/* arrays are copied whole, the elements of a shared one are written through */
+static void _clonememo(RILVM vm, ril_var_t *dest, ril_var_t *src)
+{
+  buffer_t *buffer;
+  
+  if (!ril_isarray(src))
+  {
+    ril_copyvar(vm, dest, src);
+    return;
+  }
+  
+  buffer = buffer_open(1, 256);
+  ril_writevar(buffer, src);
+  ril_clearvar(vm, dest);
+  ril_readvar(vm, dest, buffer_front(buffer));
+  buffer_close(buffer);
+}
+
+/* returns the result of a hit to the caller */
+void ril_returnmemo(RILVM vm, ril_memoentry_t *entry)
+{
+  ril_var_t var;
+  
+  if (ril_isnull(&entry->value)) return;
+  
+  ril_initvar(vm, &var);
+  _clonememo(vm, &var, &entry->value);
+  ril_return(vm, &var);
+  ril_clearvar(vm, &var);
+}
+
+/* keeps the result, NULL for none, unless the macro has been redefined meanwhile */
+void ril_storememo(RILVM vm, ril_memoentry_t *entry, ril_var_t *value)
+{
+  ril_tag_t *tag = ril_getregisteredtag2(vm, entry->signature);
+  ril_memo_t *memo = NULL != tag ? tag->memo : NULL;
+  ril_memoentry_t *old;
+  
+  if (NULL == memo || memo->id != entry->memoid)
+  {
+    ril_deletememoentry(vm, entry);
+    return;
+  }
+  
+  if (NULL != value) _clonememo(vm, &entry->value, value);
+  
+  // a colliding key gives its place up
+  old = (ril_memoentry_t*)hashmap_delete(memo->entries, entry->hash);
+  if (NULL != old)
+  {
+    _unlinkmemo(memo, old);
+    ril_deletememoentry(vm, old);
+    --memo->stats.entries;
+  }
+  hashmap_add(memo->entries, entry->hash, NULL, entry);
+  _pushmemo(memo, entry);
+  ++memo->stats.entries;
+  
+  if (RIL_MEMO_SIZE < memo->stats.entries)
+  {
+    old = memo->back;
+    _unlinkmemo(memo, old);
+    hashmap_delete(memo->entries, old->hash);
+    ril_deletememoentry(vm, old);
+    --memo->stats.entries;
+    ++memo->stats.evictions;
+  }
+}
+
+void ril_deletememoentry(RILVM vm, ril_memoentry_t *entry)
+{
+  ril_clearvar(vm, &entry->value);
+  ril_free(entry);
+}
+
+RILRESULT ril_getmemostats(ril_tag_t *tag, ril_memostats_t *stats)
+{
+  if (NULL == tag || NULL == tag->memo) return RIL_ERROR;
+  
+  *stats = tag->memo->stats;
+  
+  return RIL_OK;
+}
+
+void ril_opencache(RILVM vm)
+{
+  vm->cache.entries = hashmap_open();
+  vm->cache.front = vm->cache.back = NULL;
+  vm->cache.budget = RIL_CACHE_BUDGET;
+  memset(&vm->cache.stats, 0, sizeof(vm->cache.stats));
+}
+
+static __inline void _unlinkcache(RILVM vm, ril_cacheentry_t *entry)
+{
+  if (NULL != entry->prev) entry->prev->next = entry->next;
+  else vm->cache.front = entry->next;
+  if (NULL != entry->next) entry->next->prev = entry->prev;
+  else vm->cache.back = entry->prev;
+}
+
+static __inline void _pushcache(RILVM vm, ril_cacheentry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = vm->cache.front;
+  if (NULL != vm->cache.front) vm->cache.front->prev = entry;
+  else vm->cache.back = entry;
+  vm->cache.front = entry;
+}
+
+static void _deletecache(RILVM vm, ril_cacheentry_t *entry)
+{
+  _unlinkcache(vm, entry);
+  hashmap_delete(vm->cache.entries, entry->hash);
+  vm->cache.stats.bytes -= entry->size;
+  --vm->cache.stats.entries;
+  ril_free(entry);
+}
+
+/* drops the least recently used output until the entries fit in the budget */
+static void _fitcache(RILVM vm)
+{
+  while (NULL != vm->cache.back && vm->cache.budget < (int)vm->cache.stats.bytes)
+  {
+    _deletecache(vm, vm->cache.back);
+    ++vm->cache.stats.evictions;
+  }
+}
+
+void ril_clearcache(RILVM vm)
+{
+  while (NULL != vm->cache.front) _deletecache(vm, vm->cache.front);
+}
+
+void ril_closecache(RILVM vm)
+{
+  ril_clearcache(vm);
+  hashmap_close(vm->cache.entries);
+}
+
+const ril_cacheentry_t* ril_findcache(RILVM vm, const char *key, int keysize)
+{
+  ril_cacheentry_t *entry = (ril_cacheentry_t*)hashmap_getdata(vm->cache.entries, crc(key, keysize, 0));
+  
+  if (NULL == entry || entry->keysize != keysize || 0 != memcmp(entry->data, key, keysize))
+  {
+    ++vm->cache.stats.misses;
+    return NULL;
+  }
+  
+  ++vm->cache.stats.hits;
+  if (vm->cache.front != entry)
+  {
+    _unlinkcache(vm, entry);
+    _pushcache(vm, entry);
+  }
+  
+  return entry;
+}
+
+/* keeps the key followed by its output, unless it alone is over the budget */
+void ril_storecache(RILVM vm, const void *data, int keysize, int size)
+{
+  ril_cacheentry_t *entry, *old;
+  
+  if (vm->cache.budget < size) return;
+  
+  entry = (ril_cacheentry_t*)ril_malloc(offsetof(ril_cacheentry_t, data) + size);
+  entry->hash = crc(data, keysize, 0);
+  entry->keysize = keysize;
+  entry->size = size;
+  memcpy(entry->data, data, size);
+  
+  // a colliding key gives its place up
+  old = (ril_cacheentry_t*)hashmap_getdata(vm->cache.entries, entry->hash);
+  if (NULL != old) _deletecache(vm, old);
+  hashmap_add(vm->cache.entries, entry->hash, NULL, entry);
+  _pushcache(vm, entry);
+  vm->cache.stats.bytes += size;
+  ++vm->cache.stats.entries;
+  
+  _fitcache(vm);
+}
+
+void ril_removecache(RILVM vm, const char *key, int keysize)
+{
+  ril_cacheentry_t *entry = (ril_cacheentry_t*)hashmap_getdata(vm->cache.entries, crc(key, keysize, 0));
+  
+  if (NULL != entry && entry->keysize == keysize && 0 == memcmp(entry->data, key, keysize)) _deletecache(vm, entry);
+}
+
+void ril_setcachebudget(RILVM vm, int bytes)
+{
+  vm->cache.budget = bytes;
+  _fitcache(vm);
+}
+
+/* the output of the key, or of every key for NULL, is rendered again */
+void ril_uncache(RILVM vm, const char *key)
+{
+  if (NULL == key) ril_clearcache(vm);
+  else ril_removecache(vm, key, strlen(key));
+}
+
+void ril_getcachestats(RILVM vm, ril_cachestats_t *stats)
+{
+  *stats = vm->cache.stats;
+}
+
+/* compiles after this run the pass up to the level */
+void ril_setoptimize(RILVM vm, int level)
+{
+  vm->optimize.level = level;
+}
+
+void ril_getoptimizestats(RILVM vm, ril_optimizestats_t *stats)
+{
+  *stats = vm->optimize.stats;
+}
+
+static void _deletemacros(RILVM vm, bool unboundonly)
 {
   hashmap_entry_t *entry = hashmap_firstentry(vm->tagmap);
   for (; NULL != entry; entry = hashmap_nextentry(entry))
   {
     ril_tag_t *tag = (ril_tag_t*)hashmap_getdatabyentry(entry);
     if (tag->execute_handler != RIL_CALLFUNC(callmacro)) continue;
+    if (unboundonly && NULL != ril_getshareddata(tag)) continue;
     hashmap_delete(vm->tagmap, hashmap_getkeybyentry(entry));
     ril_deletetag(tag);
   }
 }
 
+void ril_deletemacros(RILVM vm)
+{
+  _deletemacros(vm, false);
+}
+
+// macros registered by the compiler, the running program keeps its own
+void ril_deletecompiledmacros(RILVM vm)
+{
+  _deletemacros(vm, true);
+}
+
 ril_tag_t* ril_createtag(RILVM vm, ril_signature_t signature)
 {
   ril_tag_t *tag = ril_getregisteredtag2(vm, signature);
@@ -276,6 +803,8 @@ void ril_inittag(ril_tag_t *t)
   t->name[0] = '\0';
   t->hasparent = false;
   t->refcount = 0;
+  t->userdata = NULL;
+  t->memo = NULL;
   t->param_buffer = _parameter_open(5);
   t->pair_buffer = buffer_open(sizeof(ril_pairtag_t), 5);
   t->child_buffer = buffer_open(sizeof(ril_childtag_t), 5);
@@ -287,6 +816,7 @@ void ril_inittag(ril_tag_t *t)
 
 void ril_deletetag(ril_tag_t *t)
 {
+  if (NULL != t->memo) ril_closememo(t->memo);
   _parameter_close(t->param_buffer);
   buffer_close(t->pair_buffer);
   buffer_close(t->child_buffer);
@@ -372,6 +902,12 @@ const char* ril_getparametervalue(const buffer_t *buffer, int index)
   return (char*)buffer_front(param->valuebuffer);
 }
 
+/* the buffer and the values ril_parseparameters put in it */
+void ril_closeparameters(buffer_t *buffer)
+{
+  _parameter_close(buffer);
+}
+
 RILRESULT ril_parseparameters(buffer_t *buffer, const char *args)
 {
   ril_parameter_t *param;
@@ -498,7 +1034,7 @@ ril_tag_t* ril_registertag(RILVM vm, const char *name, const char *args, RILFUNC
   if ('\0' == t->name[0])
   {
     strcpy(t->name, name);
-    buffer_clear(parameter);
+    _parameter_clear(parameter);
     ril_parseparameters(parameter, args);
     if (RIL_FAILED(_addparameters(vm, t, parameter)))
     {
@@ -524,19 +1060,43 @@ ril_tag_t* ril_getregisteredtag(RILVM vm, const char *name, const char *args)
 
 ril_tag_t* ril_getregisteredtag2(RILVM vm, ril_signature_t signature)
 {
-  return (ril_tag_t*)hashmap_getdata(vm->tagmap, signature);
+  ril_tag_t *tag = (ril_tag_t*)hashmap_getdata(vm->tagmap, signature);
+  
+  if (NULL == tag && NULL != vm->basetagmap)
+  {
+    tag = (ril_tag_t*)hashmap_getdata(vm->basetagmap, signature);
+  }
+  
+  return tag;
 }
 
 ril_tag_t* ril_getregisteredtag3(RILVM vm, const char *name, const char *args, bool hasnonamearg, bool iscmp)
 {
-  int j, k, hitnum;
+  int i;
   buffer_t *parameter;
-  hashmap_entry_t *entry;
+  ril_crc_t namehashes[RIL_ARGUMENT_SIZE];
+  ril_tag_t *tag;
   
   parameter = _parameter_open(16);
   ril_parseparameters(parameter, args);
   
-  entry = hashmap_firstentry(vm->tagmap);
+  for (i = 0; i < buffer_size(parameter) && i < RIL_ARGUMENT_SIZE; ++i)
+  {
+    namehashes[i] = ((ril_parameter_t*)buffer_index(parameter, i))->namehash;
+  }
+  tag = ril_findtag(vm, name, namehashes, i, hasnonamearg, iscmp);
+
+  _parameter_close(parameter);
+  
+  return tag;
+}
+
+static __inline ril_tag_t* _findtag(hashmap_t *tagmap, const char *name, const ril_crc_t *namehashes, int size, bool hasnonamearg, bool iscmp)
+{
+  int j, k, hitnum;
+  hashmap_entry_t *entry;
+  
+  entry = hashmap_firstentry(tagmap);
   for (; NULL != entry; entry = hashmap_nextentry(entry))
   {
     ril_tag_t *tag = (ril_tag_t*)hashmap_getdatabyentry(entry);
@@ -544,11 +1104,11 @@ ril_tag_t* ril_getregisteredtag3(RILVM vm, const char *name, const char *args, b
     
     if (iscmp)
     {
-      if (buffer_size(parameter) + hasnonamearg != argsize) continue;
+      if (size + hasnonamearg != argsize) continue;
     }
     else
     {
-      if (buffer_size(parameter) + hasnonamearg > argsize) continue;
+      if (size + hasnonamearg > argsize) continue;
     }
     if (strcmp(tag->name, name)) continue;
     
@@ -556,9 +1116,9 @@ ril_tag_t* ril_getregisteredtag3(RILVM vm, const char *name, const char *args, b
     for (j = hasnonamearg; j < argsize; ++j)
     {
       ril_parameter_t *arg = (ril_parameter_t*)buffer_index(tag->param_buffer, j);
-      for (k = buffer_size(parameter) - 1; 0 <= k; --k)
+      for (k = size - 1; 0 <= k; --k)
       {
-        if (arg->namehash == ((ril_parameter_t*)buffer_index(parameter, k))->namehash) break;
+        if (arg->namehash == namehashes[k]) break;
       }
       if (0 > k)
       {
@@ -567,18 +1127,24 @@ ril_tag_t* ril_getregisteredtag3(RILVM vm, const char *name, const char *args, b
       }
       else ++hitnum;
     }
-    if (j == argsize && hitnum == buffer_size(parameter))
-    {
-      _parameter_close(parameter);
-      return tag;
-    }
+    if (j == argsize && hitnum == size) return tag;
   }
-
-  _parameter_close(parameter);
   
   return NULL;
 }
 
+ril_tag_t* ril_findtag(RILVM vm, const char *name, const ril_crc_t *namehashes, int size, bool hasnonamearg, bool iscmp)
+{
+  ril_tag_t *tag = _findtag(vm->tagmap, name, namehashes, size, hasnonamearg, iscmp);
+  
+  if (NULL == tag && NULL != vm->basetagmap)
+  {
+    tag = _findtag(vm->basetagmap, name, namehashes, size, hasnonamearg, iscmp);
+  }
+  
+  return tag;
+}
+
 RILFUNCTION ril_getexecutehandler(ril_tag_t *tag)
 {
   return tag->execute_handler;
@@ -739,6 +1305,7 @@ ril_signature_t ril_cmdid2signature(RILVM vm, ril_cmdid_t cmdid)
 static __inline int _docmd(RILVM vm, ril_vmcmd_t *cmd)
 {
   int result;
+  bool swapped;
 
   vm->state->cmd.cur = cmd;
 
@@ -761,7 +1328,17 @@ static __inline int _docmd(RILVM vm, ril_vmcmd_t *cmd)
     }
   }
   
+  ++vm->code.running;
   result = cmd->tag->execute_handler(vm);
+  swapped = 0 < buffer_size(vm->code.retired);
+  if (0 == --vm->code.running) ril_freeretiredcode(vm);
+  
+  // the handler loaded other code, cmd went with the old one
+  if (swapped)
+  {
+    vm->state->cmd.prev = NULL;
+    return result;
+  }
 
   if (RIL_BREAKPAIR == result && cmd->pair->first->tag->addstack)
   {
@@ -830,6 +1407,7 @@ int ril_calltag(RILVM vm, ril_tag_t *tag)
   cmd->nextpair = NULL;
   cmd->parent = vm->state->cmd.cur;
   cmd->arg = NULL;
+  cmd->tailcall = false;
   
   vm->state->cmd.cur = cmd;
   
@@ -863,7 +1441,9 @@ void ril_eraseworkarea(RILVM vm, int size)
 
 void* ril_workarea(RILVM vm)
 {
-  ril_tagstack_t *stack = (ril_tagstack_t*)stack_back(vm->state->tag_stack, NULL);
+  ril_tagstack_t *stack = 0 <= vm->state->saveframe
+    ? (ril_tagstack_t*)stack_index(vm->state->tag_stack, vm->state->saveframe, NULL)
+    : (ril_tagstack_t*)stack_back(vm->state->tag_stack, NULL);
   return buffer_index(vm->state->ext_buffer, stack->buffer_offset);
 }
 
@@ -902,6 +1482,7 @@ void ril_addstack(RILVM vm, ril_tag_t *tag)
 
 RILRESULT ril_fetchlocalvar(RILVM vm)
 {
+  ril_bindlocalvar(vm);
   vm->rootvar = &vm->state->rootvar;
 
   return RIL_OK;
@@ -9,13 +9,32 @@ extern "C" {
 
 RILRESULT ril_setargumentsbycmd(RILVM vm, ril_vmcmd_t *cmd);
 void ril_setnextcmd(RILVM vm, ril_vmcmd_t *cmd);
+RILVM ril_openoverlay(RILVM vm);
+void ril_closeoverlay(RILVM vm);
 void ril_cleartags(RILVM vm);
 void ril_deletetags(RILVM vm);
 void ril_deletemacros(RILVM vm);
+void ril_deletecompiledmacros(RILVM vm);
+ril_tag_t* ril_registermacro(RILVM vm, const char *name, const char *args);
+ril_memo_t* ril_setmemo(RILVM vm, ril_tag_t *tag);
+void ril_clearmemo(ril_memo_t *memo);
+void ril_closememo(ril_memo_t *memo);
+ril_memoentry_t* ril_findmemo(RILVM vm, ril_tag_t *tag);
+ril_memoentry_t* ril_newmemoentry(RILVM vm, ril_tag_t *tag);
+void ril_returnmemo(RILVM vm, ril_memoentry_t *entry);
+void ril_storememo(RILVM vm, ril_memoentry_t *entry, ril_var_t *value);
+void ril_deletememoentry(RILVM vm, ril_memoentry_t *entry);
+void ril_opencache(RILVM vm);
+void ril_clearcache(RILVM vm);
+void ril_closecache(RILVM vm);
+const ril_cacheentry_t* ril_findcache(RILVM vm, const char *key, int keysize);
+void ril_storecache(RILVM vm, const void *data, int keysize, int size);
+void ril_removecache(RILVM vm, const char *key, int keysize);
 ril_tag_t* ril_createtag(RILVM vm, ril_signature_t signature);
 void ril_inittag(ril_tag_t *tag);
 void ril_deletetag(ril_tag_t *tag);
 void ril_addstack(RILVM vm, ril_tag_t *tag);
+ril_tag_t* ril_findtag(RILVM vm, const char *name, const ril_crc_t *namehashes, int size, bool hasnonamearg, bool iscmp);
 
 #ifdef __cplusplus
 }
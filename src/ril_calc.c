@@ -5,6 +5,7 @@
 #include "ril_vm.h"
 #include "ril_utils.h"
 #include "ril_var.h"
+#include "ril_state.h"
 #include "ril_compiler.h"
 #include <stdio.h>
 #include <stdarg.h>
@@ -12,6 +13,8 @@
 #include <ctype.h>
 
 #define STACK_SIZE 128
+#define OPERATOR_STACK_SIZE 16
+#define LASTDEST_SIZE 64
 
 #ifdef _WIN32
 #pragma warning(disable:4996)
@@ -19,7 +22,7 @@
 
 #define OPERATOR_ADD_PRIORITY 50
 
-typedef struct
+typedef struct _calc_operator
 {
   int priority;
   calc_opcode_t type;
@@ -121,12 +124,44 @@ int calc_cast(calc_t *calc, variant_t *variant, int casttype)
   return RIL_OK;
 }
 
+/* the string form with its length, a converted number is not measured again */
+const char* calc_caststring(calc_t *calc, variant_t *variant, int *length)
+{
+  char *buf;
+
+  switch (variant->type)
+  {
+  case VARIANT_INTEGER:
+    buf = (char*)buffer_malloc(calc->temp_buffer, 100);
+    *length = sprintf(buf, "%d", variant->int_value);
+    break;
+  case VARIANT_REAL:
+    buf = (char*)buffer_malloc(calc->temp_buffer, 100);
+    *length = sprintf(buf, "%f", variant->real_value);
+    break;
+  case VARIANT_STRINGOBJ:
+    *length = ((ril_string_t*)variant->ptr_value)->size;
+    buf = ((ril_string_t*)variant->ptr_value)->ptr;
+    break;
+  default:
+    calc_cast(calc, variant, VARIANT_STRING);
+    *length = strlen(variant->string_value);
+    return variant->string_value;
+  }
+  variant->type = VARIANT_STRING;
+  variant->string_value = buf;
+
+  return buf;
+}
+
 static __inline void _getvar(RILVM vm, const void *src, ril_register_t *reg)
 {
   uint32_t size;
   calc_opcode_t op;
   const char *name = NULL;
   bool isfirst = true;
+  ril_var_t *key;
+  int32_t slot;
 
   reg->var = &vm->globalvar;
   for (;;)
@@ -138,14 +173,18 @@ static __inline void _getvar(RILVM vm, const void *src, ril_register_t *reg)
     reg->parent = reg->var;
     switch (op)
     {
+    case VAR_SLOT:
     case VAR_HASH:
+      // a slot from another macro's body falls back to the key
+      slot = -1;
+      if (VAR_SLOT == op) src = ril_read(&slot, src, sizeof(slot));
       name = (char*)ril_read(&reg->hashkey, src, sizeof(reg->hashkey));
+      reg->index = -1;
       reg->var = NULL;
-      if (isfirst && RIL_SUCCEEDED(ril_fetchlocalvar(vm)))
+      if (isfirst)
       {
-        reg->var = ril_getvarbyhash(vm, NULL, reg->hashkey);
-        if (NULL != reg->var) reg->parent = vm->rootvar;
-        ril_fetchglobalvar(vm);
+        reg->var = ril_getlocalvar(vm, slot, reg->hashkey);
+        if (NULL != reg->var) reg->parent = &vm->state->rootvar;
       }
       if (NULL == reg->var)
       {
@@ -156,12 +195,22 @@ static __inline void _getvar(RILVM vm, const void *src, ril_register_t *reg)
       continue;
     case VAR_CALC:
       src = ril_read(&size, src, sizeof(uint32_t));
-      name = calc_tostring(vm, src);
+      key = calc_execute(vm, src)->var;
+      src = (uint8_t*)src + size;
+      // an integer key indexes without the string and the hash
+      if (ril_isint(key) && 0 <= key->variant.int_value)
+      {
+        reg->index = key->variant.int_value;
+        reg->var = ril_createvarbyindex(vm, reg->parent, reg->index);
+        continue;
+      }
+      name = ril_var2string(vm, key);
       reg->hashkey = hashmap_makekey(name);
+      reg->index = -1;
       reg->var = ril_createvarbyhash(vm, reg->parent, name, reg->hashkey);
-      src = (uint8_t*)src + size;
       continue;
     case VAR_ADD:
+      reg->index = -1;
       name = NULL;
       reg->var = ril_createvar(vm, reg->parent, NULL);
       continue;
@@ -185,6 +234,7 @@ static __inline void _push(RILVM vm, calc_execute_t *context)
 
   ril_register_t *reg = (ril_register_t*)stack_push(vm->calc->stack, NULL);
   var = reg->var = &reg->temp;
+  reg->index = -1;
 
   switch (value->type)
   {
@@ -233,27 +283,30 @@ static __inline void _push(RILVM vm, calc_execute_t *context)
   }
 }
 
+/* a converted number lives in the temp buffer, which the next conversion may move */
+static __inline int _tempoffset(calc_t *calc, const char *str)
+{
+  const char *front = (const char*)buffer_front(calc->temp_buffer);
+
+  return str >= front && str < front + buffer_size(calc->temp_buffer) ? (int)(str - front) : -1;
+}
+
 static __inline void _strcat(RILVM vm)
 {
   ril_register_t *rv, *lv;
-  const char *buf;
-  int size, index;
+  const char *lstr, *rstr;
+  int lsize, rsize, loffset;
 
   rv = (ril_register_t*)stack_pop(vm->calc->stack, NULL);
   lv = (ril_register_t*)stack_back(vm->calc->stack, NULL);
 
-  index = buffer_size(vm->calc->temp_buffer);
-
-  buf = ril_var2string(vm, lv->var); size = strlen(buf);
-  buffer_write(vm->calc->temp_buffer, buf, size);
-
-  buf = ril_var2string(vm, rv->var); size = strlen(buf);
-  buffer_write(vm->calc->temp_buffer, buf, size);
-
-  *(char*)buffer_malloc(vm->calc->temp_buffer, 1) = '\0';
+  lstr = ril_var2stringlen(vm, lv->var, &lsize);
+  loffset = _tempoffset(vm->calc, lstr);
+  rstr = ril_var2stringlen(vm, rv->var, &rsize);
+  if (0 <= loffset) lstr = (char*)buffer_front(vm->calc->temp_buffer) + loffset;
 
   lv->var = &lv->temp;
-  ril_setstring(vm,  lv->var, (char*)buffer_index(vm->calc->temp_buffer, index));
+  ril_setstringbyparts(vm, lv->var, lstr, lsize, rstr, rsize);
 }
 
 static __inline void _move(RILVM vm)
@@ -273,16 +326,22 @@ static __inline void _move(RILVM vm)
 
 static __inline void _strop(RILVM vm, int op, ril_var_t *dest, ril_var_t *lv, ril_var_t *rv)
 {
-  int result;
+  const char *lstr, *rstr;
+  int llength, rlength, loffset, result;
+
+  lstr = ril_var2stringlen(vm, lv, &llength);
+  loffset = _tempoffset(vm->calc, lstr);
+  rstr = ril_var2stringlen(vm, rv, &rlength);
+  if (0 <= loffset) lstr = (char*)buffer_front(vm->calc->temp_buffer) + loffset;
+  result = llength == rlength && 0 == memcmp(lstr, rstr, llength);
+
   switch (op)
   {
   case '=':
-    result = !strcmp(ril_var2string(vm, lv), ril_var2string(vm, rv));
     ril_setinteger(vm, dest, result);
     break;
   case '!':
-    result = 0 != strcmp(ril_var2string(vm, lv), ril_var2string(vm, rv));
-    ril_setinteger(vm, dest, result);
+    ril_setinteger(vm, dest, !result);
     break;
   }
 }
@@ -308,6 +367,8 @@ case VARIANT_REAL: \
 case (VARIANT_STRING|VARIANT_INTEGER): \
 case (VARIANT_STRING|VARIANT_REAL): \
 case VARIANT_STRING: \
+case (VARIANT_STRINGOBJ|VARIANT_INTEGER): \
+case VARIANT_STRINGOBJ: \
   _strop(vm, (#op)[0], &lv->temp, lv->var, rv->var); \
   break; \
 } \
@@ -530,6 +591,49 @@ static __inline void calc_optimize(RILVM vm, calc_compile_t *e_context)
   stack_clear(vm->calc->stack);
 }
 
+static __inline void _lastdest_write(calc_compile_t *context, const void *src, int size)
+{
+  int capacity = context->lastdest_capacity;
+
+  if (context->lastdest_size + size > capacity)
+  {
+    if (0 == capacity) capacity = LASTDEST_SIZE;
+    while (capacity < context->lastdest_size + size) capacity *= 2;
+    context->lastdest = (uint8_t*)arena_realloc(context->arena, context->lastdest, context->lastdest_size, capacity);
+    context->lastdest_capacity = capacity;
+  }
+  memcpy(context->lastdest + context->lastdest_size, src, size);
+  context->lastdest_size += size;
+}
+
+static __inline void _lastdest_writeoperator(calc_compile_t *context, calc_opcode_t op)
+{
+  _lastdest_write(context, &op, sizeof(op));
+}
+
+static __inline operator_t* _operator_back(calc_compile_t *context)
+{
+  return context->operator_count ? &context->operators[context->operator_count - 1] : NULL;
+}
+
+static __inline operator_t* _operator_pop(calc_compile_t *context)
+{
+  return context->operator_count ? &context->operators[--context->operator_count] : NULL;
+}
+
+static __inline void _operator_push(calc_compile_t *context, const operator_t *operator)
+{
+  int capacity = context->operator_capacity;
+
+  if (context->operator_count >= capacity)
+  {
+    capacity = capacity ? capacity * 2 : OPERATOR_STACK_SIZE;
+    context->operators = (operator_t*)arena_realloc(context->arena, context->operators, sizeof(operator_t) * context->operator_count, sizeof(operator_t) * capacity);
+    context->operator_capacity = capacity;
+  }
+  context->operators[context->operator_count++] = *operator;
+}
+
 static __inline RILRESULT push_operator(RILVM vm, calc_compile_t *context, operator_t operator_cur)
 {
   operator_t *operator;
@@ -567,31 +671,31 @@ static __inline RILRESULT push_operator(RILVM vm, calc_compile_t *context, opera
       return ril_error(vm, "unexpected '%c'", context->begin[0]);
       break;
     case CALC_INCFRONT:
-      *(calc_opcode_t*)buffer_malloc(context->lastdest_buffer, sizeof(calc_opcode_t)) = CALC_PUSH;
-      buffer_write(context->lastdest_buffer, calc_lastvalue(context), sizeof(calc_value_t));
-      buffer_write(context->lastdest_buffer, calc_lastvalue(context) + 1, calc_lastvalue(context)->size);
-      calc_writeoperator(context->lastdest_buffer, CALC_INCBACK);
+      _lastdest_writeoperator(context, CALC_PUSH);
+      _lastdest_write(context, calc_lastvalue(context), sizeof(calc_value_t));
+      _lastdest_write(context, calc_lastvalue(context) + 1, calc_lastvalue(context)->size);
+      _lastdest_writeoperator(context, CALC_INCBACK);
       return RIL_OK;
     case CALC_DECFRONT:
-      *(calc_opcode_t*)buffer_malloc(context->lastdest_buffer, sizeof(calc_opcode_t)) = CALC_PUSH;
-      buffer_write(context->lastdest_buffer, calc_lastvalue(context), sizeof(calc_value_t));
-      buffer_write(context->lastdest_buffer, calc_lastvalue(context) + 1, calc_lastvalue(context)->size);
-      calc_writeoperator(context->lastdest_buffer, CALC_DECBACK);
+      _lastdest_writeoperator(context, CALC_PUSH);
+      _lastdest_write(context, calc_lastvalue(context), sizeof(calc_value_t));
+      _lastdest_write(context, calc_lastvalue(context) + 1, calc_lastvalue(context)->size);
+      _lastdest_writeoperator(context, CALC_DECBACK);
       return RIL_OK;
     }
   }
   context->prev_is_operator = !context->prev_is_operator;
-  while (NULL != (operator = (operator_t*)stack_back(context->stack, NULL)))
+  while (NULL != (operator = _operator_back(context)))
   {
     if (operator_cur.priority <= operator->priority)
     {
       calc_writeoperator(context->dest_buffer, operator->type);
-      stack_pop(context->stack, NULL);
+      _operator_pop(context);
       continue;
     }
     break;
   }
-  stack_push(context->stack, &operator_cur);
+  _operator_push(context, &operator_cur);
   
   return RIL_OK;
 }
@@ -680,8 +784,8 @@ static __inline operator_t check_operator(RILVM vm, calc_compile_t *context, con
 
 static __inline void _compile_close(calc_compile_t *context)
 {
-  buffer_close(context->lastdest_buffer);
-  stack_close(context->stack);
+  /* scratch is reset, not freed */
+  arena_release(context->arena, context->arena_mark);
 }
 
 static __inline RILRESULT _compile_string(calc_compile_t *context)
@@ -767,7 +871,6 @@ static __inline RILRESULT _compile_number(RILVM vm, calc_compile_t *context)
     {
       if (isfloat)
       {
-        _compile_close(context);
         return ril_error(vm, "unexpected '.'");
       }
       context->cur += 2;
@@ -777,7 +880,7 @@ static __inline RILRESULT _compile_number(RILVM vm, calc_compile_t *context)
   while (isdigit(*context->cur));
   
   length = context->cur - start;
-  buf = (char*)malloc(length + 1);
+  buf = (char*)arena_malloc(context->arena, length + 1);
   memcpy(buf, start, length);
   buf[length] = '\0';
   
@@ -794,8 +897,6 @@ static __inline RILRESULT _compile_number(RILVM vm, calc_compile_t *context)
     calc_writevalue(context, VARIANT_INTEGER, &value, sizeof(int));
   }
   
-  free(buf);
-  
   return RIL_OK;
 }
 
@@ -815,9 +916,14 @@ RILRESULT calc_compile(ril_compile_t *c_context, buffer_t *dest_buffer, const ch
   context.cur = context.front;
   context.dest_begin = buffer_size(dest_buffer);
   context.dest_buffer = dest_buffer;
-  context.lastdest_buffer = buffer_open(1, 1024);
-  context.stack = stack_open(sizeof(operator_t));
-  stack_resize(context.stack, 100);
+  context.arena = c_context->arena;
+  context.arena_mark = arena_mark(context.arena);
+  context.lastdest = NULL;
+  context.lastdest_size = 0;
+  context.lastdest_capacity = 0;
+  context.operators = NULL;
+  context.operator_count = 0;
+  context.operator_capacity = 0;
 
   for (;;)
   {
@@ -890,7 +996,11 @@ RILRESULT calc_compile(ril_compile_t *c_context, buffer_t *dest_buffer, const ch
     /* string */
     if ('\"' == *context.cur)
     {
-      if (RIL_FAILED(_compile_string(&context))) return RIL_ERROR;
+      if (RIL_FAILED(_compile_string(&context)))
+      {
+        _compile_close(&context);
+        return RIL_ERROR;
+      }
       context.hasminus = false;
       continue;
     }
@@ -898,7 +1008,11 @@ RILRESULT calc_compile(ril_compile_t *c_context, buffer_t *dest_buffer, const ch
     /* numeric */
     if (isdigit(*context.cur))
     {
-      if (RIL_FAILED(_compile_number(c_context->vm, &context))) return RIL_ERROR;
+      if (RIL_FAILED(_compile_number(c_context->vm, &context)))
+      {
+        _compile_close(&context);
+        return RIL_ERROR;
+      }
       context.hasminus = false;
       continue;
     }
@@ -919,15 +1033,16 @@ RILRESULT calc_compile(ril_compile_t *c_context, buffer_t *dest_buffer, const ch
     return ril_error(c_context->vm, "'(' not closed");
   }
   
-  while (NULL != (poperator = (operator_t*)stack_pop(context.stack, NULL)))
+  while (NULL != (poperator = _operator_pop(&context)))
   {
     calc_writeoperator(dest_buffer, poperator->type);
   }
-  buffer_write(dest_buffer, buffer_front(context.lastdest_buffer), buffer_bytesize(context.lastdest_buffer));
+  if (0 < context.lastdest_size) buffer_write(dest_buffer, context.lastdest, context.lastdest_size);
   calc_writeoperator(dest_buffer, CALC_END);
 
   if (context.isref && !calc_isvar(buffer_front(dest_buffer)))
   {
+    _compile_close(&context);
     return ril_error(c_context->vm, "Calculation of a reference type can not be");
   }
   
@@ -959,6 +1074,25 @@ calc_value_t* calc_lastvalue(calc_compile_t *context)
   return (calc_value_t*)buffer_index(context->dest_buffer, context->valueindex);
 }
 
+int calc_bytesize(const void *src)
+{
+  const void *begin = src;
+  int type;
+  
+  for(;;)
+  {
+    type = *(calc_opcode_t*)src;
+    src = (calc_opcode_t*)src + 1;
+    if (CALC_END == type) break;
+    if (CALC_PUSH == type)
+    {
+      src = (int8_t*)src + sizeof(calc_value_t) + ((calc_value_t*)src)->size;
+    }
+  }
+  
+  return (intptr_t)src - (intptr_t)begin;
+}
+
 int calc_countvalue(const void *src)
 {
   int counter = 0, type;
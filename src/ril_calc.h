@@ -40,6 +40,7 @@ enum
 };
 
 struct _calc;
+struct _calc_operator;
 struct _ril_register;
 typedef struct _ril_register ril_register_t;
 
@@ -56,10 +57,16 @@ typedef struct
   const char *front;
   const char *cur;
   const char *begin;
-  buffer_t *lastdest_buffer;
+  arena_t *arena;
+  arena_mark_t arena_mark;
+  uint8_t *lastdest;
+  int lastdest_size;
+  int lastdest_capacity;
   buffer_t *dest_buffer;
   int dest_begin;
-  stack_t *stack;
+  struct _calc_operator *operators;
+  int operator_count;
+  int operator_capacity;
   int class_num;
   int plus_priority;
   int prev_is_operator;
@@ -92,12 +99,14 @@ RILRESULT calc_compile(ril_compile_t*, buffer_t*, const char*);
 void calc_writevalue(calc_compile_t*, int, const void*, uint32_t);
 void calc_writevalue2buffer(buffer_t* dest, int type, const void *src, uint32_t size);
 int calc_countvalue(const void *src);
+int calc_bytesize(const void *src);
 calc_value_t* calc_lastvalue(calc_compile_t *context);
 
 ril_register_t* calc_execute(RILVM vm, const void *src);
 const char* calc_tostring(RILVM vm, const void *src);
 
 int calc_cast(calc_t *calc, variant_t *v, int casttype);
+const char* calc_caststring(calc_t *calc, variant_t *v, int *length);
 void calc_writeoperator(buffer_t *buffer, calc_opcode_t op);
 bool calc_isvar(const void *src);
 
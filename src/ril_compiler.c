@@ -6,6 +6,9 @@
 #include "ril_compiler.h"
 #include "ril_utils.h"
 #include "ril_api.h"
+#include "thread.h"
+#include "md5.h"
+#include "crc.h"
 
 typedef struct
 {
@@ -13,10 +16,26 @@ typedef struct
   uint32_t line;
 } _stack_pair_t;
 
-static __inline uint32_t _labelnametoid(ril_compile_t *c_context, const char *name)
+typedef struct
+{
+  RILVM vm;
+  const char **files;
+  buffer_t **dests;
+  RILRESULT *results;
+  int count;
+  int next;
+  RILRESULT result;
+  mutex_t mutex;
+} _batch_t;
+
+static void _addcheckpoint(ril_compile_t *context);
+static bool _resumetail(ril_compile_t *context);
+static void _expandinlines(ril_compile_t *context);
+static void _optimize(ril_compile_t *context);
+
+static __inline uint32_t _labelhashtoid(ril_compile_t *c_context, uint32_t namehash)
 {
   int i;
-  uint32_t namehash = ril_makecrc(name);
   ril_label_t *label;
   
   for (i = buffer_size(c_context->label_buffer) - 1; 0 <= i; --i)
@@ -33,13 +52,31 @@ static __inline uint32_t _labelnametoid(ril_compile_t *c_context, const char *na
   return i;
 }
 
+static __inline uint32_t _labelnametoid(ril_compile_t *c_context, const char *name)
+{
+  return _labelhashtoid(c_context, ril_makecrc(name));
+}
+
+// grow by the current size, so that large scripts need only a few reallocs
+static __inline void _growbuffer(buffer_t *buffer)
+{
+  if (buffer->resizesize < buffer_size(buffer)) buffer_autoresize(buffer, buffer_size(buffer));
+}
+
 ril_cmd_t* rilc_newcmd(ril_compile_t *context, ril_signature_t signature)
 {
-  ril_cmd_t *cmd = buffer_malloc(context->cmd_buffer, 1);
+  ril_cmd_t *cmd;
+  
+  _growbuffer(context->cmd_buffer);
+  _growbuffer(context->arg_buffer);
+  _growbuffer(context->data_buffer);
+  
+  cmd = buffer_malloc(context->cmd_buffer, 1);
   
   cmd->signature = signature;
   cmd->arg_offset = buffer_size(context->arg_buffer);
   cmd->pair_cmdid.id = buffer_size(context->cmd_buffer) - 1;
+  cmd->parent_cmdid.id = cmd->pair_cmdid.id;
   
   context->cmd = cmd;
   context->cmdid.id = cmd->pair_cmdid.id;
@@ -90,8 +127,16 @@ void rilc_eraselastcmd(ril_compile_t *context)
     ril_arg_t *cmdarg = rilc_getarg(context, context->cmd, i);
     if (cmdarg->data_offset < databegin) databegin = cmdarg->data_offset;
   }
+  buffer_resize(context->arg_buffer, context->cmd->arg_offset);
   buffer_erase(context->cmd_buffer, 1);
   buffer_resize(context->data_buffer, databegin);
+  if (NULL != context->labelref_buffer)
+  {
+    while (!buffer_empty(context->labelref_buffer) && databegin <= *(uint32_t*)buffer_back(context->labelref_buffer))
+    {
+      buffer_erase(context->labelref_buffer, 1);
+    }
+  }
   --context->cmd;
   if ((void*)context->cmd > buffer_front(context->cmd_buffer)) context->cmd = NULL;
 }
@@ -118,6 +163,31 @@ void rilc_addstring(ril_compile_t *context, const char *value)
   calc_writeoperator(context->data_buffer, CALC_END);
 }
 
+/* the slot of a local while the body of its macro is compiled, or -1 */
+static __inline int32_t _localslot(ril_compile_t *context, ril_crc_t namehash)
+{
+  _stack_pair_t *stack_pair;
+  ril_cmd_t *cmd;
+  int i;
+  
+  if (0 == buffer_size(context->local_buffer)) return -1;
+  for (i = -1; ; --i)
+  {
+    stack_pair = (_stack_pair_t*)stack_index(context->pair_stack, i, NULL);
+    if (NULL == stack_pair) return -1;
+    if (context->localowner.id == stack_pair->cmdid.id) break;
+  }
+  cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, context->localowner.id);
+  if (context->localsignature != cmd->signature) return -1;
+  
+  for (i = 0; i < buffer_size(context->local_buffer); ++i)
+  {
+    if (namehash == *(ril_crc_t*)buffer_index(context->local_buffer, i)) return i;
+  }
+  
+  return -1;
+}
+
 static __inline RILRESULT _compilevar(ril_compile_t *c_context, calc_compile_t *e_context, bool isconst)
 {
   char word[128];
@@ -125,6 +195,7 @@ static __inline RILRESULT _compilevar(ril_compile_t *c_context, calc_compile_t *
   ril_crc_t namehash;
   bool checksub = false;
   uint32_t *size;
+  int32_t slot;
   int dest_beginindex;
   void* calc_begin;
   
@@ -133,9 +204,18 @@ static __inline RILRESULT _compilevar(ril_compile_t *c_context, calc_compile_t *
     e_context->cur = ril_getword(word, e_context->cur, false);
     if ('\0' == *word) break;
     
-    /* hash (hashkey + rawkey) */
+    /* hash (hashkey + rawkey), after the frame slot of a macro local */
     namehash = ril_makecrc(word);
-    calc_writeoperator(e_context->dest_buffer, VAR_HASH);
+    slot = _localslot(c_context, namehash);
+    if (0 <= slot)
+    {
+      calc_writeoperator(e_context->dest_buffer, VAR_SLOT);
+      buffer_write(e_context->dest_buffer, &slot, sizeof(slot));
+    }
+    else
+    {
+      calc_writeoperator(e_context->dest_buffer, VAR_HASH);
+    }
     buffer_write(e_context->dest_buffer, &namehash, sizeof(namehash));
     buffer_write(e_context->dest_buffer, word, strlen(word) + 1);
     
@@ -273,6 +353,10 @@ RILRESULT calc_cb_compile(calc_compile_t *context, ril_compile_t *c_context)
     label.id = _labelnametoid(c_context, word);
     label.namehash = ((ril_label_t*)buffer_index(c_context->label_buffer, label.id))->namehash;
     calc_writevalue(context, VARIANT_LABEL, &label, sizeof(label));
+    if (NULL != c_context->labelref_buffer)
+    {
+      *(uint32_t*)buffer_malloc(c_context->labelref_buffer, 1) = buffer_size(context->dest_buffer) - sizeof(label);
+    }
     return RIL_OK;
   }
   
@@ -349,6 +433,11 @@ RILRESULT rilc_checkpair(ril_compile_t *context, ril_cmd_t *cmd)
   if (0 < buffer_size(tag->pair_buffer))
   {
     stack_pair = stack_push(context->pair_stack, NULL);
+    if (NULL == stack_pair)
+    {
+      stack_resize(context->pair_stack, stack_count(context->pair_stack) * 2);
+      stack_pair = stack_push(context->pair_stack, NULL);
+    }
     stack_pair->cmdid = cmdid;
     stack_pair->line = context->line;
   }
@@ -356,9 +445,9 @@ RILRESULT rilc_checkpair(ril_compile_t *context, ril_cmd_t *cmd)
   return RIL_OK;
 }
 
-static __inline RILRESULT _findtag(ril_compile_t *context, ril_cmd_t *cmd, const char *name, int argc, bool hasnonamearg, const char *args)
+static __inline RILRESULT _findtag(ril_compile_t *context, ril_cmd_t *cmd, const char *name, const ril_crc_t *namehashes, int size, bool hasnonamearg)
 {
-  ril_tag_t *tag = ril_getregisteredtag3(context->vm, name, args, hasnonamearg, false);
+  ril_tag_t *tag = ril_findtag(context->vm, name, namehashes, size, hasnonamearg, false);
   
   if (NULL == tag) return RIL_ERROR;
   
@@ -398,17 +487,15 @@ static __inline RILRESULT _checkargs(ril_compile_t *context, ril_cmd_t *cmd)
 
 static __inline RILRESULT _compiletag(ril_compile_t *context)
 {
-  char word[128], args[512];
+  char word[128];
   const char *start;
-  int argc = 0;
+  int argc = 0, namedargc = 0;
   bool hasnonamearg = false;
   ril_parameter_t *param;
   int i, j, argsize;
-  ril_crc_t hash, arghashlist[RIL_ARGUMENT_SIZE] = {0};
+  ril_crc_t hash, arghashlist[RIL_ARGUMENT_SIZE] = {0}, namehashes[RIL_ARGUMENT_SIZE];
   ril_arg_t *cmdarg;
   
-  args[0] = '\0';
-  
   // get name
   context->cur = ril_getword(context->tagname, context->cur, true);
   
@@ -447,8 +534,7 @@ static __inline RILRESULT _compiletag(ril_compile_t *context)
           }
         }
         arghashlist[argc] = hash;
-        if ('\0' != args[0]) strcat(args, ",");
-        strcat(args, word);
+        namehashes[namedargc++] = hash;
         context->cur = ril_trimspace(context->cur + 1);
       }
     }
@@ -466,7 +552,7 @@ static __inline RILRESULT _compiletag(ril_compile_t *context)
   
   context->cur += context->vm->delimiter.right.length;
   
-  if (RIL_FAILED(_findtag(context, context->cmd, context->tagname, argc, hasnonamearg, args)))
+  if (RIL_FAILED(_findtag(context, context->cmd, context->tagname, namehashes, namedargc, hasnonamearg)))
   {
     return RIL_COMPILE_ERROR(context, "Fatal error: Call to undefined tag '%s'", context->tagname);
   }
@@ -538,58 +624,263 @@ static __inline RILRESULT _compiletag(ril_compile_t *context)
   return RIL_OK;
 }
 
+// discards the consumed input and appends the next chunk
+static bool _readchunk(ril_compile_t *context)
+{
+  ril_reader_t *reader = context->reader;
+  int offset = context->cur - reader->buffer, size;
+  
+  if (reader->eof) return false;
+  
+  reader->size -= offset;
+  reader->ready -= offset;
+  memmove(reader->buffer, context->cur, reader->size);
+  
+  if (reader->capacity < reader->size + READ_CHUNK_SIZE + 1)
+  {
+    reader->capacity *= 2;
+    if (reader->capacity < reader->size + READ_CHUNK_SIZE + 1)
+    {
+      reader->capacity = reader->size + READ_CHUNK_SIZE + 1;
+    }
+    reader->buffer = (char*)ril_realloc(reader->buffer, reader->capacity);
+  }
+  
+  size = reader->read(reader->userdata, reader->buffer + reader->size, READ_CHUNK_SIZE);
+  if (0 >= size)
+  {
+    reader->error = 0 > size;
+    reader->eof = true;
+    size = 0;
+  }
+  reader->size += size;
+  reader->buffer[reader->size] = '\0';
+  context->cur = reader->buffer;
+  
+  return 0 < size;
+}
+
+// keeps the whole current line in the input window
+static __inline const char* _readline(ril_compile_t *context)
+{
+  ril_reader_t *reader = context->reader;
+  const char *end;
+  
+  if (NULL == reader || context->cur - reader->buffer < reader->ready) return context->cur;
+  
+  for (;;)
+  {
+    end = strchr(context->cur, '\n');
+    if (NULL != end)
+    {
+      reader->ready = end + 1 - reader->buffer;
+      break;
+    }
+    if (!_readchunk(context))
+    {
+      reader->ready = reader->size;
+      break;
+    }
+  }
+  
+  return context->cur;
+}
+
+// keeps the whole tag in the input window
+static __inline void _readtag(ril_compile_t *context)
+{
+  const char *cur;
+  int depth;
+  bool isstring;
+  
+  if (NULL == context->reader) return;
+  
+  do
+  {
+    depth = 0;
+    isstring = false;
+    for (cur = context->cur + context->vm->delimiter.left.length; '\0' != *cur; ++cur)
+    {
+      if (isstring)
+      {
+        if ('\\' == *cur && '\0' != cur[1]) ++cur;
+        else if ('"' == *cur) isstring = false;
+        continue;
+      }
+      if ('"' == *cur) isstring = true;
+      else if ('[' == *cur) ++depth;
+      else if (0 < depth && ']' == *cur) --depth;
+      else if (ril_isrightdelimiter(context->vm, cur)) return;
+    }
+  } while (_readchunk(context));
+}
+
+bool rilc_readahead(ril_compile_t *context, const char *terminator)
+{
+  ril_reader_t *reader = context->reader;
+  int offset = 0, length = strlen(terminator);
+  
+  if (NULL == reader) return true;
+  
+  for (;;)
+  {
+    if (NULL != strstr(context->cur + offset, terminator)) return true;
+    offset = reader->buffer + reader->size - context->cur - length + 1;
+    if (0 > offset) offset = 0;
+    if (!_readchunk(context)) return false;
+  }
+}
+
 RILRESULT ril_compilefile(RILVM vm, const char *file, buffer_t *dest)
 {
   RILRESULT result;
-  char *buf;
+  FILE *fp;
   const char *path = ril_getpath(vm, file);
   
-  buf = ril_readfile(path);
-  if (NULL == buf)
+  fp = fopen(path, "rb");
+  if (NULL == fp)
   {
     return ril_error(vm, "Fatal error: Cannot open %s", path);
   }
   
-  result = ril_compile(vm, buf, dest);
+  result = ril_compilestream(vm, ril_readfp, fp, dest);
   
-  free(buf);
+  fclose(fp);
   
   return result;
 }
 
+static THREAD_FUNC(_compileworker, arg)
+{
+  _batch_t *batch = (_batch_t*)arg;
+  RILVM vm = ril_openoverlay(batch->vm);
+  RILRESULT result;
+  int i;
+  
+  for (;;)
+  {
+    mutex_lock(&batch->mutex);
+    i = batch->next++;
+    mutex_unlock(&batch->mutex);
+    if (batch->count <= i) break;
+    
+    result = ril_compilefile(vm, batch->files[i], batch->dests[i]);
+    if (NULL != batch->results) batch->results[i] = result;
+    if (RIL_FAILED(result))
+    {
+      mutex_lock(&batch->mutex);
+      batch->result = RIL_ERROR;
+      mutex_unlock(&batch->mutex);
+    }
+  }
+  
+  ril_closeoverlay(vm);
+  
+  return 0;
+}
+
+// compiles each file against the frozen tag registry of vm.
+// macros are registered in a per-thread overlay, so vm is not modified,
+// and no other thread may change vm until the batch is done.
+RILRESULT ril_compilefiles(RILVM vm, const char **files, buffer_t **dests, RILRESULT *results, int count, int threadnum)
+{
+  _batch_t batch;
+  thread_t *threads;
+  int i;
+  
+  if (0 >= threadnum) threadnum = thread_cpucount();
+  if (count < threadnum) threadnum = count;
+  
+  batch.vm = vm;
+  batch.files = files;
+  batch.dests = dests;
+  batch.results = results;
+  batch.count = count;
+  batch.next = 0;
+  batch.result = RIL_OK;
+  mutex_init(&batch.mutex);
+  
+  // tags registered just before may have left the registry resizing
+  hashmap_finishresize(vm->tagmap);
+  
+  threads = (thread_t*)ril_malloc(sizeof(thread_t) * threadnum);
+  for (i = 1; i < threadnum; ++i)
+  {
+    if (0 != thread_create(&threads[i], _compileworker, &batch)) break;
+  }
+  threadnum = i;
+  
+  // the calling thread is the first worker
+  _compileworker(&batch);
+  
+  for (i = 1; i < threadnum; ++i) thread_join(threads[i]);
+  
+  ril_free(threads);
+  mutex_destroy(&batch.mutex);
+  
+  return batch.result;
+}
+
 static __inline ril_compile_t* _open(RILVM vm)
 {
   ril_compile_t *context = malloc(sizeof(ril_compile_t));
   
   context->line = 1;
+  context->cur = NULL;
+  context->reader = NULL;
   context->cmd = NULL;
   context->tag = NULL;
   
   context->pair_stack = stack_open(sizeof(_stack_pair_t));
-  stack_resize(context->pair_stack, 100);
+  stack_resize(context->pair_stack, PAIR_STACK_SIZE);
+  
+  context->arena = arena_open(ARENA_BLOCK_SIZE);
   
   context->label_buffer = buffer_open(sizeof(ril_label_t), LABEL_BUFF_SIZE);
   context->cmd_buffer = buffer_open(sizeof(ril_cmd_t), TAG_BUFF_SIZE);
   context->arg_buffer = buffer_open(sizeof(ril_arg_t), ARG_BUFF_SIZE);
   context->data_buffer = buffer_open(1, DATA_BUFF_SIZE);
+  context->labelref_buffer = NULL;
+  context->depend_buffer = NULL;
+  
+  context->front = NULL;
+  context->checkpoint_buffer = NULL;
+  context->previous = NULL;
+  context->tailbegin = 0;
+  context->delta = 0;
+  context->local_buffer = buffer_open(sizeof(ril_crc_t), 16);
+  context->localowner.id = -1;
+  context->localsignature = 0;
+  context->inline_buffer = buffer_open(sizeof(ril_inline_t), 16);
   
   context->vm = vm;
   
   return context;
 }
 
-static void _close(ril_compile_t *context)
+static void _free(ril_compile_t *context)
 {
-  ril_deletemacros(context->vm);
   stack_close(context->pair_stack);
+  arena_close(context->arena);
   buffer_close(context->label_buffer);
   buffer_close(context->cmd_buffer);
   buffer_close(context->arg_buffer);
   buffer_close(context->data_buffer);
+  if (NULL != context->labelref_buffer) buffer_close(context->labelref_buffer);
+  if (NULL != context->depend_buffer) buffer_close(context->depend_buffer);
+  if (NULL != context->checkpoint_buffer) buffer_close(context->checkpoint_buffer);
+  buffer_close(context->local_buffer);
+  buffer_close(context->inline_buffer);
   
   free(context);
 }
 
+static void _close(ril_compile_t *context)
+{
+  ril_deletecompiledmacros(context->vm);
+  _free(context);
+}
+
 static __inline void _output(buffer_t *buffer, ril_compile_t *context)
 {
   ril_common_header_t common_header;
@@ -603,6 +894,7 @@ static __inline void _output(buffer_t *buffer, ril_compile_t *context)
   
   size = common_header_size + label_size + cmd_size + arg_size + data_size;
   
+  memset(&common_header, 0, common_header_size);
   common_header.endian = ril_endian();
   common_header.cmd_size   = buffer_size(context->cmd_buffer);
   common_header.arg_size   = buffer_size(context->arg_buffer);
@@ -620,6 +912,23 @@ static __inline void _output(buffer_t *buffer, ril_compile_t *context)
   dest_cur = ril_write(dest_cur, buffer_front(context->data_buffer), data_size);
 }
 
+static RILRESULT _compileend(ril_compile_t *context, buffer_t *dest)
+{
+  // exit tag
+  if (NULL == rilc_addcmd(context, RIL_TAG_RETURN)) return RIL_ERROR;
+  rilc_addarg(context);
+  calc_writevalue2buffer(context->data_buffer, VARIANT_NULL, NULL, 0);
+  *(calc_opcode_t*)buffer_malloc(context->data_buffer, sizeof(calc_opcode_t)) = CALC_END;
+  
+  _expandinlines(context);
+  if (RIL_OPTIMIZE_NONE != context->vm->optimize.level) _optimize(context);
+  
+  _output(dest, context);
+  _close(context);
+  
+  return RIL_OK;
+}
+
 RILRESULT ril_compile(RILVM vm, const char *src, buffer_t *dest)
 {
   ril_compile_t *context = _open(vm);
@@ -629,22 +938,25 @@ RILRESULT ril_compile(RILVM vm, const char *src, buffer_t *dest)
     _close(context);
     return RIL_ERROR;
   }
+  
+  return _compileend(context, dest);
+}
 
-  // exit tag
-  if (NULL == rilc_addcmd(context, RIL_TAG_RETURN)) return RIL_ERROR;
-  rilc_addarg(context);
-  calc_writevalue2buffer(context->data_buffer, VARIANT_NULL, NULL, 0);
-  *(calc_opcode_t*)buffer_malloc(context->data_buffer, sizeof(calc_opcode_t)) = CALC_END;
+RILRESULT ril_compilestream(RILVM vm, RILREADFUNCTION read, void *userdata, buffer_t *dest)
+{
+  ril_compile_t *context = _open(vm);
   
-  _output(dest, context);
-  _close(context);
+  if (RIL_FAILED(rilc_compilestream(read, userdata, context)))
+  {
+    _close(context);
+    return RIL_ERROR;
+  }
   
-  return RIL_OK;
+  return _compileend(context, dest);
 }
 
-RILRESULT rilc_compile(const char *src, ril_compile_t *context)
+static RILRESULT _compile(ril_compile_t *context)
 {
-  const char *beforecur = context->cur;
   char word[128];
   uint8_t isschar = false;
   uint32_t id;
@@ -653,13 +965,12 @@ RILRESULT rilc_compile(const char *src, ril_compile_t *context)
   ril_cmd_t *textcmd = NULL;
   ril_label_t *label;
   
-  context->cur = src;
-  
-  while ('\0' != *context->cur)
+  while ('\0' != *_readline(context))
   {
     // left delimiter
     if (ril_isleftdelimiter(context->vm, context->cur) && !isschar)
     {
+      _readtag(context);
       context->cur += context->vm->delimiter.left.length;
       if (RIL_FAILED(_compiletag(context))) return RIL_ERROR;
       continue;
@@ -693,6 +1004,15 @@ RILRESULT rilc_compile(const char *src, ril_compile_t *context)
       if (isschar) break;
       else
       {
+        if (NULL != context->checkpoint_buffer && NULL == stack_back(context->pair_stack, NULL))
+        {
+          _addcheckpoint(context);
+          if (_resumetail(context))
+          {
+            context->cur += strlen(context->cur);
+            continue;
+          }
+        }
         context->cur = ril_getword(word, context->cur + 1, true);
         if ('\0' == word[0])
         {
@@ -718,6 +1038,7 @@ RILRESULT rilc_compile(const char *src, ril_compile_t *context)
         ++context->cur;
         continue;
       }
+      rilc_readahead(context, "*/");
       context->cur += 2;
       while ('\0' != *context->cur)
       {
@@ -773,7 +1094,2042 @@ RILRESULT rilc_compile(const char *src, ril_compile_t *context)
     return RIL_COMPILE_ERROR(context, "Parse error: syntax error, tag pair does not exist");
   }
   
+  return RIL_OK;
+}
+
+RILRESULT rilc_compile(const char *src, ril_compile_t *context)
+{
+  const char *beforecur = context->cur;
+  ril_reader_t *beforereader = context->reader;
+  buffer_t *beforecheckpoint = context->checkpoint_buffer;
+  
+  context->cur = src;
+  context->reader = NULL;
+  context->checkpoint_buffer = NULL;
+  
+  if (RIL_FAILED(_compile(context))) return RIL_ERROR;
+  
+  context->cur = beforecur;
+  context->reader = beforereader;
+  context->checkpoint_buffer = beforecheckpoint;
+  
+  return RIL_OK;
+}
+
+RILRESULT rilc_compilestream(RILREADFUNCTION read, void *userdata, ril_compile_t *context)
+{
+  const char *beforecur = context->cur;
+  ril_reader_t *beforereader = context->reader;
+  buffer_t *beforecheckpoint = context->checkpoint_buffer;
+  ril_reader_t reader;
+  RILRESULT result;
+  
+  reader.read = read;
+  reader.userdata = userdata;
+  reader.capacity = READ_CHUNK_SIZE + 1;
+  reader.buffer = (char*)ril_malloc(reader.capacity);
+  reader.buffer[0] = '\0';
+  reader.size = 0;
+  reader.ready = 0;
+  reader.eof = false;
+  reader.error = false;
+  
+  context->cur = reader.buffer;
+  context->reader = &reader;
+  context->checkpoint_buffer = NULL;
+  
+  result = _compile(context);
+  if (RIL_SUCCEEDED(result) && reader.error)
+  {
+    result = RIL_COMPILE_ERROR(context, "Fatal error: Cannot read the stream");
+  }
+  
+  ril_free(reader.buffer);
+  
   context->cur = beforecur;
+  context->reader = beforereader;
+  context->checkpoint_buffer = beforecheckpoint;
+  
+  return result;
+}
+
+static void _hashfile(FILE *fp, ril_md5_t *hash)
+{
+  md5_state_t state;
+  char buf[READ_CHUNK_SIZE];
+  int size;
+  
+  md5_init(&state);
+  while (0 < (size = ril_readfp(fp, buf, READ_CHUNK_SIZE)))
+  {
+    md5_append(&state, (const md5_byte_t*)buf, size);
+  }
+  md5_finish(&state, hash->buf);
+  rewind(fp);
+}
+
+static __inline buffer_t* _copybuffer(const buffer_t *src)
+{
+  buffer_t *dest = buffer_open(src->blocksize, buffer_size(src) + 1);
+  
+  if (!buffer_empty(src)) buffer_write(dest, buffer_front(src), buffer_size(src));
+  
+  return dest;
+}
+
+static void _deletefragment(ril_fragment_t *fragment)
+{
+  buffer_close(fragment->label_buffer);
+  buffer_close(fragment->cmd_buffer);
+  buffer_close(fragment->arg_buffer);
+  buffer_close(fragment->data_buffer);
+  buffer_close(fragment->labelref_buffer);
+  buffer_close(fragment->depend_buffer);
+  ril_free(fragment);
+}
+
+void ril_clearincludecache(RILVM vm)
+{
+  hashmap_entry_t *entry = hashmap_firstentry(vm->includecache);
+  for (; NULL != entry; entry = hashmap_nextentry(entry))
+  {
+    _deletefragment((ril_fragment_t*)hashmap_getdatabyentry(entry));
+  }
+  hashmap_clear(vm->includecache);
+}
+
+// compiles the file on its own, so that it can be spliced anywhere
+static RILRESULT _compilefragment(ril_compile_t *context, FILE *fp, const ril_md5_t *hash, ril_fragment_t **fragment)
+{
+  ril_compile_t *sub = _open(context->vm);
+  ril_fragment_t *result;
+  ril_label_t *label;
+  const uint32_t *labelref;
+  const calc_value_t *value;
+  int i;
+  
+  sub->line = context->line;
+  sub->labelref_buffer = buffer_open(sizeof(uint32_t), 16);
+  sub->depend_buffer = buffer_open(1, 64);
+  
+  *fragment = NULL;
+  if (RIL_FAILED(rilc_compilestream(ril_readfp, fp, sub)))
+  {
+    _free(sub);
+    return RIL_ERROR;
+  }
+  
+  // every label value must be found where it was written
+  for (i = 0; i < buffer_size(sub->labelref_buffer); ++i)
+  {
+    labelref = (uint32_t*)buffer_index(sub->labelref_buffer, i);
+    value = (calc_value_t*)buffer_index(sub->data_buffer, *labelref - sizeof(calc_value_t));
+    label = (ril_label_t*)buffer_index(sub->data_buffer, *labelref);
+    if (VARIANT_LABEL != value->type
+        || buffer_size(sub->label_buffer) <= label->id
+        || ((ril_label_t*)buffer_index(sub->label_buffer, label->id))->namehash != label->namehash)
+    {
+      _free(sub);
+      return RIL_OK;
+    }
+  }
+  
+  result = (ril_fragment_t*)ril_malloc(sizeof(ril_fragment_t));
+  result->hash = *hash;
+  result->lines = sub->line - context->line;
+  result->label_buffer = _copybuffer(sub->label_buffer);
+  result->cmd_buffer = _copybuffer(sub->cmd_buffer);
+  result->arg_buffer = _copybuffer(sub->arg_buffer);
+  result->data_buffer = _copybuffer(sub->data_buffer);
+  result->labelref_buffer = _copybuffer(sub->labelref_buffer);
+  result->depend_buffer = _copybuffer(sub->depend_buffer);
+  
+  _free(sub);
+  
+  *fragment = result;
   
   return RIL_OK;
 }
+
+static bool _checkdepends(const buffer_t *depend_buffer)
+{
+  const char *cur = (const char*)buffer_front(depend_buffer);
+  const char *end = cur + buffer_size(depend_buffer);
+  ril_md5_t hash;
+  FILE *fp;
+  
+  for (; cur < end; cur += sizeof(ril_md5_t) + strlen(cur + sizeof(ril_md5_t)) + 1)
+  {
+    fp = fopen(cur + sizeof(ril_md5_t), "rb");
+    if (NULL == fp) return false;
+    _hashfile(fp, &hash);
+    fclose(fp);
+    if (ril_md5cmp(hash, *(ril_md5_t*)cur)) return false;
+  }
+  
+  return true;
+}
+
+static __inline const char* _bufferstring(const buffer_t *arg_buffer, const buffer_t *data_buffer, const ril_cmd_t *cmd, int argid)
+{
+  const ril_arg_t *arg = (ril_arg_t*)buffer_index(arg_buffer, cmd->arg_offset + argid);
+  
+  return (const char*)buffer_index(data_buffer, arg->data_offset + sizeof(calc_opcode_t) + sizeof(calc_value_t));
+}
+
+// registers the macros defined by the commands from begin to end
+static void _registermacros(ril_compile_t *context, const buffer_t *cmd_buffer, const buffer_t *arg_buffer, const buffer_t *data_buffer, int begin, int end)
+{
+  const ril_cmd_t *cmd;
+  ril_tag_t *tag;
+  int i;
+  
+  for (i = begin; i < end; ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, cmd->signature);
+    if (NULL == tag || RIL_CALLCOMPILEFUNC(macro) != tag->compile_handler) continue;
+    ril_registermacro(context->vm, _bufferstring(arg_buffer, data_buffer, cmd, 0), _bufferstring(arg_buffer, data_buffer, cmd, 1));
+  }
+}
+
+/* past the CALC_END of a calc */
+static const void* _calcend(const void *src)
+{
+  calc_opcode_t op;
+  
+  do
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_PUSH == op) src = (const int8_t*)src + sizeof(calc_value_t) + ((const calc_value_t*)src)->size;
+  }
+  while (CALC_END != op);
+  
+  return src;
+}
+
+static __inline bool _isnullcalc(const void *src)
+{
+  const calc_value_t *value = (const calc_value_t*)((const calc_opcode_t*)src + 1);
+  
+  return CALC_PUSH == *(const calc_opcode_t*)src && VARIANT_NULL == value->type && CALC_END == *(const calc_opcode_t*)(value + 1);
+}
+
+static __inline bool _isatom(const void *src)
+{
+  const calc_value_t *value = (const calc_value_t*)((const calc_opcode_t*)src + 1);
+  
+  return CALC_PUSH == *(const calc_opcode_t*)src && CALC_END == *(const calc_opcode_t*)((const int8_t*)(value + 1) + value->size);
+}
+
+static __inline const void* _skipname(const void *src)
+{
+  const char *name = (const char*)src + sizeof(ril_crc_t);
+  
+  return name + strlen(name) + 1;
+}
+
+static bool _scanbody(const void *src, ril_inline_t *record, bool nested);
+
+// a parameter is substituted only where it is read whole
+static bool _scanpath(const void *src, ril_inline_t *record, bool nested, bool *isparam)
+{
+  calc_opcode_t op;
+  int32_t slot;
+  uint32_t size;
+  bool isfirst = true;
+  
+  for (;; isfirst = false)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    switch (op)
+    {
+    case VAR_END:
+      return true;
+    case VAR_SLOT:
+      src = ril_read(&slot, src, sizeof(slot));
+      src = _skipname(src);
+      if (nested || !isfirst || VAR_END != *(const calc_opcode_t*)src || slot >= record->params) return false;
+      if (record->used & (1u << slot)) record->reused |= 1u << slot;
+      record->used |= 1u << slot;
+      *isparam = true;
+      break;
+    case VAR_HASH:
+      src = _skipname(src);
+      break;
+    case VAR_CALC:
+      src = ril_read(&size, src, sizeof(size));
+      if (!_scanbody(src, record, true)) return false;
+      src = (const int8_t*)src + size;
+      break;
+    }
+  }
+}
+
+// counts the parameter reads of a calc in the body, false when one is written
+static bool _scanbody(const void *src, ril_inline_t *record, bool nested)
+{
+  bool stack[INLINE_STACK_SIZE], isparam;
+  const calc_value_t *value;
+  calc_opcode_t op;
+  int depth = 0;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    switch (op)
+    {
+    case CALC_END:
+      return true;
+    case CALC_PUSH:
+      value = (const calc_value_t*)src;
+      src = (const int8_t*)(value + 1) + value->size;
+      isparam = false;
+      if (VARIANT_LABEL == value->type || INLINE_STACK_SIZE <= depth) return false;
+      if (VARIANT_VAR == value->type || VARIANT_REFVAR == value->type)
+      {
+        if (!_scanpath(value + 1, record, nested, &isparam)) return false;
+        if (isparam && VARIANT_REFVAR == value->type) return false;
+      }
+      stack[depth++] = isparam;
+      break;
+    case CALC_MOVE:
+      record->haswrite = true;
+      if (2 > depth || stack[depth - 2]) return false;
+      stack[--depth - 1] = false;
+      break;
+    case CALC_INCFRONT:
+    case CALC_INCBACK:
+    case CALC_DECFRONT:
+    case CALC_DECBACK:
+      record->haswrite = true;
+      if (1 > depth || stack[depth - 1]) return false;
+      break;
+    case CALC_NOT:
+    case CALC_NEG:
+      if (1 > depth) return false;
+      stack[depth - 1] = false;
+      break;
+    default:
+      if (2 > depth) return false;
+      stack[--depth - 1] = false;
+      break;
+    }
+  }
+}
+
+enum
+{
+  _ARG_VAR = 1,
+  _ARG_WRITE = 2
+};
+
+static int _argflags(const void *src)
+{
+  const calc_value_t *value;
+  const void *path;
+  calc_opcode_t op;
+  uint32_t size;
+  int flags = 0;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_END == op) return flags;
+    if (CALC_MOVE == op || (CALC_INCFRONT <= op && CALC_DECBACK >= op)) flags |= _ARG_WRITE;
+    if (CALC_PUSH != op) continue;
+    
+    value = (const calc_value_t*)src;
+    src = (const int8_t*)(value + 1) + value->size;
+    if (VARIANT_LABEL == value->type || VARIANT_REFVAR == value->type) flags |= _ARG_WRITE;
+    if (VARIANT_VAR != value->type) continue;
+    
+    flags |= _ARG_VAR;
+    for (path = value + 1; VAR_END != (op = *(const calc_opcode_t*)path);)
+    {
+      path = (const calc_opcode_t*)path + 1;
+      if (VAR_SLOT == op) path = (const int32_t*)path + 1;
+      if (VAR_SLOT == op || VAR_HASH == op) path = _skipname(path);
+      if (VAR_CALC != op) continue;
+      path = ril_read(&size, path, sizeof(size));
+      flags |= _argflags(path);
+      path = (const int8_t*)path + size;
+    }
+  }
+}
+
+// false when the body reads a name that is one of the locals of the calling macro
+static bool _checkfree(const ril_crc_t *locals, int count, const void *src)
+{
+  const calc_value_t *value;
+  const void *path;
+  calc_opcode_t op;
+  uint32_t size;
+  int i;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_END == op) return true;
+    if (CALC_PUSH != op) continue;
+    
+    value = (const calc_value_t*)src;
+    src = (const int8_t*)(value + 1) + value->size;
+    if (VARIANT_VAR != value->type && VARIANT_REFVAR != value->type) continue;
+    
+    path = value + 1;
+    if (VAR_HASH == *(const calc_opcode_t*)path)
+    {
+      for (i = 0; i < count; ++i)
+      {
+        if (locals[i] == *(const ril_crc_t*)((const calc_opcode_t*)path + 1)) return false;
+      }
+    }
+    for (; VAR_END != (op = *(const calc_opcode_t*)path);)
+    {
+      path = (const calc_opcode_t*)path + 1;
+      if (VAR_SLOT == op) path = (const int32_t*)path + 1;
+      if (VAR_SLOT == op || VAR_HASH == op) path = _skipname(path);
+      if (VAR_CALC != op) continue;
+      path = ril_read(&size, path, sizeof(size));
+      if (!_checkfree(locals, count, path)) return false;
+      path = (const int8_t*)path + size;
+    }
+  }
+}
+
+// copies a calc of the body with each parameter read replaced by its argument
+static void _substitute(buffer_t *dest, const void *src, const buffer_t *args, const int *offsets)
+{
+  const calc_value_t *value;
+  calc_opcode_t op;
+  int32_t slot;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_PUSH != op)
+    {
+      calc_writeoperator(dest, op);
+      if (CALC_END == op) return;
+      continue;
+    }
+    
+    value = (const calc_value_t*)src;
+    src = (const int8_t*)(value + 1) + value->size;
+    if (VARIANT_VAR == value->type && VAR_SLOT == *(const calc_opcode_t*)(value + 1))
+    {
+      ril_read(&slot, (const calc_opcode_t*)(value + 1) + 1, sizeof(slot));
+      buffer_write(dest, buffer_index(args, offsets[slot]), offsets[slot + 1] - offsets[slot] - sizeof(calc_opcode_t));
+      continue;
+    }
+    calc_writeoperator(dest, op);
+    buffer_write(dest, value, sizeof(calc_value_t) + value->size);
+  }
+}
+
+static __inline ril_inline_t* _findinline(ril_compile_t *context, ril_signature_t signature)
+{
+  ril_inline_t *record;
+  int i;
+  
+  for (i = buffer_size(context->inline_buffer) - 1; 0 <= i; --i)
+  {
+    record = (ril_inline_t*)buffer_index(context->inline_buffer, i);
+    if (signature == record->signature) return record;
+  }
+  
+  return NULL;
+}
+
+static __inline const void* _cmdargument(ril_compile_t *context, const ril_cmd_t *cmd, int argid)
+{
+  return buffer_index(context->data_buffer, ((ril_arg_t*)buffer_index(context->arg_buffer, cmd->arg_offset + argid))->data_offset);
+}
+
+// a body of a few [ch], [r] and [let] without locals of its own, at most ending in [return]
+static bool _checkinline(ril_compile_t *context, const ril_cmd_t *macro, ril_inline_t *record)
+{
+  const ril_cmd_t *cmd;
+  const calc_value_t *value;
+  ril_tag_t *tag;
+  ril_parameter_t *param;
+  int i, k;
+  
+  if (INLINE_CMD_SIZE < record->end - record->begin || RIL_ARGUMENT_SIZE < record->params) return false;
+  
+  value = (const calc_value_t*)((const calc_opcode_t*)_cmdargument(context, macro, 2) + 1);
+  if (record->params != *(const int32_t*)((const uint32_t*)(value + 1) + 1)) return false;
+  
+  tag = ril_getregisteredtag2(context->vm, record->signature);
+  for (i = 0; i < record->params; ++i)
+  {
+    param = (ril_parameter_t*)buffer_index(tag->param_buffer, i);
+    if (param->isrefvar) return false;
+  }
+  
+  for (i = record->begin; i < record->end; ++i)
+  {
+    cmd = (const ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, cmd->signature);
+    if (i != (int)cmd->pair_cmdid.id || i != (int)cmd->parent_cmdid.id) return false;
+    if (RIL_TAG_RETURN == cmd->signature ? i + 1 != record->end
+        : RIL_TAG_CH != cmd->signature && RIL_TAG_R != cmd->signature && RIL_CALLFUNC(let) != tag->execute_handler) return false;
+    for (k = buffer_size(tag->param_buffer) - 1; 0 <= k; --k)
+    {
+      if (!_scanbody(_cmdargument(context, cmd, k), record, false)) return false;
+    }
+  }
+  
+  return true;
+}
+
+// a second definition of the macro keeps the calls of both
+static void _addinline(ril_compile_t *context, int macroid)
+{
+  const ril_cmd_t *macro = (const ril_cmd_t*)buffer_index(context->cmd_buffer, macroid);
+  ril_tag_t *tag;
+  ril_inline_t record, *previous;
+  
+  tag = ril_getregisteredtag(context->vm, _bufferstring(context->arg_buffer, context->data_buffer, macro, 0), _bufferstring(context->arg_buffer, context->data_buffer, macro, 1));
+  if (NULL == tag) return;
+  
+  previous = _findinline(context, ril_signature(tag));
+  if (NULL != previous)
+  {
+    previous->begin = -1;
+    return;
+  }
+  
+  record.signature = ril_signature(tag);
+  record.begin = macroid + 1;
+  record.end = macro->pair_cmdid.id;
+  record.params = buffer_size(tag->param_buffer);
+  record.haswrite = false;
+  record.used = 0;
+  record.reused = 0;
+  if (!_checkinline(context, macro, &record)) record.begin = -1;
+  
+  buffer_write(context->inline_buffer, &record, 1);
+}
+
+static __inline RILFUNCTION _cmdhandler(ril_compile_t *context, int cmdid)
+{
+  ril_tag_t *tag = ril_getregisteredtag2(context->vm, ((const ril_cmd_t*)buffer_index(context->cmd_buffer, cmdid))->signature);
+  
+  return NULL != tag ? tag->execute_handler : NULL;
+}
+
+// the locals of the macro around a call, none at the top level
+static int _callerlocals(ril_compile_t *context, int macroid, const ril_crc_t **locals)
+{
+  const calc_value_t *value;
+  const int32_t *count;
+  
+  *locals = NULL;
+  if (0 > macroid) return 0;
+  
+  value = (const calc_value_t*)((const calc_opcode_t*)_cmdargument(context, (const ril_cmd_t*)buffer_index(context->cmd_buffer, macroid), 2) + 1);
+  count = (const int32_t*)((const uint32_t*)(value + 1) + 1);
+  *locals = (const ril_crc_t*)(count + 1);
+  
+  return *count;
+}
+
+// the commands that replace the call, or -1 when it is kept
+static int _inlinesize(ril_compile_t *context, int callid, int macroid)
+{
+  const ril_cmd_t *call = (const ril_cmd_t*)buffer_index(context->cmd_buffer, callid), *body;
+  ril_inline_t *record = _findinline(context, call->signature);
+  const ril_crc_t *locals;
+  const void *src;
+  ril_tag_t *tag;
+  int i, k, flags, count, size = 0;
+  
+  if (NULL == record || 0 > record->begin) return -1;
+  
+  // an argument is evaluated where its parameter is read
+  for (i = 0; i < record->params; ++i)
+  {
+    src = _cmdargument(context, call, i);
+    flags = _argflags(src);
+    if (flags & _ARG_WRITE) return -1;
+    if ((flags & _ARG_VAR) && (record->haswrite || !(record->used & (1u << i)))) return -1;
+    if ((record->reused & (1u << i)) && !_isatom(src)) return -1;
+  }
+  
+  count = _callerlocals(context, macroid, &locals);
+  for (i = record->begin; i < record->end; ++i)
+  {
+    body = (const ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, body->signature);
+    for (k = buffer_size(tag->param_buffer) - 1; 0 <= k; --k)
+    {
+      if (!_checkfree(locals, count, _cmdargument(context, body, k))) return -1;
+    }
+    if (RIL_TAG_RETURN != body->signature || !_isnullcalc(_cmdargument(context, body, 0))) ++size;
+  }
+  
+  return size;
+}
+
+// writes the body of the macro in place of the call
+static void _expandcall(ril_compile_t *context, int callid, buffer_t *cmds, buffer_t *args)
+{
+  const ril_cmd_t *call = (const ril_cmd_t*)buffer_index(context->cmd_buffer, callid), *body;
+  ril_inline_t *record = _findinline(context, call->signature);
+  ril_signature_t signature;
+  ril_cmd_t *cmd;
+  ril_arg_t *arg;
+  buffer_t *values, *code;
+  const void *src;
+  int offsets[RIL_ARGUMENT_SIZE + 1], i, k, argc;
+  
+  values = buffer_open(1, 256);
+  for (i = 0; i < record->params; ++i)
+  {
+    src = _cmdargument(context, call, i);
+    offsets[i] = buffer_size(values);
+    buffer_write(values, src, (const int8_t*)_calcend(src) - (const int8_t*)src);
+  }
+  offsets[record->params] = buffer_size(values);
+  
+  code = buffer_open(1, 256);
+  for (i = record->begin; i < record->end; ++i)
+  {
+    body = (const ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    signature = body->signature;
+    if (RIL_TAG_RETURN == signature)
+    {
+      // the value goes to a pending [set] as the return would
+      if (_isnullcalc(_cmdargument(context, body, 0))) break;
+      signature = ril_signature(ril_getregisteredtag(context->vm, "returnvalue", "value"));
+    }
+    argc = buffer_size(ril_getregisteredtag2(context->vm, body->signature)->param_buffer);
+    
+    cmd = (ril_cmd_t*)buffer_malloc(cmds, 1);
+    cmd->signature = signature;
+    cmd->arg_offset = buffer_size(args);
+    cmd->pair_cmdid.id = buffer_size(cmds) - 1;
+    cmd->parent_cmdid.id = cmd->pair_cmdid.id;
+    for (k = 0; k < argc; ++k)
+    {
+      buffer_clear(code);
+      _substitute(code, _cmdargument(context, body, k), values, offsets);
+      arg = (ril_arg_t*)buffer_malloc(args, 1);
+      arg->data_offset = buffer_size(context->data_buffer);
+      buffer_write(context->data_buffer, buffer_front(code), buffer_size(code));
+    }
+  }
+  buffer_close(code);
+  buffer_close(values);
+}
+
+// replaces the calls of small macros by their bodies. it runs on the whole program,
+// so a macro defined again anywhere keeps every call, before or after the definition.
+static void _expandinlines(ril_compile_t *context)
+{
+  int i, size = buffer_size(context->cmd_buffer), cmdsize = 0, count = 0, macroid = -1, argend;
+  int32_t *cmdmap, *sizes;
+  buffer_t *cmds, *args;
+  RILFUNCTION handler;
+  ril_cmd_t *cmd;
+  ril_label_t *label;
+  
+  buffer_clear(context->inline_buffer);
+  for (i = 0; i < size; ++i)
+  {
+    if (RIL_CALLFUNC(endmacro) == _cmdhandler(context, i)) _addinline(context, ((ril_cmd_t*)buffer_index(context->cmd_buffer, i))->pair_cmdid.id);
+  }
+  
+  cmdmap = (int32_t*)ril_malloc(sizeof(int32_t) * size);
+  sizes = (int32_t*)ril_malloc(sizeof(int32_t) * size);
+  for (i = 0; i < size; ++i)
+  {
+    handler = _cmdhandler(context, i);
+    if (RIL_CALLFUNC(macro) == handler) macroid = i;
+    else if (RIL_CALLFUNC(endmacro) == handler) macroid = -1;
+    sizes[i] = RIL_CALLFUNC(callmacro) == handler ? _inlinesize(context, i, macroid) : -1;
+    if (0 <= sizes[i]) ++count;
+    cmdmap[i] = cmdsize;
+    cmdsize += 0 > sizes[i] ? 1 : sizes[i];
+  }
+  
+  if (0 < count)
+  {
+    cmds = buffer_open(sizeof(ril_cmd_t), cmdsize + 1);
+    args = buffer_open(sizeof(ril_arg_t), buffer_size(context->arg_buffer) + 1);
+    for (i = 0; i < size; ++i)
+    {
+      if (0 <= sizes[i])
+      {
+        _expandcall(context, i, cmds, args);
+        continue;
+      }
+      cmd = (ril_cmd_t*)buffer_malloc(cmds, 1);
+      *cmd = *(ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+      argend = i + 1 < size ? (int)((ril_cmd_t*)buffer_index(context->cmd_buffer, i + 1))->arg_offset : buffer_size(context->arg_buffer);
+      if (argend > (int)cmd->arg_offset) buffer_write(args, buffer_index(context->arg_buffer, cmd->arg_offset), argend - cmd->arg_offset);
+      cmd->arg_offset = buffer_size(args) - (argend - cmd->arg_offset);
+      cmd->pair_cmdid.id = cmdmap[cmd->pair_cmdid.id];
+      cmd->parent_cmdid.id = cmdmap[cmd->parent_cmdid.id];
+    }
+    buffer_close(context->cmd_buffer);
+    buffer_close(context->arg_buffer);
+    context->cmd_buffer = cmds;
+    context->arg_buffer = args;
+    
+    for (i = buffer_size(context->label_buffer) - 1; 0 <= i; --i)
+    {
+      label = (ril_label_t*)buffer_index(context->label_buffer, i);
+      if (LABEL_NULL != label->cmdid) label->cmdid = cmdmap[label->cmdid];
+    }
+    context->cmdid.id = cmdsize - 1;
+    context->cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, context->cmdid.id);
+  }
+  
+  ril_free(sizes);
+  ril_free(cmdmap);
+}
+
+typedef struct
+{
+  int begin;
+  int end;
+  bool invariant;
+  bool hasop;
+  bool hasvar;
+} _hoistnode_t;
+
+static __inline ril_crc_t _rootof(const calc_value_t *value)
+{
+  const calc_opcode_t *path = (const calc_opcode_t*)(value + 1);
+  
+  return *(const ril_crc_t*)((const int8_t*)(path + 1) + (VAR_SLOT == *path ? sizeof(int32_t) : 0));
+}
+
+static __inline bool _iswritten(const buffer_t *writes, ril_crc_t root)
+{
+  int i;
+  
+  for (i = buffer_size(writes) - 1; 0 <= i; --i)
+  {
+    if (root == *(const ril_crc_t*)buffer_index(writes, i)) return true;
+  }
+  
+  return false;
+}
+
+static __inline void _addwrite(buffer_t *writes, const calc_value_t *value)
+{
+  ril_crc_t root = _rootof(value);
+  
+  if (!_iswritten(writes, root)) buffer_write(writes, &root, 1);
+}
+
+// collects the variables a calc writes, false when it refers to a label
+static bool _hoistwrites(const void *src, buffer_t *writes)
+{
+  const calc_value_t *stack[HOIST_STACK_SIZE], *value;
+  const void *path;
+  calc_opcode_t op;
+  uint32_t size;
+  int depth = 0;
+  bool front = false;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    switch (op)
+    {
+    case CALC_END:
+      return true;
+    case CALC_PUSH:
+      value = (const calc_value_t*)src;
+      src = (const int8_t*)(value + 1) + value->size;
+      if (VARIANT_LABEL == value->type || HOIST_STACK_SIZE <= depth) return false;
+      stack[depth++] = NULL;
+      if (VARIANT_VAR != value->type && VARIANT_REFVAR != value->type) break;
+      stack[depth - 1] = value;
+      if (front || VARIANT_REFVAR == value->type) _addwrite(writes, value);
+      front = false;
+      for (path = value + 1; VAR_END != (op = *(const calc_opcode_t*)path);)
+      {
+        path = (const calc_opcode_t*)path + 1;
+        if (VAR_ADD == op) _addwrite(writes, value);
+        if (VAR_SLOT == op) path = (const int32_t*)path + 1;
+        if (VAR_SLOT == op || VAR_HASH == op) path = _skipname(path);
+        if (VAR_CALC != op) continue;
+        path = ril_read(&size, path, sizeof(size));
+        if (!_hoistwrites(path, writes)) return false;
+        path = (const int8_t*)path + size;
+      }
+      break;
+    case CALC_MOVE:
+      if (2 > depth) return false;
+      if (NULL != stack[depth - 2]) _addwrite(writes, stack[depth - 2]);
+      stack[--depth - 1] = NULL;
+      break;
+    case CALC_INCFRONT:
+    case CALC_DECFRONT:
+      front = true;
+      break;
+    case CALC_INCBACK:
+    case CALC_DECBACK:
+      if (1 > depth) return false;
+      if (NULL != stack[depth - 1]) _addwrite(writes, stack[depth - 1]);
+      --depth;
+      break;
+    case CALC_NOT:
+    case CALC_NEG:
+      if (1 > depth) return false;
+      stack[depth - 1] = NULL;
+      break;
+    default:
+      if (2 > depth) return false;
+      stack[--depth - 1] = NULL;
+      break;
+    }
+  }
+}
+
+static bool _isinvariant(const void *src, const buffer_t *writes);
+
+// a variable the loop leaves alone, the temporaries of inner loops are not
+static bool _invariantpath(const calc_value_t *value, const buffer_t *writes)
+{
+  const void *path;
+  calc_opcode_t op;
+  uint32_t size;
+  
+  if (VARIANT_VAR != value->type || _iswritten(writes, _rootof(value))) return false;
+  
+  for (path = value + 1;;)
+  {
+    op = *(const calc_opcode_t*)path;
+    path = (const calc_opcode_t*)path + 1;
+    switch (op)
+    {
+    case VAR_END:
+      return true;
+    case VAR_ADD:
+      return false;
+    case VAR_SLOT:
+      path = (const int32_t*)path + 1;
+      /* fall through */
+    case VAR_HASH:
+      if ('#' == *((const char*)path + sizeof(ril_crc_t))) return false;
+      path = _skipname(path);
+      break;
+    case VAR_CALC:
+      path = ril_read(&size, path, sizeof(size));
+      if (!_isinvariant(path, writes)) return false;
+      path = (const int8_t*)path + size;
+      break;
+    }
+  }
+}
+
+static __inline bool _isconstant(const calc_value_t *value)
+{
+  return VARIANT_NULL == value->type || VARIANT_INTEGER == value->type || VARIANT_REAL == value->type
+    || (VARIANT_LITERAL | VARIANT_STRING) == value->type;
+}
+
+static bool _isinvariant(const void *src, const buffer_t *writes)
+{
+  const calc_value_t *value;
+  calc_opcode_t op;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_END == op) return true;
+    if (CALC_MOVE == op || (CALC_INCFRONT <= op && CALC_DECBACK >= op)) return false;
+    if (CALC_PUSH != op) continue;
+    
+    value = (const calc_value_t*)src;
+    src = (const int8_t*)(value + 1) + value->size;
+    if (!_isconstant(value) && !_invariantpath(value, writes)) return false;
+  }
+}
+
+static __inline void _addcandidate(const _hoistnode_t *node, int *ranges, int *count)
+{
+  if (!node->invariant || !node->hasop || !node->hasvar || HOIST_SIZE <= *count) return;
+  
+  ranges[*count * 2] = node->begin;
+  ranges[*count * 2 + 1] = node->end;
+  ++*count;
+}
+
+static __inline void _writetemp(buffer_t *dest, const char *name)
+{
+  ril_crc_t namehash = ril_makecrc(name);
+  
+  calc_writevalue2buffer(dest, VARIANT_VAR, NULL, sizeof(calc_opcode_t) * 2 + sizeof(namehash) + strlen(name) + 1);
+  calc_writeoperator(dest, VAR_HASH);
+  buffer_write(dest, &namehash, sizeof(namehash));
+  buffer_write(dest, name, strlen(name) + 1);
+  calc_writeoperator(dest, VAR_END);
+}
+
+// copies a calc with its largest invariant subexpressions read from temporaries,
+// which are named by their code so the same expression shares one
+static bool _hoistcalc(const void *src, const buffer_t *writes, buffer_t *dest, buffer_t *hoists, buffer_t *temps)
+{
+  _hoistnode_t stack[HOIST_STACK_SIZE], *node;
+  const calc_value_t *value;
+  const int8_t *cur = (const int8_t*)src;
+  calc_opcode_t op;
+  int ranges[HOIST_SIZE * 2], count = 0, depth = 0, at, front = -1, i, j, temp, offset;
+  char name[16];
+  ril_crc_t namehash;
+  bool invariant;
+  
+  for (;;)
+  {
+    at = cur - (const int8_t*)src;
+    op = *(const calc_opcode_t*)cur;
+    cur += sizeof(calc_opcode_t);
+    if (CALC_END == op) break;
+    switch (op)
+    {
+    case CALC_PUSH:
+      value = (const calc_value_t*)cur;
+      cur = (const int8_t*)(value + 1) + value->size;
+      if (HOIST_STACK_SIZE <= depth) return false;
+      node = &stack[depth++];
+      node->begin = 0 <= front ? front : at;
+      node->end = cur - (const int8_t*)src;
+      node->invariant = 0 > front && (_isconstant(value) || _invariantpath(value, writes));
+      node->hasop = false;
+      node->hasvar = VARIANT_VAR == value->type;
+      front = -1;
+      break;
+    case CALC_INCFRONT:
+    case CALC_DECFRONT:
+      front = at;
+      break;
+    case CALC_INCBACK:
+    case CALC_DECBACK:
+      if (2 > depth) return false;
+      node = &stack[--depth - 1];
+      node->end = cur - (const int8_t*)src;
+      node->invariant = false;
+      break;
+    case CALC_NOT:
+    case CALC_NEG:
+      if (1 > depth) return false;
+      node = &stack[depth - 1];
+      node->end = cur - (const int8_t*)src;
+      node->hasop = true;
+      break;
+    default:
+      if (2 > depth) return false;
+      node = &stack[--depth - 1];
+      invariant = CALC_MOVE != op && node->invariant && node[1].invariant;
+      if (!invariant)
+      {
+        _addcandidate(node, ranges, &count);
+        _addcandidate(&node[1], ranges, &count);
+      }
+      node->end = cur - (const int8_t*)src;
+      node->invariant = invariant;
+      node->hasop = true;
+      node->hasvar |= node[1].hasvar;
+      break;
+    }
+  }
+  for (i = 0; i < depth; ++i) _addcandidate(&stack[i], ranges, &count);
+  if (0 == count) return false;
+  
+  // in the order of the code
+  for (i = 1; i < count; ++i)
+  {
+    for (j = i; 0 < j && ranges[j * 2 - 2] > ranges[j * 2]; --j)
+    {
+      temp = ranges[j * 2 - 2]; ranges[j * 2 - 2] = ranges[j * 2]; ranges[j * 2] = temp;
+      temp = ranges[j * 2 - 1]; ranges[j * 2 - 1] = ranges[j * 2 + 1]; ranges[j * 2 + 1] = temp;
+    }
+  }
+  
+  for (i = 0, at = 0; i < count; ++i)
+  {
+    buffer_write(dest, (const int8_t*)src + at, ranges[i * 2] - at);
+    at = ranges[i * 2 + 1];
+    sprintf(name, "#%08x", (unsigned int)crc((const int8_t*)src + ranges[i * 2], at - ranges[i * 2], 0));
+    _writetemp(dest, name);
+    
+    namehash = ril_makecrc(name);
+    if (_iswritten(temps, namehash)) continue;
+    buffer_write(temps, &namehash, 1);
+    
+    // [size] $temp = expression
+    offset = buffer_size(hoists);
+    buffer_malloc(hoists, sizeof(uint32_t));
+    _writetemp(hoists, name);
+    buffer_write(hoists, (const int8_t*)src + ranges[i * 2], at - ranges[i * 2]);
+    calc_writeoperator(hoists, CALC_MOVE);
+    calc_writeoperator(hoists, CALC_END);
+    *(uint32_t*)buffer_index(hoists, offset) = buffer_size(hoists) - offset - sizeof(uint32_t);
+  }
+  buffer_write(dest, (const int8_t*)src + at, (const int8_t*)_calcend(src) - (const int8_t*)src - at);
+  
+  return true;
+}
+
+// the tags a hoisted loop may hold, which write variables only through calcs and & parameters
+static bool _hoistsafe(const ril_cmd_t *cmd, const ril_tag_t *tag)
+{
+  static const RILFUNCTION handlers[] = {
+    RIL_CALLFUNC(let), RIL_CALLFUNC(const), RIL_CALLFUNC(set), RIL_CALLFUNC(unset),
+    RIL_CALLFUNC(isnull), RIL_CALLFUNC(isint), RIL_CALLFUNC(isreal), RIL_CALLFUNC(isarray), RIL_CALLFUNC(isstring),
+    RIL_CALLFUNC(if), RIL_CALLFUNC(elseif), RIL_CALLFUNC(else), RIL_CALLFUNC(endif),
+    RIL_CALLFUNC(switch), RIL_CALLFUNC(case), RIL_CALLFUNC(default), RIL_CALLFUNC(endswitch),
+    RIL_CALLFUNC(while), RIL_CALLFUNC(endwhile), RIL_CALLFUNC(do), RIL_CALLFUNC(dowhile),
+    RIL_CALLFUNC(foreach), RIL_CALLFUNC(endforeach), RIL_CALLFUNC(for), RIL_CALLFUNC(endfor),
+    RIL_CALLFUNC(break), RIL_CALLFUNC(continue),
+    RIL_CALLFUNC(hoistwhile), RIL_CALLFUNC(hoistdo), RIL_CALLFUNC(hoistforeach), RIL_CALLFUNC(hoistfor),
+    RIL_CALLFUNC(count), RIL_CALLFUNC(substr), RIL_CALLFUNC(strlen), RIL_CALLFUNC(strtok)
+  };
+  int i;
+  
+  if (NULL == tag) return false;
+  if (RIL_TAG_CH == cmd->signature || RIL_TAG_R == cmd->signature) return true;
+  for (i = sizeof(handlers) / sizeof(handlers[0]) - 1; 0 <= i; --i)
+  {
+    if (handlers[i] == tag->execute_handler) return true;
+  }
+  
+  return false;
+}
+
+static bool _returnsvalue(const ril_tag_t *tag)
+{
+  static const RILFUNCTION handlers[] = {
+    RIL_CALLFUNC(isnull), RIL_CALLFUNC(isint), RIL_CALLFUNC(isreal), RIL_CALLFUNC(isarray), RIL_CALLFUNC(isstring),
+    RIL_CALLFUNC(count), RIL_CALLFUNC(substr), RIL_CALLFUNC(strlen), RIL_CALLFUNC(strtok)
+  };
+  int i;
+  
+  for (i = sizeof(handlers) / sizeof(handlers[0]) - 1; 0 <= i; --i)
+  {
+    if (handlers[i] == tag->execute_handler) return true;
+  }
+  
+  return false;
+}
+
+// a returned value goes to the variable of the last [set], which may be any variable
+// unless a [set] of the body runs before it in every iteration
+static bool _capturesreturns(ril_compile_t *context, int loopid, int end)
+{
+  ril_cmd_t *cmd;
+  ril_tag_t *tag;
+  int i, depth = 0;
+  bool captured = false;
+  
+  for (i = loopid + 1; i < end; ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, cmd->signature);
+    if (0 < tag->refcount && (int)cmd->pair_cmdid.id < i) --depth;
+    else if (0 == tag->refcount && 0 < buffer_size(tag->pair_buffer)) ++depth;
+    if (RIL_CALLFUNC(set) == tag->execute_handler && 0 == depth) captured = true;
+    else if (!captured && _returnsvalue(tag)) return false;
+  }
+  
+  return true;
+}
+
+static __inline ril_tag_t* _hoisttag(RILVM vm, const ril_tag_t *tag)
+{
+  if (RIL_CALLFUNC(while) == tag->execute_handler) return ril_getregisteredtag(vm, "while", "value, hoist");
+  if (RIL_CALLFUNC(do) == tag->execute_handler) return ril_getregisteredtag(vm, "do", "hoist");
+  if (RIL_CALLFUNC(for) == tag->execute_handler)
+  {
+    return ril_getregisteredtag(vm, tag->name, strcmp(tag->name, "for") ? "&item, from, to, step, hoist" : "&var, from, to, step, hoist");
+  }
+  if (RIL_CALLFUNC(foreach) != tag->execute_handler) return NULL;
+  
+  return ril_getregisteredtag(vm, "foreach", 3 == buffer_size(tag->param_buffer) ? "&from, &item, &key, hoist" : "&from, &item, hoist");
+}
+
+// the loop just closed computes the invariant expressions of its body once it is entered,
+// the body is read where every entered iteration reaches it and the rest of the loop writes
+void rilc_hoist(ril_compile_t *context, int loopid)
+{
+  ril_cmd_t *loop = (ril_cmd_t*)buffer_index(context->cmd_buffer, loopid), *cmd;
+  ril_tag_t *tag = ril_getregisteredtag2(context->vm, loop->signature), *hoisttag;
+  buffer_t *writes, *hoists, *temps, *code;
+  ril_arg_t *arg;
+  int i, k, end = context->cmdid.id, depth = 0, pos;
+  uint32_t size;
+  bool reach = true, guaranteed;
+  
+  if (NULL == tag || NULL == (hoisttag = _hoisttag(context->vm, tag))) return;
+  
+  writes = buffer_open(sizeof(ril_crc_t), 16);
+  for (i = loopid; i <= end; ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, cmd->signature);
+    if (!_hoistsafe(cmd, tag)) break;
+    for (k = buffer_size(tag->param_buffer) - 1; 0 <= k; --k)
+    {
+      if (!_hoistwrites(_cmdargument(context, cmd, k), writes)) break;
+    }
+    if (0 <= k) break;
+  }
+  if (i <= end || !_capturesreturns(context, loopid, end))
+  {
+    buffer_close(writes);
+    return;
+  }
+  
+  hoists = buffer_open(1, 256);
+  temps = buffer_open(sizeof(ril_crc_t), 16);
+  code = buffer_open(1, 256);
+  for (i = loopid + 1; i <= end; ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, i);
+    tag = ril_getregisteredtag2(context->vm, cmd->signature);
+    if (i == end) guaranteed = reach;
+    else if (0 < tag->refcount && (int)cmd->pair_cmdid.id < i)
+    {
+      --depth;
+      guaranteed = reach && 0 == depth;
+    }
+    else if (0 < tag->refcount) guaranteed = false;
+    else
+    {
+      guaranteed = reach && 0 == depth;
+      if (0 < buffer_size(tag->pair_buffer)) ++depth;
+    }
+    if (RIL_CALLFUNC(break) == tag->execute_handler || RIL_CALLFUNC(continue) == tag->execute_handler) reach = false;
+    if (!guaranteed) continue;
+    
+    for (k = buffer_size(tag->param_buffer) - 1; 0 <= k; --k)
+    {
+      buffer_clear(code);
+      if (!_hoistcalc(_cmdargument(context, cmd, k), writes, code, hoists, temps)) continue;
+      arg = rilc_getarg(context, cmd, k);
+      arg->data_offset = buffer_size(context->data_buffer);
+      buffer_write(context->data_buffer, buffer_front(code), buffer_size(code));
+    }
+  }
+  
+  // the loop takes the calcs as the last argument of its hoisting tag
+  if (!buffer_empty(hoists))
+  {
+    pos = loop->arg_offset + buffer_size(ril_getregisteredtag2(context->vm, loop->signature)->param_buffer);
+    buffer_malloc(context->arg_buffer, 1);
+    memmove(buffer_index(context->arg_buffer, pos + 1), buffer_index(context->arg_buffer, pos), sizeof(ril_arg_t) * (buffer_size(context->arg_buffer) - 1 - pos));
+    arg = (ril_arg_t*)buffer_index(context->arg_buffer, pos);
+    arg->data_offset = buffer_size(context->data_buffer);
+    size = buffer_size(hoists);
+    calc_writevalue2buffer(context->data_buffer, VARIANT_LITERAL | VARIANT_BYTES, NULL, sizeof(size) + size);
+    buffer_write(context->data_buffer, &size, sizeof(size));
+    buffer_write(context->data_buffer, buffer_front(hoists), size);
+    calc_writeoperator(context->data_buffer, CALC_END);
+    for (i = loopid + 1; i <= end; ++i) ++((ril_cmd_t*)buffer_index(context->cmd_buffer, i))->arg_offset;
+    loop->signature = ril_signature(hoisttag);
+  }
+  
+  buffer_close(code);
+  buffer_close(temps);
+  buffer_close(hoists);
+  buffer_close(writes);
+}
+
+static __inline ril_cmd_t* _optcmd(ril_compile_t *context, int cmdid)
+{
+  return (ril_cmd_t*)buffer_index(context->cmd_buffer, cmdid);
+}
+
+static __inline RILFUNCTION _opthandler(ril_compile_t *context, int cmdid)
+{
+  ril_tag_t *tag = ril_getregisteredtag2(context->vm, _optcmd(context, cmdid)->signature);
+  
+  return NULL != tag ? tag->execute_handler : NULL;
+}
+
+// a calc of literals only, it reads and writes nothing
+static bool _isliteralcalc(const void *src)
+{
+  const calc_value_t *value;
+  calc_opcode_t op;
+  
+  for (;;)
+  {
+    op = *(const calc_opcode_t*)src;
+    src = (const calc_opcode_t*)src + 1;
+    if (CALC_END == op) return true;
+    if (CALC_MOVE == op || (CALC_INCFRONT <= op && CALC_DECBACK >= op)) return false;
+    if (CALC_PUSH != op) continue;
+    
+    value = (const calc_value_t*)src;
+    src = (const int8_t*)(value + 1) + value->size;
+    if (!_isconstant(value) && (VARIANT_LITERAL | VARIANT_BYTES) != value->type) return false;
+  }
+}
+
+// whether a condition of a single literal holds, or -1 for any other calc
+static int _literalbool(ril_compile_t *context, const void *src)
+{
+  const calc_value_t *value = (const calc_value_t*)((const calc_opcode_t*)src + 1);
+  
+  if (!_isatom(src) || !_isconstant(value)) return -1;
+  if (VARIANT_NULL == value->type) return 0;
+  
+  return 0 != ril_var2integer(context->vm, calc_execute(context->vm, src)->var);
+}
+
+// the label a builtin [goto] always jumps to, or NULL
+static ril_label_t* _gotolabel(ril_compile_t *context, int cmdid)
+{
+  const void *src;
+  calc_value_t *value;
+  ril_label_t *label;
+  
+  if (RIL_TAG_GOTO != _optcmd(context, cmdid)->signature || RIL_CALLFUNC(goto) != _opthandler(context, cmdid)) return NULL;
+  
+  src = _cmdargument(context, _optcmd(context, cmdid), 0);
+  value = (calc_value_t*)((const calc_opcode_t*)src + 1);
+  if (!_isatom(src) || VARIANT_LABEL != value->type) return NULL;
+  
+  label = (ril_label_t*)(value + 1);
+  if (label->id >= buffer_size(context->label_buffer)) return NULL;
+  if (LABEL_NULL == ((ril_label_t*)buffer_index(context->label_buffer, label->id))->cmdid) return NULL;
+  
+  return label;
+}
+
+static __inline int _labelcmd(ril_compile_t *context, const ril_label_t *label)
+{
+  return ((ril_label_t*)buffer_index(context->label_buffer, label->id))->cmdid;
+}
+
+// the command a jump to the label runs after the labels in its way
+static __inline int _landing(ril_compile_t *context, const bool *removed, int cmdid)
+{
+  int size = buffer_size(context->cmd_buffer);
+  
+  while (cmdid < size - 1 && (removed[cmdid] || RIL_TAG_LABEL == _optcmd(context, cmdid)->signature)) ++cmdid;
+  
+  return cmdid;
+}
+
+// a region with a label or a macro in it is entered from elsewhere
+static bool _isentered(ril_compile_t *context, int begin, int end)
+{
+  int i;
+  
+  for (i = begin; i <= end; ++i)
+  {
+    if (RIL_TAG_LABEL == _optcmd(context, i)->signature || RIL_CALLFUNC(macro) == _opthandler(context, i)) return true;
+  }
+  
+  return false;
+}
+
+static int _removerange(bool *removed, int begin, int end)
+{
+  int count = 0;
+  
+  for (; begin <= end; ++begin)
+  {
+    if (!removed[begin]) ++count;
+    removed[begin] = true;
+  }
+  
+  return count;
+}
+
+// folds the chain of an [if] whose head tests a literal, and drops its elseifs of literal false
+static int _foldif(ril_compile_t *context, bool *removed, int head)
+{
+  ril_cmd_t *cmd;
+  int count = 0, value, next, end, prev, i;
+  
+  for (;;)
+  {
+    cmd = _optcmd(context, head);
+    value = _literalbool(context, _cmdargument(context, cmd, 0));
+    if (0 > value) break;
+    next = cmd->pair_cmdid.id;
+    for (end = head; head != _optcmd(context, end)->pair_cmdid.id; end = _optcmd(context, end)->pair_cmdid.id);
+    
+    // only the body of the head runs
+    if (value)
+    {
+      if (_isentered(context, next, end)) return count;
+      return count + _removerange(removed, head, head) + _removerange(removed, next, end);
+    }
+    
+    if (_isentered(context, head, next - 1)) return count;
+    count += _removerange(removed, head, next - 1);
+    if (next == end) return count + _removerange(removed, end, end);
+    if (RIL_CALLFUNC(else) == _opthandler(context, next))
+    {
+      return count + _removerange(removed, next, next) + _removerange(removed, end, end);
+    }
+    
+    // the first elseif heads the chain
+    _optcmd(context, next)->signature = cmd->signature;
+    _optcmd(context, end)->pair_cmdid.id = next;
+    head = next;
+  }
+  
+  for (prev = head, i = _optcmd(context, head)->pair_cmdid.id; head != i; i = next)
+  {
+    next = _optcmd(context, i)->pair_cmdid.id;
+    if (RIL_CALLFUNC(elseif) == _opthandler(context, i) && 0 == _literalbool(context, _cmdargument(context, _optcmd(context, i), 0))
+        && !_isentered(context, i, next - 1))
+    {
+      count += _removerange(removed, i, next - 1);
+      _optcmd(context, prev)->pair_cmdid.id = next;
+    }
+    else prev = i;
+  }
+  
+  return count;
+}
+
+// jumps to a label that only leads to another jump go there at once
+static int _threadgotos(ril_compile_t *context, const bool *removed)
+{
+  ril_label_t *label, *next;
+  int i, k, target, size = buffer_size(context->cmd_buffer), count = 0;
+  
+  for (i = 0; i < size; ++i)
+  {
+    label = _gotolabel(context, i);
+    if (removed[i] || NULL == label) continue;
+    
+    // a cycle of jumps stops after as many steps as there are commands
+    for (k = 0; k < size; ++k)
+    {
+      target = _landing(context, removed, _labelcmd(context, label));
+      next = _gotolabel(context, target);
+      if (i == target || NULL == next || next->id == label->id) break;
+      *label = *next;
+    }
+    if (0 < k) ++count;
+  }
+  
+  return count;
+}
+
+static __inline bool _isterminal(ril_compile_t *context, int cmdid)
+{
+  RILFUNCTION handler = _opthandler(context, cmdid);
+  
+  return NULL != _gotolabel(context, cmdid) || RIL_CALLFUNC(exit) == handler
+    || (RIL_TAG_RETURN == _optcmd(context, cmdid)->signature && RIL_CALLFUNC(return) == handler);
+}
+
+// a label, or a tag of a pair, may be reached without falling through
+static __inline bool _isentry(ril_compile_t *context, int cmdid)
+{
+  ril_cmd_t *cmd = _optcmd(context, cmdid);
+  ril_tag_t *tag = ril_getregisteredtag2(context->vm, cmd->signature);
+  
+  return RIL_TAG_LABEL == cmd->signature || NULL == tag || 0 < tag->refcount || 0 < buffer_size(tag->pair_buffer);
+}
+
+static int _dropunreachable(ril_compile_t *context, bool *removed)
+{
+  int i, k, size = buffer_size(context->cmd_buffer), count = 0;
+  
+  for (i = 0; i < size - 1; i = k)
+  {
+    k = i + 1;
+    if (removed[i] || !_isterminal(context, i)) continue;
+    for (; k < size - 1 && (removed[k] || !_isentry(context, k)); ++k)
+    {
+      if (!removed[k]) ++count;
+      removed[k] = true;
+    }
+  }
+  
+  return count;
+}
+
+// a jump over nothing but labels falls into its label anyway
+static int _dropfallthrough(ril_compile_t *context, bool *removed)
+{
+  ril_label_t *label;
+  int i, size = buffer_size(context->cmd_buffer), count = 0;
+  
+  for (i = 0; i < size; ++i)
+  {
+    label = _gotolabel(context, i);
+    if (removed[i] || NULL == label || _labelcmd(context, label) <= i) continue;
+    if (_landing(context, removed, i + 1) < _labelcmd(context, label)) continue;
+    removed[i] = true;
+    ++count;
+  }
+  
+  return count;
+}
+
+// closes up the commands left and their arguments, the data stays where it is
+static void _compactcmds(ril_compile_t *context, const bool *removed)
+{
+  int i, size = buffer_size(context->cmd_buffer), cmdsize = 0, argsize = 0, argend;
+  int32_t *cmdmap = (int32_t*)ril_malloc(sizeof(int32_t) * size);
+  ril_cmd_t cmd;
+  ril_label_t *label;
+  
+  for (i = 0; i < size; ++i) cmdmap[i] = removed[i] ? -1 : cmdsize++;
+  
+  for (i = 0; i < size; ++i)
+  {
+    if (removed[i]) continue;
+    cmd = *_optcmd(context, i);
+    argend = i + 1 < size ? (int)_optcmd(context, i + 1)->arg_offset : buffer_size(context->arg_buffer);
+    memmove(buffer_index(context->arg_buffer, argsize), buffer_index(context->arg_buffer, cmd.arg_offset), sizeof(ril_arg_t) * (argend - cmd.arg_offset));
+    cmd.arg_offset = argsize;
+    argsize += argend - (int)_optcmd(context, i)->arg_offset;
+    cmd.pair_cmdid.id = 0 > cmdmap[cmd.pair_cmdid.id] ? cmdmap[i] : cmdmap[cmd.pair_cmdid.id];
+    cmd.parent_cmdid.id = 0 > cmdmap[cmd.parent_cmdid.id] ? cmdmap[i] : cmdmap[cmd.parent_cmdid.id];
+    *_optcmd(context, cmdmap[i]) = cmd;
+  }
+  buffer_resize(context->cmd_buffer, cmdsize);
+  buffer_resize(context->arg_buffer, argsize);
+  
+  for (i = buffer_size(context->label_buffer) - 1; 0 <= i; --i)
+  {
+    label = (ril_label_t*)buffer_index(context->label_buffer, i);
+    if (LABEL_NULL != label->cmdid) label->cmdid = cmdmap[label->cmdid];
+  }
+  
+  ril_free(cmdmap);
+}
+
+// takes out what the commands do not need to do: [let] without effect, [if] of literal
+// conditions, jumps to jumps and what no jump reaches. labels and macros stay in place.
+static void _optimize(ril_compile_t *context)
+{
+  ril_optimizestats_t *stats = &context->vm->optimize.stats;
+  int i, size = buffer_size(context->cmd_buffer), count = 0, n;
+  bool *removed = (bool*)ril_malloc(sizeof(bool) * size);
+  
+  memset(removed, 0, sizeof(bool) * size);
+  
+  for (i = 0; i < size - 1; ++i)
+  {
+    if (RIL_CALLFUNC(let) != _opthandler(context, i) || !_isliteralcalc(_cmdargument(context, _optcmd(context, i), 0))) continue;
+    removed[i] = true;
+    ++stats->lets;
+    ++count;
+  }
+  for (i = 0; i < size - 1; ++i)
+  {
+    if (removed[i] || RIL_CALLFUNC(if) != _opthandler(context, i)) continue;
+    n = _foldif(context, removed, i);
+    stats->branches += n;
+    count += n;
+  }
+  
+  if (RIL_OPTIMIZE_FLOW <= context->vm->optimize.level)
+  {
+    n = _threadgotos(context, removed);
+    stats->gotos += n;
+    n = _dropunreachable(context, removed);
+    stats->unreachable += n;
+    count += n;
+    n = _dropfallthrough(context, removed);
+    stats->gotos += n;
+    count += n;
+  }
+  
+  if (0 < count) _compactcmds(context, removed);
+  
+  ril_free(removed);
+}
+
+// cases of one key are the same when they are equal, or an integer and its text
+static bool _samecase(const calc_value_t *a, const calc_value_t *b)
+{
+  int number;
+  
+  if (a->type == b->type) return a->size == b->size && 0 == memcmp(a + 1, b + 1, a->size);
+  
+  return ril_isintegertext((const char*)(VARIANT_INTEGER == a->type ? b + 1 : a + 1), &number);
+}
+
+// a [case] is an integer or a string literal whose key no earlier case of the switch has
+RILRESULT rilc_checkcase(ril_compile_t *context)
+{
+  const void *src = rilc_getargument(context, 0);
+  const calc_value_t *value = (const calc_value_t*)((const calc_opcode_t*)src + 1), *other;
+  ril_cmd_t *cmd;
+  int id;
+  
+  if (!_isatom(src) || (VARIANT_INTEGER != value->type && (VARIANT_LITERAL | VARIANT_STRING) != value->type))
+  {
+    return RIL_COMPILE_ERROR(context, "Fatal error: '%s' takes an integer or a string constant", context->tagname);
+  }
+  
+  for (id = context->cmd->pair_cmdid.id; id != context->cmdid.id; id = cmd->pair_cmdid.id)
+  {
+    cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, id);
+    if (context->cmd->signature != cmd->signature) continue;
+    other = (const calc_value_t*)((const calc_opcode_t*)_cmdargument(context, cmd, 0) + 1);
+    if (ril_casekey(other) != ril_casekey(value)) continue;
+    if (!_samecase(other, value))
+    {
+      return RIL_COMPILE_ERROR(context, "Fatal error: case '%s' collides with another case of the switch", rilc_getstring(context, 0));
+    }
+    return RIL_COMPILE_ERROR(context, "Fatal error: case '%s' is already in the switch", rilc_getstring(context, 0));
+  }
+  
+  return RIL_OK;
+}
+
+// registers the macros of the fragment and checks that every tag still resolves
+static bool _checkfragment(ril_compile_t *context, const ril_fragment_t *fragment)
+{
+  const ril_cmd_t *cmd;
+  int i;
+  
+  _registermacros(context, fragment->cmd_buffer, fragment->arg_buffer, fragment->data_buffer, 0, buffer_size(fragment->cmd_buffer));
+  
+  for (i = 0; i < buffer_size(fragment->cmd_buffer); ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(fragment->cmd_buffer, i);
+    if (NULL == ril_getregisteredtag2(context->vm, cmd->signature)) return false;
+  }
+  
+  return true;
+}
+
+static RILRESULT _splice(ril_compile_t *context, const ril_fragment_t *fragment)
+{
+  int cmdbase = buffer_size(context->cmd_buffer);
+  int argbase = buffer_size(context->arg_buffer);
+  int database = buffer_size(context->data_buffer);
+  int i, count;
+  uint32_t *labelids;
+  ril_label_t *label, *fragmentlabel;
+  ril_cmd_t *cmd;
+  ril_arg_t *arg;
+  
+  // labels
+  count = buffer_size(fragment->label_buffer);
+  labelids = (uint32_t*)ril_malloc(sizeof(uint32_t) * (count + 1));
+  for (i = 0; i < count; ++i)
+  {
+    fragmentlabel = (ril_label_t*)buffer_index(fragment->label_buffer, i);
+    labelids[i] = _labelhashtoid(context, fragmentlabel->namehash);
+    if (LABEL_NULL == fragmentlabel->cmdid) continue;
+    label = (ril_label_t*)buffer_index(context->label_buffer, labelids[i]);
+    if (LABEL_NULL != label->cmdid)
+    {
+      ril_free(labelids);
+      return RIL_COMPILE_ERROR(context, "Fatal error: label is overloaded in included file");
+    }
+    label->cmdid = cmdbase + fragmentlabel->cmdid;
+  }
+  
+  // commands
+  count = buffer_size(fragment->cmd_buffer);
+  if (0 < count)
+  {
+    buffer_write(context->cmd_buffer, buffer_front(fragment->cmd_buffer), count);
+    for (i = 0; i < count; ++i)
+    {
+      cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, cmdbase + i);
+      cmd->pair_cmdid.id += cmdbase;
+      cmd->parent_cmdid.id += cmdbase;
+      cmd->arg_offset += argbase;
+    }
+    context->cmd = cmd;
+    context->cmdid.id = cmdbase + count - 1;
+  }
+  
+  // arguments
+  count = buffer_size(fragment->arg_buffer);
+  if (0 < count) buffer_write(context->arg_buffer, buffer_front(fragment->arg_buffer), count);
+  for (i = 0; i < count; ++i)
+  {
+    arg = (ril_arg_t*)buffer_index(context->arg_buffer, argbase + i);
+    arg->data_offset += database;
+  }
+  
+  // data
+  count = buffer_size(fragment->data_buffer);
+  if (0 < count) buffer_write(context->data_buffer, buffer_front(fragment->data_buffer), count);
+  for (i = 0; i < buffer_size(fragment->labelref_buffer); ++i)
+  {
+    label = (ril_label_t*)buffer_index(context->data_buffer, database + *(uint32_t*)buffer_index(fragment->labelref_buffer, i));
+    label->id = labelids[label->id];
+    if (NULL != context->labelref_buffer)
+    {
+      *(uint32_t*)buffer_malloc(context->labelref_buffer, 1) = database + *(uint32_t*)buffer_index(fragment->labelref_buffer, i);
+    }
+  }
+  
+  ril_free(labelids);
+  
+  context->line += fragment->lines;
+  
+  return RIL_OK;
+}
+
+static void _adddependhash(ril_compile_t *context, const char *file, const ril_md5_t *hash)
+{
+  const char *cur, *end;
+  
+  if (NULL == context->depend_buffer) return;
+  
+  cur = (const char*)buffer_front(context->depend_buffer);
+  end = cur + buffer_size(context->depend_buffer);
+  for (; cur < end; cur += sizeof(ril_md5_t) + strlen(cur + sizeof(ril_md5_t)) + 1)
+  {
+    if (!ril_md5cmp(*hash, *(ril_md5_t*)cur) && !strcmp(file, cur + sizeof(ril_md5_t))) return;
+  }
+  
+  buffer_write(context->depend_buffer, hash, sizeof(ril_md5_t));
+  buffer_write(context->depend_buffer, file, strlen(file) + 1);
+}
+
+static __inline void _adddepend(ril_compile_t *context, const char *file, const ril_fragment_t *fragment)
+{
+  const char *cur = (const char*)buffer_front(fragment->depend_buffer);
+  const char *end = cur + buffer_size(fragment->depend_buffer);
+  
+  if (NULL == context->depend_buffer) return;
+  
+  _adddependhash(context, file, &fragment->hash);
+  for (; cur < end; cur += sizeof(ril_md5_t) + strlen(cur + sizeof(ril_md5_t)) + 1)
+  {
+    _adddependhash(context, cur + sizeof(ril_md5_t), (const ril_md5_t*)cur);
+  }
+}
+
+// compiles an included file once per content and splices it afterwards
+RILRESULT rilc_include(ril_compile_t *context, const char *path)
+{
+  char file[1024];
+  FILE *fp;
+  ril_crc_t pathhash;
+  ril_fragment_t *fragment;
+  ril_md5_t hash;
+  RILRESULT result;
+  
+  // nested includes overwrite the ril_getpath buffer
+  strcpy(file, path);
+  pathhash = ril_makecrc(file);
+  
+  fp = fopen(file, "rb");
+  if (NULL == fp)
+  {
+    return ril_error(context->vm, "Fatal error: Cannot open %s", file);
+  }
+  
+  // a fragment can not close pairs opened outside of it
+  if (NULL != stack_back(context->pair_stack, NULL))
+  {
+    if (NULL != context->depend_buffer)
+    {
+      _hashfile(fp, &hash);
+      _adddependhash(context, file, &hash);
+    }
+    result = rilc_compilestream(ril_readfp, fp, context);
+    fclose(fp);
+    return result;
+  }
+  
+  _hashfile(fp, &hash);
+  
+  fragment = (ril_fragment_t*)hashmap_getdata(context->vm->includecache, pathhash);
+  if (NULL != fragment
+      && (ril_md5cmp(hash, fragment->hash) || !_checkdepends(fragment->depend_buffer) || !_checkfragment(context, fragment)))
+  {
+    hashmap_delete(context->vm->includecache, pathhash);
+    _deletefragment(fragment);
+    fragment = NULL;
+  }
+  
+  if (NULL == fragment)
+  {
+    if (RIL_FAILED(_compilefragment(context, fp, &hash, &fragment)))
+    {
+      fclose(fp);
+      return RIL_ERROR;
+    }
+    if (NULL == fragment)
+    {
+      // not relocatable
+      _adddependhash(context, file, &hash);
+      rewind(fp);
+      result = rilc_compilestream(ril_readfp, fp, context);
+      fclose(fp);
+      return result;
+    }
+    hashmap_add(context->vm->includecache, pathhash, NULL, fragment);
+  }
+  
+  fclose(fp);
+  
+  _adddepend(context, file, fragment);
+  
+  return _splice(context, fragment);
+}
+
+ril_incremental_t* ril_openincremental(void)
+{
+  ril_incremental_t *incremental = (ril_incremental_t*)ril_malloc(sizeof(ril_incremental_t));
+  
+  incremental->src = NULL;
+  incremental->size = 0;
+  incremental->line = 1;
+  incremental->checkpoint_buffer = NULL;
+  incremental->label_buffer = NULL;
+  incremental->cmd_buffer = NULL;
+  incremental->arg_buffer = NULL;
+  incremental->data_buffer = NULL;
+  incremental->labelref_buffer = NULL;
+  incremental->depend_buffer = NULL;
+  
+  return incremental;
+}
+
+static void _clearincremental(ril_incremental_t *incremental)
+{
+  if (NULL == incremental->src) return;
+  
+  ril_free(incremental->src);
+  buffer_close(incremental->checkpoint_buffer);
+  buffer_close(incremental->label_buffer);
+  buffer_close(incremental->cmd_buffer);
+  buffer_close(incremental->arg_buffer);
+  buffer_close(incremental->data_buffer);
+  buffer_close(incremental->labelref_buffer);
+  buffer_close(incremental->depend_buffer);
+  incremental->src = NULL;
+}
+
+void ril_closeincremental(ril_incremental_t *incremental)
+{
+  _clearincremental(incremental);
+  ril_free(incremental);
+}
+
+static void _addcheckpoint(ril_compile_t *context)
+{
+  ril_checkpoint_t *checkpoint = (ril_checkpoint_t*)buffer_malloc(context->checkpoint_buffer, 1);
+  
+  checkpoint->offset = context->cur - context->front;
+  checkpoint->line = context->line;
+  checkpoint->cmd_size = buffer_size(context->cmd_buffer);
+  checkpoint->arg_size = buffer_size(context->arg_buffer);
+  checkpoint->data_size = buffer_size(context->data_buffer);
+  checkpoint->label_size = buffer_size(context->label_buffer);
+  checkpoint->labelref_size = buffer_size(context->labelref_buffer);
+}
+
+static __inline void _copyprefix(buffer_t *dest, const buffer_t *src, int size)
+{
+  if (0 < size) buffer_write(dest, buffer_front(src), size);
+}
+
+// restarts the compile from the last label before the first edit
+static void _resumehead(ril_compile_t *context, const char *src)
+{
+  const ril_incremental_t *previous = context->previous;
+  const ril_checkpoint_t *checkpoint = NULL;
+  ril_label_t *label;
+  int i, count, diff = 0;
+  
+  while (diff < previous->size && src[diff] == previous->src[diff]) ++diff;
+  
+  count = buffer_size(previous->checkpoint_buffer);
+  for (i = 0; i < count; ++i)
+  {
+    if (((ril_checkpoint_t*)buffer_index(previous->checkpoint_buffer, i))->offset > (uint32_t)diff) break;
+    checkpoint = (ril_checkpoint_t*)buffer_index(previous->checkpoint_buffer, i);
+  }
+  if (NULL == checkpoint) return;
+  
+  _copyprefix(context->checkpoint_buffer, previous->checkpoint_buffer, i - 1);
+  _copyprefix(context->label_buffer, previous->label_buffer, checkpoint->label_size);
+  _copyprefix(context->cmd_buffer, previous->cmd_buffer, checkpoint->cmd_size);
+  _copyprefix(context->arg_buffer, previous->arg_buffer, checkpoint->arg_size);
+  _copyprefix(context->data_buffer, previous->data_buffer, checkpoint->data_size);
+  _copyprefix(context->labelref_buffer, previous->labelref_buffer, checkpoint->labelref_size);
+  
+  // labels defined after the checkpoint are defined again
+  for (i = 0; i < checkpoint->label_size; ++i)
+  {
+    label = (ril_label_t*)buffer_index(context->label_buffer, i);
+    if (LABEL_NULL != label->cmdid && label->cmdid >= (uint32_t)checkpoint->cmd_size) label->cmdid = LABEL_NULL;
+  }
+  
+  if (0 < checkpoint->cmd_size)
+  {
+    context->cmdid.id = checkpoint->cmd_size - 1;
+    context->cmd = (ril_cmd_t*)buffer_index(context->cmd_buffer, context->cmdid.id);
+  }
+  
+  _registermacros(context, previous->cmd_buffer, previous->arg_buffer, previous->data_buffer, 0, checkpoint->cmd_size);
+  
+  context->line = checkpoint->line;
+  context->cur = src + checkpoint->offset;
+}
+
+typedef struct
+{
+  uint32_t position;
+  uint32_t id;
+} _labelevent_t;
+
+static int _comparelabelevent(const void *a, const void *b)
+{
+  uint32_t x = ((const _labelevent_t*)a)->position, y = ((const _labelevent_t*)b)->position;
+  
+  return x < y ? -1 : x > y;
+}
+
+// cuts the previous program after the checkpoint into a relocatable fragment,
+// labels are numbered in order of their first use as the compiler would do
+static void _tailfragment(const ril_incremental_t *previous, const ril_checkpoint_t *checkpoint, ril_fragment_t *fragment, int32_t *positions)
+{
+  int i, count, eventcount = 0;
+  int32_t *labelids;
+  _labelevent_t *events;
+  ril_label_t *label, *oldlabel;
+  ril_cmd_t *cmd;
+  ril_arg_t *arg;
+  uint32_t offset;
+  
+  fragment->lines = previous->line - checkpoint->line;
+  fragment->cmd_buffer = buffer_open(sizeof(ril_cmd_t), buffer_size(previous->cmd_buffer) - checkpoint->cmd_size + 1);
+  fragment->arg_buffer = buffer_open(sizeof(ril_arg_t), buffer_size(previous->arg_buffer) - checkpoint->arg_size + 1);
+  fragment->data_buffer = buffer_open(1, buffer_size(previous->data_buffer) - checkpoint->data_size + 1);
+  fragment->label_buffer = buffer_open(sizeof(ril_label_t), LABEL_BUFF_SIZE);
+  fragment->labelref_buffer = buffer_open(sizeof(uint32_t), buffer_size(previous->labelref_buffer) - checkpoint->labelref_size + 1);
+  fragment->depend_buffer = buffer_open(1, 1);
+  
+  count = buffer_size(previous->cmd_buffer) - checkpoint->cmd_size;
+  if (0 < count) buffer_write(fragment->cmd_buffer, buffer_index(previous->cmd_buffer, checkpoint->cmd_size), count);
+  for (i = 0; i < count; ++i)
+  {
+    cmd = (ril_cmd_t*)buffer_index(fragment->cmd_buffer, i);
+    cmd->pair_cmdid.id -= checkpoint->cmd_size;
+    cmd->parent_cmdid.id -= checkpoint->cmd_size;
+    cmd->arg_offset -= checkpoint->arg_size;
+  }
+  
+  count = buffer_size(previous->arg_buffer) - checkpoint->arg_size;
+  if (0 < count) buffer_write(fragment->arg_buffer, buffer_index(previous->arg_buffer, checkpoint->arg_size), count);
+  for (i = 0; i < count; ++i)
+  {
+    arg = (ril_arg_t*)buffer_index(fragment->arg_buffer, i);
+    arg->data_offset -= checkpoint->data_size;
+  }
+  
+  count = buffer_size(previous->data_buffer) - checkpoint->data_size;
+  if (0 < count) buffer_write(fragment->data_buffer, buffer_index(previous->data_buffer, checkpoint->data_size), count);
+  
+  // label references and definitions in the order of the source
+  count = buffer_size(previous->labelref_buffer) - checkpoint->labelref_size + buffer_size(previous->label_buffer);
+  events = (_labelevent_t*)ril_malloc(sizeof(_labelevent_t) * (count + 1));
+  for (i = checkpoint->labelref_size; i < buffer_size(previous->labelref_buffer); ++i)
+  {
+    offset = *(uint32_t*)buffer_index(previous->labelref_buffer, i) - checkpoint->data_size;
+    *(uint32_t*)buffer_malloc(fragment->labelref_buffer, 1) = offset;
+    events[eventcount].position = offset;
+    events[eventcount].id = ((ril_label_t*)buffer_index(fragment->data_buffer, offset))->id;
+    ++eventcount;
+  }
+  for (i = 0; i < buffer_size(previous->label_buffer); ++i)
+  {
+    oldlabel = (ril_label_t*)buffer_index(previous->label_buffer, i);
+    if (LABEL_NULL == oldlabel->cmdid || oldlabel->cmdid < (uint32_t)checkpoint->cmd_size) continue;
+    cmd = (ril_cmd_t*)buffer_index(fragment->cmd_buffer, oldlabel->cmdid - checkpoint->cmd_size);
+    events[eventcount].position = ((ril_arg_t*)buffer_index(fragment->arg_buffer, cmd->arg_offset))->data_offset;
+    events[eventcount].id = i;
+    ++eventcount;
+  }
+  qsort(events, eventcount, sizeof(_labelevent_t), _comparelabelevent);
+  
+  labelids = (int32_t*)ril_malloc(sizeof(int32_t) * (buffer_size(previous->label_buffer) + 1));
+  for (i = 0; i < buffer_size(previous->label_buffer); ++i) labelids[i] = -1;
+  for (i = 0; i < eventcount; ++i)
+  {
+    if (0 <= labelids[events[i].id]) continue;
+    oldlabel = (ril_label_t*)buffer_index(previous->label_buffer, events[i].id);
+    labelids[events[i].id] = buffer_size(fragment->label_buffer);
+    positions[buffer_size(fragment->label_buffer)] = events[i].position;
+    label = (ril_label_t*)buffer_malloc(fragment->label_buffer, 1);
+    label->namehash = oldlabel->namehash;
+    label->cmdid = LABEL_NULL == oldlabel->cmdid || oldlabel->cmdid < (uint32_t)checkpoint->cmd_size
+      ? LABEL_NULL : oldlabel->cmdid - checkpoint->cmd_size;
+  }
+  
+  for (i = 0; i < buffer_size(fragment->labelref_buffer); ++i)
+  {
+    label = (ril_label_t*)buffer_index(fragment->data_buffer, *(uint32_t*)buffer_index(fragment->labelref_buffer, i));
+    label->id = labelids[label->id];
+  }
+  
+  ril_free(labelids);
+  ril_free(events);
+}
+
+static __inline int _findlabel(const buffer_t *label_buffer, ril_crc_t namehash)
+{
+  int i;
+  
+  for (i = buffer_size(label_buffer) - 1; 0 <= i; --i)
+  {
+    if (namehash == ((ril_label_t*)buffer_index(label_buffer, i))->namehash) return i;
+  }
+  
+  return -1;
+}
+
+// splices the unchanged rest of the previous program at a label behind the last edit
+static bool _resumetail(ril_compile_t *context)
+{
+  const ril_incremental_t *previous = context->previous;
+  const ril_checkpoint_t *checkpoint = NULL;
+  ril_checkpoint_t newcheckpoint, *dest;
+  ril_fragment_t fragment;
+  uint32_t offset = context->cur - context->front;
+  int32_t *positions;
+  int i, k, index, count, labelcount, newlabels;
+  bool result = false;
+  
+  if (NULL == previous || offset < context->tailbegin) return false;
+  
+  count = buffer_size(previous->checkpoint_buffer);
+  for (index = 0; index < count; ++index)
+  {
+    checkpoint = (ril_checkpoint_t*)buffer_index(previous->checkpoint_buffer, index);
+    if (checkpoint->offset + context->delta >= offset) break;
+  }
+  if (index == count || checkpoint->offset + context->delta != offset) return false;
+  
+  positions = (int32_t*)ril_malloc(sizeof(int32_t) * (buffer_size(previous->label_buffer) + 1));
+  _tailfragment(previous, checkpoint, &fragment, positions);
+  
+  // a label defined twice is reported by the compiler itself
+  for (i = 0; i < buffer_size(fragment.label_buffer); ++i)
+  {
+    ril_label_t *label = (ril_label_t*)buffer_index(fragment.label_buffer, i);
+    k = _findlabel(context->label_buffer, label->namehash);
+    if (LABEL_NULL != label->cmdid && 0 <= k
+        && LABEL_NULL != ((ril_label_t*)buffer_index(context->label_buffer, k))->cmdid) break;
+  }
+  
+  if (i == buffer_size(fragment.label_buffer) && _checkfragment(context, &fragment))
+  {
+    // new labels are appended in the order of the fragment
+    labelcount = buffer_size(context->label_buffer);
+    for (i = 0, newlabels = 0; i < buffer_size(fragment.label_buffer); ++i)
+    {
+      if (0 > _findlabel(context->label_buffer, ((ril_label_t*)buffer_index(fragment.label_buffer, i))->namehash))
+      {
+        positions[newlabels++] = positions[i];
+      }
+    }
+    
+    newcheckpoint = *(ril_checkpoint_t*)buffer_back(context->checkpoint_buffer);
+    for (i = index + 1; i < count; ++i)
+    {
+      dest = (ril_checkpoint_t*)buffer_malloc(context->checkpoint_buffer, 1);
+      *dest = *(ril_checkpoint_t*)buffer_index(previous->checkpoint_buffer, i);
+      for (k = 0; k < newlabels && positions[k] < dest->data_size - checkpoint->data_size; ++k);
+      dest->offset += context->delta;
+      dest->line += newcheckpoint.line - checkpoint->line;
+      dest->cmd_size += newcheckpoint.cmd_size - checkpoint->cmd_size;
+      dest->arg_size += newcheckpoint.arg_size - checkpoint->arg_size;
+      dest->data_size += newcheckpoint.data_size - checkpoint->data_size;
+      dest->labelref_size += newcheckpoint.labelref_size - checkpoint->labelref_size;
+      dest->label_size = labelcount + k;
+    }
+    
+    result = RIL_SUCCEEDED(_splice(context, &fragment));
+  }
+  else
+  {
+    // the rest fails to compile anyway
+    context->previous = NULL;
+  }
+  
+  ril_free(positions);
+  buffer_close(fragment.label_buffer);
+  buffer_close(fragment.cmd_buffer);
+  buffer_close(fragment.arg_buffer);
+  buffer_close(fragment.data_buffer);
+  buffer_close(fragment.labelref_buffer);
+  buffer_close(fragment.depend_buffer);
+  
+  return result;
+}
+
+static void _storeincremental(ril_incremental_t *incremental, ril_compile_t *context, const char *src, int size)
+{
+  _clearincremental(incremental);
+  
+  incremental->src = (char*)ril_malloc(size + 1);
+  memcpy(incremental->src, src, size + 1);
+  incremental->size = size;
+  incremental->line = context->line;
+  incremental->checkpoint_buffer = _copybuffer(context->checkpoint_buffer);
+  incremental->label_buffer = _copybuffer(context->label_buffer);
+  incremental->cmd_buffer = _copybuffer(context->cmd_buffer);
+  incremental->arg_buffer = _copybuffer(context->arg_buffer);
+  incremental->data_buffer = _copybuffer(context->data_buffer);
+  incremental->labelref_buffer = _copybuffer(context->labelref_buffer);
+  incremental->depend_buffer = _copybuffer(context->depend_buffer);
+}
+
+// compiles only the labels from the first to the last edit since the previous call
+RILRESULT ril_recompile(RILVM vm, ril_incremental_t *incremental, const char *src, buffer_t *dest)
+{
+  ril_compile_t *context = _open(vm);
+  int size = strlen(src), suffix = 0;
+  
+  context->labelref_buffer = buffer_open(sizeof(uint32_t), 16);
+  context->depend_buffer = buffer_open(1, 64);
+  context->checkpoint_buffer = buffer_open(sizeof(ril_checkpoint_t), 64);
+  context->front = src;
+  context->cur = src;
+  
+  // an edited include invalidates the whole previous program
+  if (NULL != incremental->src && _checkdepends(incremental->depend_buffer))
+  {
+    context->previous = incremental;
+    context->delta = size - incremental->size;
+    while (suffix < size && suffix < incremental->size
+           && src[size - 1 - suffix] == incremental->src[incremental->size - 1 - suffix]) ++suffix;
+    context->tailbegin = size - suffix;
+    _copyprefix(context->depend_buffer, incremental->depend_buffer, buffer_size(incremental->depend_buffer));
+    _resumehead(context, src);
+  }
+  
+  if (RIL_FAILED(_compile(context)))
+  {
+    _close(context);
+    return RIL_ERROR;
+  }
+  
+  _storeincremental(incremental, context, src, size);
+  
+  return _compileend(context, dest);
+}
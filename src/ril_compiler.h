@@ -7,15 +7,87 @@
 #define LABEL_BUFF_SIZE 128
 #define TAG_BUFF_SIZE 1024
 #define ARG_BUFF_SIZE TAG_BUFF_SIZE * 4
-#define DATA_BUFF_SIZE ARG_BUFF_SIZE * 256
+#define DATA_BUFF_SIZE ARG_BUFF_SIZE * 4
+#define PAIR_STACK_SIZE 16
+#define ARENA_BLOCK_SIZE 4096
+#define READ_CHUNK_SIZE 4096
+#define INLINE_CMD_SIZE 4
+#define INLINE_STACK_SIZE 32
+#define HOIST_STACK_SIZE 32
+#define HOIST_SIZE 16
 
 #define RIL_COMPILE_ERROR(context, s, ...) \
 ril_error(context->vm, s " on line %d", ##__VA_ARGS__, context->line);
 
+typedef struct
+{
+  RILREADFUNCTION read;
+  void *userdata;
+  char *buffer;
+  int size;
+  int capacity;
+  int ready; /* input before this offset holds complete lines */
+  bool eof;
+  bool error;
+} ril_reader_t;
+
+/* compiled [include] file, relocated when it is spliced */
+typedef struct
+{
+  ril_md5_t hash;
+  uint32_t lines;
+  buffer_t *label_buffer; /* cmdid is relative, or LABEL_NULL */
+  buffer_t *cmd_buffer;
+  buffer_t *arg_buffer;
+  buffer_t *data_buffer;
+  buffer_t *labelref_buffer; /* data offsets of label values */
+  buffer_t *depend_buffer; /* md5 + path of nested includes */
+} ril_fragment_t;
+
+/* compiler state at a top-level label */
+typedef struct
+{
+  uint32_t offset;
+  uint32_t line;
+  int cmd_size;
+  int arg_size;
+  int data_size;
+  int label_size;
+  int labelref_size;
+} ril_checkpoint_t;
+
+/* a macro whose calls are replaced by its body */
+typedef struct
+{
+  ril_signature_t signature;
+  int begin; /* the body commands, or -1 when the calls are kept */
+  int end;
+  int params;
+  bool haswrite; /* the body assigns variables */
+  uint32_t used; /* parameters read once or more */
+  uint32_t reused; /* parameters read more than once */
+} ril_inline_t;
+
+/* last compile of a script, kept by ril_recompile */
+struct _ril_incremental
+{
+  char *src;
+  int size;
+  uint32_t line;
+  buffer_t *checkpoint_buffer;
+  buffer_t *label_buffer;
+  buffer_t *cmd_buffer;
+  buffer_t *arg_buffer;
+  buffer_t *data_buffer;
+  buffer_t *labelref_buffer;
+  buffer_t *depend_buffer;
+};
+
 struct _ril_compile
 {
   uint32_t line;
   const char *cur;
+  ril_reader_t *reader;
   RILVM vm;
   char calc_error[256];
   char tagname[128];
@@ -23,11 +95,23 @@ struct _ril_compile
   ril_cmd_t *cmd;
   ril_cmdid_t cmdid;
   stack_t *pair_stack;
+  arena_t *arena;
   buffer_t *cmd_buffer;
   buffer_t *arg_buffer;
   buffer_t *data_buffer;
   buffer_t *label_buffer;
   buffer_t *var_buffer;
+  buffer_t *labelref_buffer;
+  buffer_t *depend_buffer;
+  const char *front;
+  buffer_t *checkpoint_buffer;
+  const ril_incremental_t *previous;
+  uint32_t tailbegin;
+  int delta;
+  buffer_t *local_buffer; /* ril_crc_t of the macro locals by slot */
+  ril_cmdid_t localowner; /* the [macro] they belong to */
+  ril_signature_t localsignature;
+  buffer_t *inline_buffer; /* ril_inline_t of the macros of the program */
 };
 
 #ifdef __cplusplus
@@ -40,6 +124,9 @@ ril_cmd_t* rilc_newcmd(ril_compile_t *context, ril_signature_t signature);
 ril_cmd_t* rilc_addcmd(ril_compile_t *context, ril_signature_t signature);
 RILRESULT rilc_checkpair(ril_compile_t *context, ril_cmd_t *cmd);
 RILRESULT rilc_checkchild(ril_compile_t *context, ril_cmd_t *cmd);
+RILRESULT rilc_include(ril_compile_t *context, const char *file);
+void rilc_hoist(ril_compile_t *context, int loopid);
+RILRESULT rilc_checkcase(ril_compile_t *context);
 
 RILRESULT calc_cb_compile(calc_compile_t *context, ril_compile_t *c_context);
 
@@ -5,14 +5,18 @@
 
 #include "stack.h"
 #include "buffer.h"
+#include "arena.h"
+#include "slab.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 
 #include <ril.h>
 #include "list.h"
 #include "hashmap.h"
+#include "hamt.h"
 #include "ril_calc.h"
 
 #endif
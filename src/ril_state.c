@@ -8,16 +8,21 @@
 
 typedef struct
 {
-  int size;
-  int lastindex;
+  int size; /* the caller's frame size */
+  int lastindex; /* the base of this frame */
   ril_var_t *returnvar;
 } ril_localvar_t;
 
-typedef struct
+/* a new block is added when the last one is full, the others never move */
+static ril_varstack_t* _pushvarstack(ril_state_t *state)
 {
-  hashmap_key_t key;
-  ril_var_t var;
-} ril_varstack_t;
+  if (state->varsize == buffer_size(state->varblocks) * VAR_BLOCK_SIZE)
+  {
+    *(ril_varstack_t**)buffer_malloc(state->varblocks, 1) = (ril_varstack_t*)ril_malloc(sizeof(ril_varstack_t) * VAR_BLOCK_SIZE);
+  }
+  
+  return ril_varstack(state, state->varsize++);
+}
 
 ril_state_t* ril_newstate(RILVM vm)
 {
@@ -36,11 +41,16 @@ ril_state_t* ril_newstate(RILVM vm)
   }
 
   ril_initvar(vm, &state->rootvar);
-  state->varbuffer = buffer_open(sizeof(ril_varstack_t), 64);
+  state->varblocks = buffer_open(sizeof(ril_varstack_t*), 16);
+  state->varsize = 0;
+  state->framebase = 0;
+  state->framesize = 0;
+  state->bound = false;
   
   state->tag_stack = stack_open(sizeof(ril_tagstack_t));
   stack_resize(state->tag_stack, STACK_BUFFER_SIZE);
   state->ext_buffer = buffer_open(1, EXT_BUFFER_SIZE);
+  state->saveframe = -1;
 
   cmd = &state->tmpcmd[1];
   cmd->tag = ril_getregisteredtag2(vm, RIL_TAG_EXIT);
@@ -71,11 +81,14 @@ void ril_clearstate(ril_state_t *state)
   ril_setstate(backupstate);
 
   ril_cleararray(state->vm, &state->rootvar);
-  for (i = buffer_size(state->varbuffer) - 1; 0 <= i; --i)
+  for (i = state->varsize - 1; 0 <= i; --i)
   {
-    ril_clearvar(state->vm, &((ril_varstack_t*)buffer_index(state->varbuffer, i))->var);
+    ril_clearvar(state->vm, &ril_varstack(state, i)->var);
   }
-  buffer_clear(state->varbuffer);
+  state->varsize = 0;
+  state->framebase = 0;
+  state->framesize = 0;
+  state->bound = false;
 
   if (NULL != state->returnvar) ril_deletevar(state->vm, state->returnvar);
 }
@@ -96,7 +109,11 @@ void ril_deletestate(ril_state_t *state)
     ril_clearvar(state->vm, &state->args[i].temp);
   }
 
-  buffer_close(state->varbuffer);
+  for (i = buffer_size(state->varblocks) - 1; 0 <= i; --i)
+  {
+    ril_free(*(ril_varstack_t**)buffer_index(state->varblocks, i));
+  }
+  buffer_close(state->varblocks);
   stack_close(state->tag_stack);
   buffer_close(state->ext_buffer);
   
@@ -118,9 +135,73 @@ void ril_setmainstate(RILVM vm)
   vm->state = vm->mainstate;
 }
 
+// the innermost macro owns the variables added after its frame
+static void _loadframe(RILVM vm)
+{
+  ril_state_t *state = vm->state;
+  ril_tagstack_t *tagstack;
+  ril_localvar_t *workarea;
+  int i;
+  
+  state->framebase = 0;
+  state->framesize = state->varsize;
+  for (i = stack_count(state->tag_stack) - 1; 0 <= i; --i)
+  {
+    tagstack = (ril_tagstack_t*)stack_index(state->tag_stack, i, NULL);
+    if (RIL_CALLLOADFUNC(callmacro) == tagstack->tag->loadstate_handler) break;
+  }
+  if (0 > i) return;
+  
+  workarea = (ril_localvar_t*)buffer_index(state->ext_buffer, tagstack->buffer_offset);
+  state->framebase = workarea->lastindex;
+  state->framesize = state->varsize - workarea->lastindex;
+}
+
+/* rootvar mirrors the frame only while ril_fetchlocalvar needs it */
+void ril_bindlocalvar(RILVM vm)
+{
+  ril_state_t *state = vm->state;
+  ril_varstack_t *varstack;
+  int i;
+
+  if (state->bound) return;
+  for (i = 0; i < state->framesize; ++i)
+  {
+    varstack = ril_varstack(state, state->framebase + i);
+    ril_set2arraybyhash(vm, &state->rootvar, &varstack->var, NULL, varstack->key);
+  }
+  state->bound = true;
+}
+
+/* an unset local leaves its slot keyless, so the name reaches the global again */
+void ril_unsetlocalvar(RILVM vm, hashmap_key_t key)
+{
+  ril_state_t *state = vm->state;
+  ril_varstack_t *varstack;
+  int i;
+
+  if (state->bound) ril_unset2array(vm, &state->rootvar, key);
+  for (i = 0; i < state->framesize; ++i)
+  {
+    varstack = ril_varstack(state, state->framebase + i);
+    if (key != varstack->key) continue;
+    ril_clearvar(vm, &varstack->var);
+    varstack->key = 0;
+    break;
+  }
+}
+
+static __inline void _unbindlocalvar(ril_state_t *state)
+{
+  if (!state->bound) return;
+  ril_cleararray(state->vm, &state->rootvar);
+  state->bound = false;
+}
+
 RILRESULT ril_savestate(RILVM vm, buffer_t *dest)
 {
-  int32_t i, *size;
+  int32_t i, size;
+  RILRESULT result;
   void *buf;
   
   buffer_write(dest, vm->loadfile, sizeof(vm->loadfile));
@@ -137,20 +218,24 @@ RILRESULT ril_savestate(RILVM vm, buffer_t *dest)
   
   //buffer_write(dest, &vm->isfirst, sizeof(vm->isfirst));
   
-  size = (int32_t*)buffer_malloc(dest, sizeof(int32_t));
-  *size = stack_count(vm->state->tag_stack);
-  for (i = 0; i < *size; ++i)
+  // the handlers write on, so the count is not kept as a pointer into dest
+  size = stack_count(vm->state->tag_stack);
+  buffer_write(dest, &size, sizeof(size));
+  for (i = 0; i < size; ++i)
   {
     ril_tagstack_t *tagstack = (ril_tagstack_t*)stack_index(vm->state->tag_stack, i, NULL);
     *(uint32_t*)buffer_malloc(dest, sizeof(ril_signature_t)) = ril_signature(tagstack->tag);
-    if (RIL_FAILED(tagstack->tag->savestate_handler(vm, dest))) return RIL_ERROR;
+    vm->state->saveframe = i;
+    result = tagstack->tag->savestate_handler(vm, dest);
+    vm->state->saveframe = -1;
+    if (RIL_FAILED(result)) return RIL_ERROR;
   }
 
-  size = (int32_t*)buffer_malloc(dest, sizeof(int32_t));
-  *size = buffer_size(vm->state->varbuffer);
-  for (i = 0; i < *size; ++i)
+  size = vm->state->varsize;
+  buffer_write(dest, &size, sizeof(size));
+  for (i = 0; i < size; ++i)
   {
-    ril_varstack_t *varstack = (ril_varstack_t*)buffer_index(vm->state->varbuffer, i);
+    ril_varstack_t *varstack = ril_varstack(vm->state, i);
     buffer_write(dest, &varstack->key, sizeof(varstack->key));
     ril_writevar(dest, &varstack->var);
   }
@@ -195,6 +280,10 @@ int ril_loadstate(RILVM vm, const void *src)
     ril_tagstack_t *tagstack = (ril_tagstack_t*)stack_push(vm->state->tag_stack, NULL);
     tagstack->buffer_offset = buffer_size(vm->state->ext_buffer);
     tagstack->tag = ril_getregisteredtag2(vm, *(ril_signature_t*)cur);
+    if (NULL == tagstack->tag || NULL == tagstack->tag->loadstate_handler)
+    {
+      return ril_error(vm, "cannot load the state of %08x", *(ril_signature_t*)cur);
+    }
     cur = (int8_t*)cur + sizeof(ril_signature_t);
     result = tagstack->tag->loadstate_handler(vm, cur);
     if (RIL_FAILED(result)) return RIL_ERROR;
@@ -204,11 +293,12 @@ int ril_loadstate(RILVM vm, const void *src)
   cur = ril_read(&size, cur, sizeof(size));
   for (i = 0; i < size; ++i)
   {
-    ril_varstack_t *varstack = (ril_varstack_t*)buffer_malloc(vm->state->varbuffer, 1);
+    ril_varstack_t *varstack = _pushvarstack(vm->state);
     cur = ril_read(&varstack->key, cur, sizeof(varstack->key));
     ril_initvar(vm, &varstack->var);
     cur = (uint8_t*)cur + ril_readvar(vm, &varstack->var, cur);
   }
+  _loadframe(vm);
 
   if (ril_md5cmp(hash, vm->hash))
   {
@@ -233,26 +323,26 @@ void ril_pushlocalvar(RILVM vm)
   ril_localvar_t *workarea;
   ril_state_t *state = vm->state;
 
-  /* backup vars */
+  /* the caller's frame stays below the new one */
   workarea = (ril_localvar_t*)ril_mallocworkarea(vm, sizeof(ril_localvar_t));
-  workarea->size = ril_countvar(&state->rootvar);
-  workarea->lastindex = buffer_size(state->varbuffer);
+  workarea->size = state->framesize;
+  workarea->lastindex = state->varsize;
   workarea->returnvar = state->returnvar;
   state->returnvar= NULL;
 
-  if (0 < workarea->size)
-  {
-    hashmap_clear(((ril_array_t*)state->rootvar.variant.ptr_value)->map);
-  }
+  _unbindlocalvar(state);
+  state->framebase = workarea->lastindex;
+  state->framesize = 0;
 }
 
+/* the slot of the var is its order of addition, as the compiler numbers the macro locals */
 ril_var_t* ril_addlocalvar(RILVM vm, hashmap_key_t key)
 {
-  ril_varstack_t *varstack = (ril_varstack_t*)buffer_malloc(vm->state->varbuffer, 1);
+  ril_varstack_t *varstack = _pushvarstack(vm->state);
 
   varstack->key = key;
   ril_initvar(vm, &varstack->var);
-  ril_set2arraybyhash(vm, &vm->state->rootvar, &varstack->var, NULL, key);
+  ++vm->state->framesize;
 
   return &varstack->var;
 }
@@ -261,38 +351,83 @@ void ril_poplocalvar(RILVM vm)
 {
   int i;
   ril_localvar_t *workarea = (ril_localvar_t*)ril_workarea(vm);
-  ril_varstack_t *varstack;
   ril_state_t *state = vm->state;
 
   /* restore return var */
   if (NULL != state->returnvar) ril_deletevar(vm, state->returnvar);
   state->returnvar = workarea->returnvar;
   
-  /* clear array */
-  ril_cleararray(vm, &vm->state->rootvar);
+  _unbindlocalvar(state);
+
+  for (i = state->varsize - 1; workarea->lastindex <= i; --i)
+  {
+    ril_clearvar(state->vm, &ril_varstack(state, i)->var);
+  }
+  state->varsize = workarea->lastindex;
+
+  /* back to the caller's frame */
+  state->framesize = workarea->size;
+  state->framebase = workarea->lastindex - workarea->size;
+}
+
+/* the tag stack index of the return a tail call can keep, or -1 when a [set] waits on either frame */
+int ril_findtailframe(RILVM vm)
+{
+  ril_state_t *state = vm->state;
+  ril_tagstack_t *tagstack;
+  ril_localvar_t *workarea;
+  int i;
+
+  if (NULL != state->returnvar) return -1;
 
-  varstack = (ril_varstack_t*)buffer_back(state->varbuffer);
-  for (i = buffer_size(state->varbuffer) - 1; workarea->lastindex <= i; --i, --varstack)
+  // past the entry of the call, the tags of the macro body lie above its return
+  for (i = stack_count(state->tag_stack) - 2; 0 < i; --i)
   {
-    ril_clearvar(state->vm, &varstack->var);
+    tagstack = (ril_tagstack_t*)stack_index(state->tag_stack, i, NULL);
+    if (RIL_TAG_RETURN == ril_signature(tagstack->tag)) break;
   }
-  buffer_resize(state->varbuffer, workarea->lastindex);
+  if (0 >= i) return -1;
+
+  tagstack = (ril_tagstack_t*)stack_index(state->tag_stack, i - 1, NULL);
+  if (RIL_CALLLOADFUNC(callmacro) != tagstack->tag->loadstate_handler) return -1;
+  workarea = (ril_localvar_t*)buffer_index(state->ext_buffer, tagstack->buffer_offset);
+
+  return NULL == workarea->returnvar ? i : -1;
+}
+
+/* unwinds to the return found by ril_findtailframe and empties the frame below it */
+void ril_resetlocalvar(RILVM vm, int tailframe)
+{
+  ril_state_t *state = vm->state;
+  ril_tagstack_t *tagstack;
+  int i;
 
-  /* restore vars */
-  varstack = (ril_varstack_t*)buffer_back(state->varbuffer);
-  for (i = workarea->size - 1; 0 <= i; --i, --varstack)
+  // the entry of the call holds no workarea yet
+  stack_pop(state->tag_stack, NULL);
+  while (stack_count(state->tag_stack) - 1 > tailframe)
   {
-    ril_set2arraybyhash(state->vm, &state->rootvar, &varstack->var, NULL, varstack->key);
+    tagstack = (ril_tagstack_t*)stack_back(state->tag_stack, NULL);
+    tagstack->tag->delete_handler(vm);
+    buffer_resize(state->ext_buffer, tagstack->buffer_offset);
+    stack_pop(state->tag_stack, NULL);
+  }
+
+  _unbindlocalvar(state);
+
+  for (i = state->varsize - 1; state->framebase <= i; --i)
+  {
+    ril_clearvar(vm, &ril_varstack(state, i)->var);
   }
+  state->varsize = state->framebase;
+  state->framesize = 0;
 }
 
 void ril_savelocalvar(RILVM vm, buffer_t *buffer)
 {
   ril_localvar_t *workarea = (ril_localvar_t*)ril_workarea(vm);
 
-  ril_cleararray(vm, &vm->state->rootvar);
-
   buffer_write(buffer, &workarea->size, sizeof(workarea->size));
+  buffer_write(buffer, &workarea->lastindex, sizeof(workarea->lastindex));
 }
 
 int ril_loadlocalvar(RILVM vm, const void *src)
@@ -301,6 +436,8 @@ int ril_loadlocalvar(RILVM vm, const void *src)
   ril_localvar_t *workarea = (ril_localvar_t*)ril_mallocworkarea(vm, sizeof(ril_localvar_t));
 
   cur = ril_read(&workarea->size, cur, sizeof(workarea->size));
+  cur = ril_read(&workarea->lastindex, cur, sizeof(workarea->lastindex));
+  workarea->returnvar = NULL;
 
   return (uintptr_t)cur - (uintptr_t)src;
 }
@@ -354,6 +491,7 @@ RILRESULT ril_setargumentsbycmd(RILVM vm, ril_vmcmd_t *cmd)
     }
     argreg->parent = reg->parent;
     argreg->hashkey = reg->hashkey;
+    argreg->index = reg->index;
     argreg->var  = reg->var;
   }
   
@@ -398,6 +536,11 @@ const char* ril_getstring(RILVM vm, int index)
   return ril_var2string(vm, ril_getargument(vm, index));
 }
 
+const char* ril_getstringlen(RILVM vm, int index, int *length)
+{
+  return ril_var2stringlen(vm, ril_getargument(vm, index), length);
+}
+
 bool ril_getbool(RILVM vm, int index)
 {
   return 0 != ril_getinteger(vm, index);
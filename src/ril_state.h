@@ -6,6 +6,14 @@
 #define RIL_ARGUMENT_SIZE 32
 #define STACK_BUFFER_SIZE 1024
 #define EXT_BUFFER_SIZE 1024
+#define VAR_BLOCK_SIZE 64
+
+/* a local variable of a macro frame */
+typedef struct
+{
+  hashmap_key_t key;
+  ril_var_t var;
+} ril_varstack_t;
 
 struct _ril_state
 {
@@ -23,10 +31,55 @@ struct _ril_state
   ril_register_t args[RIL_ARGUMENT_SIZE];
 
   ril_var_t rootvar, *returnvar;
-  buffer_t *varbuffer;
+  buffer_t *varblocks; /* ril_varstack_t of every macro frame, in blocks so a local keeps its address */
+  int varsize;
+  int framebase, framesize; /* the frame of the innermost macro in the blocks */
+  bool bound; /* rootvar holds the frame, for ril_fetchlocalvar */
   buffer_t *ext_buffer;
   stack_t *tag_stack;
+  int saveframe; /* tag stack index written by ril_savestate, or -1 */
   ril_vmcmd_t tmpcmd[2];
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ril_bindlocalvar(RILVM vm);
+void ril_unsetlocalvar(RILVM vm, hashmap_key_t key);
+int ril_findtailframe(RILVM vm);
+void ril_resetlocalvar(RILVM vm, int tailframe);
+
+#ifdef __cplusplus
+}
+#endif
+
+static __inline ril_varstack_t* ril_varstack(ril_state_t *state, int index)
+{
+  return *(ril_varstack_t**)buffer_index(state->varblocks, (unsigned int)index / VAR_BLOCK_SIZE) + (unsigned int)index % VAR_BLOCK_SIZE;
+}
+
+/* a local of the innermost frame, by the slot the compiler gave it or by its key */
+static __inline ril_var_t* ril_getlocalvar(RILVM vm, int slot, hashmap_key_t key)
+{
+  ril_state_t *state = vm->state;
+  ril_varstack_t *varstack;
+  int i;
+
+  if (0 == state->framesize) return NULL;
+  if (slot < state->framesize && 0 <= slot)
+  {
+    varstack = ril_varstack(state, state->framebase + slot);
+    if (key == varstack->key) return &varstack->var;
+  }
+  if (state->bound) return ril_getvarbyhash(vm, &state->rootvar, key);
+  for (i = 0; i < state->framesize; ++i)
+  {
+    varstack = ril_varstack(state, state->framebase + i);
+    if (key == varstack->key) return &varstack->var;
+  }
+
+  return NULL;
+}
+
 #endif
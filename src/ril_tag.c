@@ -13,6 +13,7 @@
 typedef struct
 {
   bool hasfile;
+  ril_memoentry_t *memo; /* the call of a pure macro awaiting its result */
   union
   {
     struct
@@ -49,12 +50,34 @@ typedef struct
   ril_var_t var;
 } ril_stream_t;
 
+typedef struct
+{
+  struct
+  {
+    RILFUNCTION executehandler;
+    void *shareddata;
+  } ch, r; /* the handlers taken over, the output still goes to them */
+  buffer_t *output; /* the key, then the output in the layout of ril_cacheentry_t */
+  int keysize;
+  int text; /* the offset of the length of the last text, -1 after [r] */
+} ril_cache_t;
+
 typedef struct
 {
   ril_var_t *from, *item, *key;
   hashmap_entry_t *entry;
+  hashmap_key_t hash; /* the key of entry, found again if the array turns persistent */
+  uint32_t seq; /* the next entry of a persistent array */
+  int index; /* the next packed item while entry is NULL, -1 in the map, -2 in the tries */
 } ril_foreach_t;
 
+typedef struct
+{
+  ril_var_t *var;
+  ril_cmdid_t cmdid; /* the opener, its arguments bind var again once loaded */
+  int cur, to, step; /* to is excluded, a negative step counts down */
+} ril_for_t;
+
 RIL_FUNC(std_ch, vm)
 {
   printf("%s", ril_getstring(vm, 0));
@@ -88,7 +111,10 @@ RIL_FUNC(set, vm)
 RIL_FUNC(unset, vm)
 {
   ril_register_t *reg = vm->state->args;
-  ril_unset2array(vm, reg->parent, reg->hashkey);
+
+  if (&vm->state->rootvar == reg->parent) ril_unsetlocalvar(vm, reg->hashkey);
+  else if (0 <= reg->index) ril_unset2arraybyindex(vm, reg->parent, reg->index);
+  else ril_unset2array(vm, reg->parent, reg->hashkey);
   
   return RIL_NEXT;
 }
@@ -151,13 +177,17 @@ RIL_FUNC(goto, vm)
 
 RIL_FUNC(gotofile, vm)
 {
-  const char *file = ril_getstring(vm, 0);
+  char file[sizeof(vm->loadfile)];
   ril_code_t code;
   ril_label_t *label;
   uint32_t label_size;
   buffer_t *buffer = buffer_open(1, 512);
   int nexttagid = 0;
   
+  // the name may be a literal of the code that ril_load frees
+  strncpy(file, ril_getstring(vm, 0), sizeof(file) - 1);
+  file[sizeof(file) - 1] = '\0';
+  
   if (RIL_FAILED(ril_compilefile(vm, file, buffer)))
   {
     return RIL_ERROR;
@@ -205,6 +235,7 @@ RIL_FUNC(gosub, vm)
   rtn = ril_mallocworkarea(vm, sizeof(ril_return_t));
   rtn->cmd = vm->state->cmd.cur;
   rtn->hasfile = false;
+  rtn->memo = NULL;
   
   return ril_getexecutehandler(ril_getregisteredtag2(vm, RIL_TAG_GOTO))(vm);
 }
@@ -217,6 +248,7 @@ RIL_FUNC(gosubfile, vm)
   rtn = ril_mallocworkarea(vm, sizeof(ril_return_t));
   rtn->cmdid = _cmd2cmdid(vm, vm->state->cmd.cur);
   rtn->hasfile = true;
+  rtn->memo = NULL;
   strncpy(rtn->file, vm->loadfile, sizeof(rtn->file));
   
   return ril_getexecutehandler(ril_getregisteredtag2(vm, RIL_TAG_GOTOFILE))(vm);
@@ -253,6 +285,77 @@ RIL_FUNC(endif, vm)
   return RIL_BREAKPAIR;
 }
 
+/* integers, and reals of an integer value, match the integer cases, strings the string cases */
+RIL_FUNC(switch, vm)
+{
+  ril_paircmd_t *pair = vm->state->cmd.cur->pair;
+  ril_var_t *var = ril_getargument(vm, 0);
+  hashmap_entry_t *entry = NULL;
+  const char *text = NULL, *casetext;
+  char buf[16];
+  ril_vmcmd_t *target;
+  bool isnumber = false;
+  int number;
+  
+  // as ==, an integer and its text are equal, a real only equals an integer
+  if (NULL != pair->cases)
+  {
+    if (ril_isint(var))
+    {
+      sprintf(buf, "%d", var->variant.int_value);
+      text = buf;
+      isnumber = true;
+      entry = hashmap_getentry(pair->cases, (hashmap_key_t)var->variant.int_value);
+    }
+    else if (ril_isreal(var) && var->variant.real_value == (float)(int)var->variant.real_value)
+    {
+      isnumber = true;
+      entry = hashmap_getentry(pair->cases, (hashmap_key_t)(int)var->variant.real_value);
+    }
+    else if (ril_isstring(var))
+    {
+      text = ril_var2string(vm, var);
+      isnumber = ril_isintegertext(text, &number);
+      entry = hashmap_getentry(pair->cases, isnumber ? (hashmap_key_t)number : hashmap_makekey(text));
+    }
+  }
+  
+  // an integer case has no text
+  if (NULL != entry)
+  {
+    casetext = (const char*)hashmap_getrawkeybyentry(entry);
+    if (NULL == casetext ? !isnumber : NULL == text || 0 != strcmp(text, casetext)) entry = NULL;
+  }
+  
+  target = NULL != entry ? (ril_vmcmd_t*)hashmap_getdatabyentry(entry) : pair->other;
+  if (NULL == target) return RIL_BREAKPAIR;
+  
+  vm->state->cmd.next = target + 1;
+  
+  return RIL_NULL;
+}
+
+RIL_COMPILEFUNC(case, context)
+{
+  return rilc_checkcase(context);
+}
+
+/* the body before reaches the next case */
+RIL_FUNC(case, vm)
+{
+  return RIL_BREAKPAIR;
+}
+
+RIL_FUNC(default, vm)
+{
+  return RIL_BREAKPAIR;
+}
+
+RIL_FUNC(endswitch, vm)
+{
+  return RIL_BREAKPAIR;
+}
+
 RIL_FUNC(let, vm)
 {
   return RIL_NEXT;
@@ -260,8 +363,7 @@ RIL_FUNC(let, vm)
 
 RIL_COMPILEFUNC(macro, context)
 {
-  ril_tag_t *t;
-  char name[128], args[256], localvars[256];
+  char name[128], args[256], localvars[256], pure[16];
   ril_crc_t namehash;
   buffer_t *buffer;
   int i;
@@ -275,14 +377,15 @@ RIL_COMPILEFUNC(macro, context)
   /* local variables */
   strcpy(localvars, rilc_getstring(context, 2));
   
-  if (NULL == ril_getregisteredtag(context->vm, name, args))
-  {
-    t = ril_registertag(context->vm, name, args, RIL_CALLFUNC(callmacro));
-    RIL_SETSTORAGE(t, callmacro);
-  }
+  /* pure */
+  strcpy(pure, 0 != atoi(rilc_getstring(context, 3)) ? "1" : "0");
+  
+  ril_registermacro(context->vm, name, args);
   
   rilc_eraselastcmd(context);
   rilc_newcmd(context, ril_signature(context->tag));
+  context->localowner = context->cmdid;
+  context->localsignature = ril_signature(context->tag);
   rilc_addstring(context, name);
   rilc_addstring(context, args);
   
@@ -296,13 +399,18 @@ RIL_COMPILEFUNC(macro, context)
   calc_writevalue2buffer(context->data_buffer, VARIANT_LITERAL | VARIANT_BYTES, NULL, sizeof(uint32_t) + i);
   *(uint32_t*)buffer_malloc(context->data_buffer, sizeof(uint32_t)) = i; /* byte size */
   *(int32_t*)buffer_malloc(context->data_buffer, sizeof(int32_t)) = buffer_size(buffer); /* var size */
+  // the body refers to the locals by these slots
+  buffer_clear(context->local_buffer);
   for (i = 0; i < buffer_size(buffer); ++i)
   {
     namehash = ril_makecrc(ril_getparametername(buffer, i));
     buffer_write(context->data_buffer, &namehash, sizeof(namehash));
+    buffer_write(context->local_buffer, &namehash, 1);
   }
   calc_writeoperator(context->data_buffer, CALC_END);
-  buffer_close(buffer);
+  ril_closeparameters(buffer);
+  
+  rilc_addstring(context, pure);
   
   return RIL_OK;
 }
@@ -312,27 +420,83 @@ RIL_FUNC(macro, vm)
   ril_tag_t *tag = ril_registertag(vm, ril_getstring(vm, 0), ril_getstring(vm, 1), RIL_CALLFUNC(callmacro));
   RIL_SETSTORAGE(tag, callmacro);
   ril_setshareddata(tag, vm->state->cmd.cur);
+  if (0 != atoi(ril_getstring(vm, 3))) ril_setmemo(vm, tag);
+  else if (NULL != tag->memo)
+  {
+    ril_closememo(tag->memo);
+    tag->memo = NULL;
+  }
 
   return RIL_BREAKPAIR;
 }
 
 RIL_FUNC(callmacro, vm)
 {
-  int i, varsize;
+  int i, varsize, tailframe;
   ril_tag_t *tag = ril_currenttag(vm);
-  ril_var_t *var, *var2;
+  ril_var_t *var, *var2, args[RIL_ARGUMENT_SIZE];
   ril_return_t *rtn;
+  ril_memoentry_t *memo = NULL;
+  ril_tagstack_t *stack;
+  const calc_value_t *value;
   const ril_crc_t *localvars;
+  
+  if (NULL != tag->memo)
+  {
+    memo = ril_findmemo(vm, tag);
+    if (NULL != memo)
+    {
+      // the entry of the call holds no workarea yet, ril_calltag adds none
+      stack = (ril_tagstack_t*)stack_back(vm->state->tag_stack, NULL);
+      if (NULL != stack && tag == stack->tag && buffer_size(vm->state->ext_buffer) == stack->buffer_offset)
+      {
+        stack_pop(vm->state->tag_stack, NULL);
+      }
+      ril_returnmemo(vm, memo);
+      return RIL_NEXT;
+    }
+    memo = ril_newmemoentry(vm, tag);
+  }
 
-  var = ((ril_register_t*)calc_execute(vm, ((ril_vmcmd_t*)ril_getshareddata(tag))->arg[2].data))->var;
-  localvars = (ril_crc_t*)variant_getbytes(&var->variant);
+  // the vars argument is a pushed literal: opcode, value, byte size, var size, then the keys
+  value = (const calc_value_t*)((const calc_opcode_t*)((ril_vmcmd_t*)ril_getshareddata(tag))->arg[2].data + 1);
+  localvars = (const ril_crc_t*)((const uint32_t*)(value + 1) + 1);
   
   varsize = *localvars;
   ++localvars;
 
+  tailframe = vm->state->cmd.cur->tailcall ? ril_findtailframe(vm) : -1;
+  if (0 <= tailframe)
+  {
+    /* the macro given up returns nothing, the frame awaits the result of this call */
+    rtn = (ril_return_t*)buffer_index(vm->state->ext_buffer,
+      ((ril_tagstack_t*)stack_index(vm->state->tag_stack, tailframe, NULL))->buffer_offset);
+    if (NULL != rtn->memo) ril_storememo(vm, rtn->memo, NULL);
+    rtn->memo = memo;
+    
+    /* the arguments may be locals of the frame given up */
+    for (i = 0; i < varsize && i < RIL_ARGUMENT_SIZE; ++i)
+    {
+      ril_initvar(vm, &args[i]);
+      if (ril_has(vm, i)) ril_copyvar(vm, &args[i], ril_getargument(vm, i));
+    }
+    ril_resetlocalvar(vm, tailframe);
+    for (i = 0; i < varsize; ++i)
+    {
+      var = ril_addlocalvar(vm, *localvars);
+      ++localvars;
+      if (RIL_ARGUMENT_SIZE <= i) continue;
+      ril_copyvar(vm, var, &args[i]);
+      ril_clearvar(vm, &args[i]);
+    }
+
+    /* the return of the frame still leads back to its caller */
+    vm->state->cmd.next = (ril_vmcmd_t*)ril_getshareddata(tag);
+    return RIL_NEXT;
+  }
+
   /* set local variables */
   ril_pushlocalvar(vm);
-  ril_fetchlocalvar(vm);
   for (i = 0; i < varsize; ++i)
   {
     var = ril_addlocalvar(vm, *localvars);
@@ -343,7 +507,6 @@ RIL_FUNC(callmacro, vm)
     var2 = ril_getargument(vm, i);
     ril_copyvar(vm, var, var2);
   }
-  ril_fetchglobalvar(vm);
   
   vm->state->cmd.next = (ril_vmcmd_t*)ril_getshareddata(tag);
   
@@ -351,6 +514,7 @@ RIL_FUNC(callmacro, vm)
   rtn = (ril_return_t*)ril_mallocworkarea(vm, sizeof(ril_return_t));
   rtn->cmd = vm->state->cmd.cur;
   rtn->hasfile = false;
+  rtn->memo = memo;
   
   return RIL_NEXT;
 }
@@ -378,10 +542,21 @@ RIL_FUNC(endmacro, vm)
   return RIL_CALLFUNC(return)(vm);
 }
 
+/* the [return] of an inlined macro */
+RIL_FUNC(returnvalue, vm)
+{
+  ril_var_t *var = ril_getargument(vm, 0);
+  
+  if (!ril_isnull(var)) ril_return(vm, var);
+  
+  return RIL_NEXT;
+}
+
 RIL_FUNC(return, vm)
 {
   ril_tagstack_t *stack;
   ril_return_t *workarea;
+  ril_memoentry_t *memo;
   ril_cmdid_t cmdid;
   ril_var_t var;
   
@@ -404,6 +579,8 @@ RIL_FUNC(return, vm)
   }
   
   workarea = ril_workarea(vm);
+  memo = workarea->memo;
+  workarea->memo = NULL;
   
   if (workarea->hasfile)
   {
@@ -426,6 +603,7 @@ RIL_FUNC(return, vm)
     ril_releaseworkarea(vm, workarea->cmd->tag);
   }
 
+  if (NULL != memo) ril_storememo(vm, memo, &var);
   if (!ril_isnull(&var)) ril_return(vm, &var);
   ril_clearvar(vm, &var);
   
@@ -463,6 +641,7 @@ RIL_LOADFUNC(return, vm, src)
   ril_return_t *workarea = (ril_return_t*)ril_mallocworkarea(vm, sizeof(ril_return_t));
   
   workarea->hasfile = *(uint8_t*)cur++;
+  workarea->memo = NULL;
   if (workarea->hasfile)
   {
     workarea->cmdid = *(ril_cmdid_t*)cur;
@@ -481,6 +660,11 @@ RIL_LOADFUNC(return, vm, src)
 
 RIL_DELETEFUNC(return, vm)
 {
+  ril_return_t *workarea = ril_workarea(vm);
+  
+  /* left without a result */
+  if (NULL != workarea->memo) ril_deletememoentry(vm, workarea->memo);
+  
   return RIL_OK;
 }
 
@@ -530,9 +714,32 @@ RIL_FUNC(dowhile, vm)
   return ril_getbool(vm, 0) ? RIL_FIRSTPAIR : RIL_BREAKPAIR;
 }
 
+/* the packed keys lead the map or the tries in their order once the array leaves the vector,
+   so the ones below index were walked already */
+static __inline bool _isvisited(const char *name, int index, int *last)
+{
+  const char *cur = name;
+  int num;
+  
+  if (NULL == name || '\0' == *name) return false;
+  for (; '\0' != *cur; ++cur)
+  {
+    if (!isdigit((unsigned char)*cur)) return false;
+  }
+  num = atoi(name);
+  if (num >= index || num <= *last) return false;
+  *last = num;
+  
+  return true;
+}
+
 RIL_FUNC(foreach, vm)
 {
   ril_foreach_t *workarea;
+  ril_array_t *array;
+  hamt_leaf_t *leaf;
+  char name[16];
+  int last;
   
   if (ril_isfirst(vm))
   {
@@ -541,12 +748,85 @@ RIL_FUNC(foreach, vm)
     if (!ril_isarray(workarea->from)) return RIL_BREAKPAIR;
     workarea->item = ril_getargument(vm, 1);
     if (ril_has(vm, 2)) workarea->key = ril_getargument(vm, 2);
-    workarea->entry = hashmap_firstentry(((ril_array_t*)workarea->from->variant.ptr_value)->map);
+    array = (ril_array_t*)workarea->from->variant.ptr_value;
+    workarea->entry = hashmap_firstentry(array->map);
+    workarea->index = NULL == workarea->entry ? 0 : -1;
+    if (NULL != workarea->entry) workarea->hash = hashmap_getkeybyentry(workarea->entry);
+    workarea->seq = 0;
+    if (array->persistent) workarea->index = -2;
   }
   else
   {
     workarea = (ril_foreach_t*)ril_workarea(vm);
   }
+
+  /* packed items go by index, and continue in the map once they are unpacked */
+  if (0 <= workarea->index)
+  {
+    if (!ril_isarray(workarea->from)) return RIL_BREAKPAIR;
+    array = (ril_array_t*)workarea->from->variant.ptr_value;
+    if (array->persistent)
+    {
+      for (leaf = hamt_seek(array->byseq, 0), last = -1; NULL != leaf; leaf = hamt_seek(array->byseq, leaf->key + 1))
+      {
+        if (!_isvisited((const char*)leaf->extra, workarea->index, &last)) break;
+      }
+      if (NULL == leaf) return RIL_BREAKPAIR;
+      workarea->seq = leaf->key;
+      workarea->index = -2;
+    }
+    else if (0 == hashmap_count(array->map))
+    {
+      if (workarea->index >= array->size) return RIL_BREAKPAIR;
+
+      ril_copyvar(vm, workarea->item, array->items[workarea->index]);
+      if (ril_has(vm, 2))
+      {
+        sprintf(name, "%d", workarea->index);
+        ril_setstring(vm, workarea->key, name);
+      }
+      ++workarea->index;
+
+      return RIL_NEXT;
+    }
+    else
+    {
+      for (workarea->entry = hashmap_firstentry(array->map), last = -1; NULL != workarea->entry; workarea->entry = hashmap_nextentry(workarea->entry))
+      {
+        if (!_isvisited((char*)hashmap_getrawkeybyentry(workarea->entry), workarea->index, &last)) break;
+      }
+      if (NULL != workarea->entry) workarea->hash = hashmap_getkeybyentry(workarea->entry);
+      workarea->index = -1;
+    }
+  }
+  else if (-1 == workarea->index && NULL != workarea->entry && ril_isarray(workarea->from))
+  {
+    // the map entries are gone once the array turns persistent
+    array = (ril_array_t*)workarea->from->variant.ptr_value;
+    if (array->persistent)
+    {
+      leaf = hamt_get(array->bykey, workarea->hash);
+      if (NULL == leaf) return RIL_BREAKPAIR;
+      workarea->seq = leaf->aux;
+      workarea->index = -2;
+    }
+  }
+
+  /* persistent arrays go by insertion seq */
+  if (-2 == workarea->index)
+  {
+    if (!ril_isarray(workarea->from)) return RIL_BREAKPAIR;
+    array = (ril_array_t*)workarea->from->variant.ptr_value;
+    if (!array->persistent) return RIL_BREAKPAIR;
+    leaf = hamt_seek(array->byseq, workarea->seq);
+    if (NULL == leaf) return RIL_BREAKPAIR;
+
+    ril_copyvar(vm, workarea->item, (ril_var_t*)leaf->value);
+    if (ril_has(vm, 2)) ril_setstring(vm, workarea->key, (const char*)leaf->extra);
+    workarea->seq = leaf->key + 1;
+
+    return RIL_NEXT;
+  }
   
   if (NULL == workarea->entry)
   {
@@ -557,15 +837,72 @@ RIL_FUNC(foreach, vm)
   if (ril_has(vm, 2)) ril_setstring(vm, workarea->key, (char*)hashmap_getrawkeybyentry(workarea->entry));
 
   workarea->entry = hashmap_nextentry(workarea->entry);
+  if (NULL != workarea->entry) workarea->hash = hashmap_getkeybyentry(workarea->entry);
   
   return RIL_NEXT;
 }
 
 RIL_FUNC(endforeach, vm)
 {
+  RILFUNCTION handler = vm->state->cmd.cur->pair->first->tag->execute_handler;
+  
+  // a range of integers is counted here
+  if (RIL_CALLFUNC(for) == handler || RIL_CALLFUNC(hoistfor) == handler) return RIL_CALLFUNC(endfor)(vm);
+  
   return RIL_FIRSTPAIR;
 }
 
+RIL_COMPILEFUNC(endloop, context)
+{
+  rilc_hoist(context, context->cmd->pair_cmdid.id);
+  
+  return RIL_OK;
+}
+
+// the calcs hoisted out of the body run once the loop is entered
+static __inline int _hoist(RILVM vm, int result)
+{
+  const ril_var_t *var;
+  const int8_t *cur, *end;
+  uint32_t size;
+  
+  if (RIL_NEXT != result || !ril_isfirst(vm)) return result;
+  
+  var = ril_getargument(vm, vm->state->argc - 1);
+  if ((VARIANT_LITERAL | VARIANT_BYTES) != var->variant.type) return result;
+  
+  cur = (const int8_t*)ril_read(&size, var->variant.ptr_value, sizeof(size));
+  for (end = cur + size; cur < end; cur += size)
+  {
+    cur = (const int8_t*)ril_read(&size, cur, sizeof(size));
+    calc_execute(vm, cur);
+  }
+  
+  return result;
+}
+
+RIL_FUNC(hoistwhile, vm)
+{
+  return _hoist(vm, RIL_CALLFUNC(while)(vm));
+}
+
+RIL_FUNC(hoistdo, vm)
+{
+  return _hoist(vm, RIL_CALLFUNC(do)(vm));
+}
+
+RIL_FUNC(hoistforeach, vm)
+{
+  int argc = vm->state->argc, result;
+  
+  /* the calcs are not the key of [foreach from item] */
+  vm->state->argc = argc - 1;
+  result = RIL_CALLFUNC(foreach)(vm);
+  vm->state->argc = argc;
+  
+  return _hoist(vm, result);
+}
+
 RIL_SAVEFUNC(foreach, vm, dest)
 {
   return RIL_OK;
@@ -581,6 +918,101 @@ RIL_DELETEFUNC(foreach, vm)
   return RIL_OK;
 }
 
+// the counter moves by step and stays short of to, computed wide so it cannot wrap
+static __inline bool _nextfor(ril_for_t *workarea, bool isfirst)
+{
+  int64_t next = (int64_t)workarea->cur + (isfirst ? 0 : workarea->step);
+  
+  if (0 < workarea->step ? next >= workarea->to : 0 == workarea->step || next <= workarea->to) return false;
+  workarea->cur = (int)next;
+  
+  return true;
+}
+
+RIL_FUNC(for, vm)
+{
+  ril_for_t *workarea;
+  bool isfirst = ril_isfirst(vm);
+  
+  if (isfirst)
+  {
+    workarea = (ril_for_t*)ril_mallocworkarea(vm, sizeof(ril_for_t));
+    /* held while the loop runs, the body may unset or replace it */
+    workarea->var = ril_getargument(vm, 0);
+    ril_retainvar(workarea->var);
+    workarea->cmdid = ril_cmd(vm);
+    workarea->cur = ril_getinteger(vm, 1);
+    workarea->to = ril_getinteger(vm, 2);
+    workarea->step = ril_getinteger(vm, 3);
+  }
+  else
+  {
+    // back from continue
+    workarea = (ril_for_t*)ril_workarea(vm);
+  }
+  
+  if (!_nextfor(workarea, isfirst)) return RIL_BREAKPAIR;
+  ril_setinteger(vm, workarea->var, workarea->cur);
+  
+  return RIL_NEXT;
+}
+
+RIL_FUNC(endfor, vm)
+{
+  ril_for_t *workarea = (ril_for_t*)ril_workarea(vm);
+  
+  if (!_nextfor(workarea, false)) return RIL_BREAKPAIR;
+  ril_setinteger(vm, workarea->var, workarea->cur);
+  
+  /* the body again, the arguments of the opener are not computed */
+  vm->state->cmd.next = vm->state->cmd.cur->pair->first + 1;
+  
+  return RIL_NULL;
+}
+
+RIL_FUNC(hoistfor, vm)
+{
+  return _hoist(vm, RIL_CALLFUNC(for)(vm));
+}
+
+RIL_SAVEFUNC(for, vm, dest)
+{
+  ril_for_t *workarea = ril_workarea(vm);
+  
+  buffer_write(dest, &workarea->cmdid, sizeof(workarea->cmdid));
+  buffer_write(dest, &workarea->cur, sizeof(workarea->cur));
+  buffer_write(dest, &workarea->to, sizeof(workarea->to));
+  buffer_write(dest, &workarea->step, sizeof(workarea->step));
+  
+  return RIL_OK;
+}
+
+RIL_LOADFUNC(for, vm, src)
+{
+  const void *cur = src;
+  ril_for_t *workarea = (ril_for_t*)ril_mallocworkarea(vm, sizeof(ril_for_t));
+  
+  cur = ril_read(&workarea->cmdid, cur, sizeof(workarea->cmdid));
+  cur = ril_read(&workarea->cur, cur, sizeof(workarea->cur));
+  cur = ril_read(&workarea->to, cur, sizeof(workarea->to));
+  cur = ril_read(&workarea->step, cur, sizeof(workarea->step));
+  
+  ril_setarguments(vm, workarea->cmdid);
+  workarea->var = ril_getargument(vm, 0);
+  ril_retainvar(workarea->var);
+  
+  return (intptr_t)cur - (intptr_t)src;
+}
+
+RIL_DELETEFUNC(for, vm)
+{
+  ril_for_t *workarea = (ril_for_t*)ril_workarea(vm);
+  
+  ril_deletevar(vm, workarea->var);
+  
+  return RIL_OK;
+}
+
 RIL_FUNC(exit, vm)
 {
   return RIL_EXIT;
@@ -600,26 +1032,13 @@ RIL_FUNC(const, vm)
 
 RIL_COMPILEFUNC(include, context)
 {
-  RILRESULT result;
-  char *buf;
   const char *file;
 
   file = ril_getpath(context->vm, rilc_getstring(context, 0));
   
-  buf = ril_readfile(file);
-  
-  if (NULL == buf)
-  {
-    return ril_error(context->vm, "Fatal error: Cannot open %s", file);
-  }
-  
   rilc_eraselastcmd(context);
   
-  result = rilc_compile(buf, context);
-  
-  ril_free(buf);
-  
-  return result;
+  return rilc_include(context, file);
 }
 
 static RIL_FUNC(stream2var, vm)
@@ -632,18 +1051,15 @@ static RIL_FUNC(stream2var, vm)
   
   if (VARIANT_STRING & var->variant.type)
   {
-    str = ril_var2string(vm, var);
-    length = strlen(str);
-    str2 = ril_getstring(vm, 0);
-    length2 = strlen(str2);
+    str = ril_var2stringlen(vm, var, &length);
+    str2 = ril_getstringlen(vm, 0, &length2);
     
-    buf = ril_mallocworkarea(vm, length + length2 + 1);
+    buf = ril_mallocworkarea(vm, length + length2);
     memcpy(buf, str, length);
     memcpy(buf + length, str2, length2);
-    buf[length + length2] = '\0';
     
-    ril_setstring(vm, var, buf);
-    ril_eraseworkarea(vm, length + length2 + 1);
+    ril_setstringbysize(vm, var, buf, length + length2);
+    ril_eraseworkarea(vm, length + length2);
   }
   else
   {
@@ -759,6 +1175,204 @@ RIL_DELETEFUNC(stream, vm)
   return RIL_OK;
 }
 
+/* runs a handler the cache took over with both output tags as they were before [cache] */
+static int _forwardcache(RILVM vm, ril_cache_t *cache, RILFUNCTION handler)
+{
+  ril_tag_t *ch = ril_getregisteredtag2(vm, RIL_TAG_CH), *r = ril_getregisteredtag2(vm, RIL_TAG_R);
+  RILFUNCTION chhandler = ril_getexecutehandler(ch), rhandler = ril_getexecutehandler(r);
+  int result;
+  
+  ril_setexecutehandler(ch, cache->ch.executehandler);
+  ril_setshareddata(ch, cache->ch.shareddata);
+  ril_setexecutehandler(r, cache->r.executehandler);
+  ril_setshareddata(r, cache->r.shareddata);
+  
+  result = handler(vm);
+  
+  ril_setexecutehandler(ch, chhandler);
+  ril_setshareddata(ch, cache);
+  ril_setexecutehandler(r, rhandler);
+  ril_setshareddata(r, cache);
+  
+  return result;
+}
+
+static RIL_FUNC(cache2ch, vm)
+{
+  ril_cache_t *cache = ril_getshareddata(ril_getregisteredtag2(vm, RIL_TAG_CH));
+  const char *str;
+  int32_t length;
+  int size;
+  
+  // output over the budget is not kept, so it is not captured either
+  if (buffer_size(cache->output) <= vm->cache.budget)
+  {
+    str = ril_getstringlen(vm, 0, &size);
+    if (0 > cache->text)
+    {
+      cache->text = buffer_size(cache->output);
+      length = 0;
+      buffer_write(cache->output, &length, sizeof(length));
+    }
+    // the texts between two [r] are joined
+    ril_read(&length, buffer_index(cache->output, cache->text), sizeof(length));
+    length += size;
+    memcpy(buffer_index(cache->output, cache->text), &length, sizeof(length));
+    buffer_write(cache->output, str, size);
+  }
+  
+  return _forwardcache(vm, cache, cache->ch.executehandler);
+}
+
+static RIL_FUNC(cache2r, vm)
+{
+  ril_cache_t *cache = ril_getshareddata(ril_getregisteredtag2(vm, RIL_TAG_R));
+  int32_t length = -1;
+  
+  if (buffer_size(cache->output) <= vm->cache.budget) buffer_write(cache->output, &length, sizeof(length));
+  cache->text = -1;
+  
+  return _forwardcache(vm, cache, cache->r.executehandler);
+}
+
+static void _capturecache(RILVM vm, ril_cache_t *cache)
+{
+  ril_tag_t *tag;
+  
+  tag = ril_getregisteredtag2(vm, RIL_TAG_CH);
+  cache->ch.executehandler = ril_getexecutehandler(tag);
+  cache->ch.shareddata = ril_getshareddata(tag);
+  ril_pushfunction(vm, tag, RIL_CALLFUNC(cache2ch), NULL, NULL, NULL, cache);
+  tag = ril_getregisteredtag2(vm, RIL_TAG_R);
+  cache->r.executehandler = ril_getexecutehandler(tag);
+  cache->r.shareddata = ril_getshareddata(tag);
+  ril_pushfunction(vm, tag, RIL_CALLFUNC(cache2r), NULL, NULL, NULL, cache);
+}
+
+/* hands the output of a hit to the current ch and r, in one state for the whole of it */
+static void _replaycache(RILVM vm, const ril_cacheentry_t *entry)
+{
+  const uint8_t *cur = entry->data + entry->keysize, *end = entry->data + entry->size;
+  ril_tag_t *ch = ril_getregisteredtag2(vm, RIL_TAG_CH), *r = ril_getregisteredtag2(vm, RIL_TAG_R);
+  ril_state_t *state = ril_getstate(vm);
+  int32_t length;
+  
+  ril_setstate(ril_newstate(vm));
+  while (cur < end)
+  {
+    cur = ril_read(&length, cur, sizeof(length));
+    if (0 > length)
+    {
+      ril_calltag(vm, r);
+      continue;
+    }
+    ril_setstringbysize(vm, ril_getargument(vm, 0), (const char*)cur, length);
+    ril_calltag(vm, ch);
+    cur += length;
+  }
+  ril_deletestate(ril_getstate(vm));
+  ril_setstate(state);
+}
+
+RIL_FUNC(cache, vm)
+{
+  ril_cache_t *cache, **workarea = (ril_cache_t**)ril_mallocworkarea(vm, sizeof(ril_cache_t*));
+  const ril_cacheentry_t *entry;
+  const char *key;
+  int keysize;
+  
+  key = ril_getstringlen(vm, 0, &keysize);
+  entry = ril_findcache(vm, key, keysize);
+  if (NULL != entry)
+  {
+    // the body is skipped, the output it gave goes out again
+    *workarea = NULL;
+    _replaycache(vm, entry);
+    return RIL_BREAKPAIR;
+  }
+  
+  cache = *workarea = (ril_cache_t*)ril_malloc(sizeof(ril_cache_t));
+  cache->output = buffer_open(1, 256);
+  buffer_write(cache->output, key, keysize);
+  cache->keysize = keysize;
+  cache->text = -1;
+  _capturecache(vm, cache);
+  
+  return RIL_NEXT;
+}
+
+RIL_FUNC(endcache, vm)
+{
+  ril_cache_t *cache = *(ril_cache_t**)ril_workarea(vm);
+  
+  ril_storecache(vm, buffer_front(cache->output), cache->keysize, buffer_size(cache->output));
+  
+  return RIL_BREAKPAIR;
+}
+
+RIL_SAVEFUNC(cache, vm, dest)
+{
+  ril_cache_t *cache = *(ril_cache_t**)ril_workarea(vm);
+  int32_t size = buffer_size(cache->output);
+  
+  buffer_write(dest, &size, sizeof(size));
+  buffer_write(dest, &cache->keysize, sizeof(cache->keysize));
+  buffer_write(dest, &cache->text, sizeof(cache->text));
+  buffer_write(dest, buffer_front(cache->output), size);
+  
+  return RIL_OK;
+}
+
+RIL_LOADFUNC(cache, vm, src)
+{
+  const void* cur = src;
+  ril_cache_t *cache = (ril_cache_t*)ril_malloc(sizeof(ril_cache_t));
+  int32_t size;
+  
+  *(ril_cache_t**)ril_mallocworkarea(vm, sizeof(ril_cache_t*)) = cache;
+  cur = ril_read(&size, cur, sizeof(size));
+  cur = ril_read(&cache->keysize, cur, sizeof(cache->keysize));
+  cur = ril_read(&cache->text, cur, sizeof(cache->text));
+  cache->output = buffer_open(1, size + 256);
+  buffer_write(cache->output, cur, size);
+  cur = (int8_t*)cur + size;
+  _capturecache(vm, cache);
+  
+  return (intptr_t)cur - (intptr_t)src;
+}
+
+RIL_DELETEFUNC(cache, vm)
+{
+  ril_cache_t **workarea = (ril_cache_t**)ril_workarea(vm);
+  ril_cache_t *cache = *workarea;
+  
+  // a hit has taken nothing over
+  if (NULL == cache) return RIL_OK;
+  
+  ril_popfunction(vm, ril_popfunction(vm, workarea + 1));
+  buffer_close(cache->output);
+  ril_free(cache);
+  
+  return RIL_OK;
+}
+
+RIL_FUNC(uncache, vm)
+{
+  int keysize;
+  const char *key = ril_getstringlen(vm, 0, &keysize);
+  
+  ril_removecache(vm, key, keysize);
+  
+  return RIL_NEXT;
+}
+
+RIL_FUNC(uncacheall, vm)
+{
+  ril_clearcache(vm);
+  
+  return RIL_NEXT;
+}
+
 RIL_SAVEFUNC(null, vm, dest)
 {
   return RIL_OK;
@@ -798,6 +1412,10 @@ RIL_COMPILEFUNC(literal, context)
   int valueindex;
   calc_value_t *value;
   ril_cmd_t *textcmd = NULL;
+  char terminator[RIL_DELIMITER_LENGTH + 16];
+  
+  sprintf(terminator, "%sendliteral", context->vm->delimiter.left.string);
+  rilc_readahead(context, terminator);
   
   if ('\r' == *context->cur) ++context->cur;
   if ('\n' == *context->cur) ++context->cur;
@@ -911,73 +1529,86 @@ RIL_FUNC(file, vm)
   return RIL_NEXT;
 }
 
+// one character, a NUL or a broken sequence counts as a byte
+static __inline int _mbsize(const char *str, const char *end)
+{
+  int size = mblen(str, end - str);
+  
+  return 0 < size ? size : 1;
+}
+
 RIL_FUNC(substr, vm)
 {
-  const char *str = ril_getstring(vm, 0), *begin;
-  char *buf;
+  int size;
+  const char *str = ril_getstringlen(vm, 0, &size), *begin, *end = str + size;
   int offset = ril_getinteger(vm, 1);
   int length = ril_getinteger(vm, 2);
+  ril_var_t var;
 
   if (0 > offset)
   {
-    offset += ril_mbstrlen(str);
+    offset += ril_mbstrnlen(str, size);
   }
   if (0 >= length)
   {
-    length += ril_mbstrlen(str);
+    length += ril_mbstrnlen(str, size);
   }
 
-  while ('\0' != *str)
+  while (str < end)
   {
     if (0 >= offset) break;
-    str += mblen(str, MB_CUR_MAX);
+    str += _mbsize(str, end);
     --offset;
   }
 
   begin = str;
-  while ('\0' != *str)
+  while (str < end)
   {
     if (0 >= length) break;
-    str += mblen(str, MB_CUR_MAX);
+    str += _mbsize(str, end);
     --length;
   }
 
-  length = str - begin;
-  buf = ril_mallocworkarea(vm, length + 1);
-  memcpy(buf, begin, length);
-  buf[length] = '\0';
-  ril_returnstring(vm, buf);
-  ril_eraseworkarea(vm, length + 1);
+  ril_initvar(vm, &var);
+  ril_setstringbysize(vm, &var, begin, str - begin);
+  ril_return(vm, &var);
+  ril_clearvar(vm, &var);
 
   return RIL_NEXT;
 }
 
 RIL_FUNC(strlen, vm)
 {
-  const char *str = ril_getstring(vm, 0);
+  int length;
+  const char *str = ril_getstringlen(vm, 0, &length);
 
-  ril_returninteger(vm, ril_mbstrlen(str));
+  ril_returninteger(vm, ril_mbstrnlen(str, length));
 
   return RIL_NEXT;
 }
 
 RIL_FUNC(strtok, vm)
 {
-  const char *str = ril_getstring(vm, 0);
-  size_t size = strlen(str) + 1;
-  char *buf = (char*)ril_malloc(size);
-  const char *delimiter = ril_getstring(vm, 1);
-  const char *token;
+  int size, delimitersize;
+  const char *src = ril_getstringlen(vm, 0, &size), *str, *end, *token;
+  char *buf = (char*)ril_malloc(size + 1);
+  const char *delimiter;
   ril_var_t var;
 
   ril_initvar(vm, &var);
 
-  memcpy(buf, str, size);
-  token = strtok(buf, delimiter);
-  while (NULL != token)
+  // the text is copied before a converted delimiter may move the calc buffer
+  memcpy(buf, src, size);
+  delimiter = ril_getstringlen(vm, 1, &delimitersize);
+  str = buf;
+  end = buf + size;
+
+  // the bytes between delimiters like strtok, a NUL in either string is a byte too
+  while (str < end)
   {
-    ril_setstring(vm, ril_createvar(vm, &var, NULL), token);
-    token = strtok(NULL, delimiter);
+    for (; str < end && NULL != memchr(delimiter, *str, delimitersize); ++str);
+    for (token = str; str < end && NULL == memchr(delimiter, *str, delimitersize); ++str);
+    if (token < str) ril_setstringbysize(vm, ril_createvar(vm, &var, NULL), token, str - token);
   }
 
   ril_return(vm, &var);
@@ -106,7 +106,7 @@ uint8_t ril_endian(void)
 
 RILRESULT ril_error(RILVM vm, const char *s, ...)
 {
-  static char temp[1024];
+  char temp[1024];
   va_list vl;
   
   if (NULL == vm->error_hander) return RIL_ERROR;
@@ -140,6 +140,11 @@ char* ril_readfile(const char *file)
   return buf;
 }
 
+int ril_readfp(void *fp, char *dest, int size)
+{
+  return (int)fread(dest, 1, size, (FILE*)fp);
+}
+
 size_t ril_writefile(const char *file, const void *src, int size)
 {
   FILE *fp = fopen(file, "wb");
@@ -155,7 +160,7 @@ size_t ril_writefile(const char *file, const void *src, int size)
 
 const char* ril_getpath(RILVM vm, const char *file)
 {
-  static char path[1024];
+  static RIL_THREADLOCAL char path[1024];
   int length = strlen(vm->path);
   
 #ifdef _WIN32
@@ -184,6 +189,22 @@ int ril_mbstrlen(const char*str)
   return count;
 }
 
+/* counts characters of the first length bytes, a NUL counts as one */
+int ril_mbstrnlen(const char *str, int length)
+{
+  const char *end = str + length;
+  int count = 0, size;
+
+  while (str < end)
+  {
+    size = mblen(str, end - str);
+    str += 0 < size ? size : 1;
+    count++;
+  }
+
+  return count;
+}
+
 void ril_str2lower(char *dest, const char *src)
 {
   int length;
@@ -3,6 +3,12 @@
 #ifndef _RIL_UTILS_H_
 #define _RIL_UTILS_H_
 
+#ifdef _WIN32
+#define RIL_THREADLOCAL __declspec(thread)
+#else
+#define RIL_THREADLOCAL __thread
+#endif
+
 enum {
   RIL_LITTLE_ENDIAN = 0,
   RIL_BIG_ENDIAN,
@@ -24,6 +30,7 @@ char* ril_nextline(const char *src);
 uint8_t ril_endian(void);
 RILRESULT ril_error(RILVM vm, const char *s, ...);
 char* ril_readfile(const char *file);
+int ril_readfp(void *fp, char *dest, int size);
 size_t ril_writefile(const char *file, const void *src, int size);
 const char* ril_getpath(RILVM vm, const char *file);
 void ril_str2lower(char *dest, const char *src);
@@ -31,6 +38,11 @@ void ril_str2upper(char *dest, const char *src);
 
 static __inline ril_vmcmd_t* _cmdid2cmd(RILVM vm, ril_cmdid_t cmdid)
 {
+  // ids of the replaced program while ril_reload restores the state
+  if (NULL != vm->cmdmap && 0 <= cmdid.id && cmdid.id < vm->cmdmap_size)
+  {
+    cmdid.id = vm->cmdmap[cmdid.id];
+  }
   return vm->code.cmd + cmdid.id;
 }
 
@@ -43,6 +55,7 @@ static __inline ril_cmdid_t _cmd2cmdid(RILVM vm, const ril_vmcmd_t *cmd)
 }
 
 int ril_mbstrlen(const char*str);
+int ril_mbstrnlen(const char *str, int length);
 
 #ifdef __cplusplus
 }
@@ -6,22 +6,271 @@
 #include "ril_compiler.h"
 #include "ril_utils.h"
 
+/* "0", "1", ... name the packed keys, any other name is hashed */
+static __inline int _nametoindex(const char *name)
+{
+  int index = 0, digits = 0;
+
+  if (NULL == name || !isdigit((unsigned char)*name)) return -1;
+  if ('0' == *name) return '\0' == name[1] ? 0 : -1;
+  for (; isdigit((unsigned char)*name); ++name)
+  {
+    if (9 <= digits++) return -1;
+    index = index * 10 + (*name - '0');
+  }
+
+  return '\0' == *name ? index : -1;
+}
+
+/* an interned key name, shared by every array entry with the same name */
+typedef struct
+{
+  int refcount;
+  hashmap_t *keymap; /* NULL when the name is not in the intern table */
+  hashmap_key_t hash;
+  char name[1];
+} ril_key_t;
+
+#define _KEY(name) ((ril_key_t*)((char*)(name) - offsetof(ril_key_t, name)))
+
+static const char* _internkey(RILVM vm, const char *name, hashmap_key_t hash)
+{
+  ril_key_t *key = (ril_key_t*)hashmap_getdata(vm->keymap, hash);
+  int size;
+
+  if (NULL != key && 0 == strcmp(key->name, name))
+  {
+    ++key->refcount;
+    return key->name;
+  }
+
+  size = strlen(name) + 1;
+  // a name colliding with another one keeps a private copy
+  if (NULL == key)
+  {
+    key = (ril_key_t*)slab_malloc(vm->slab, offsetof(ril_key_t, name) + size);
+    key->keymap = vm->keymap;
+    hashmap_add(vm->keymap, hash, NULL, key);
+  }
+  else
+  {
+    key = (ril_key_t*)slab_malloc(vm->slab, offsetof(ril_key_t, name) + size);
+    key->keymap = NULL;
+  }
+  key->refcount = 1;
+  key->hash = hash;
+  memcpy(key->name, name, size);
+
+  return key->name;
+}
+
+static __inline void _retainkey(const char *name)
+{
+  if (NULL != name) ++_KEY(name)->refcount;
+}
+
+static __inline void _releasekey(const char *name)
+{
+  ril_key_t *key;
+
+  if (NULL == name) return;
+  key = _KEY(name);
+  if (0 < --key->refcount) return;
+
+  if (NULL != key->keymap) hashmap_delete(key->keymap, key->hash);
+  slab_free(key, offsetof(ril_key_t, name) + strlen(key->name) + 1);
+}
+
+void ril_detachkeys(RILVM vm)
+{
+  hashmap_entry_t *entry = hashmap_firstentry(vm->keymap);
+
+  // keys still held by vars outlive the table
+  for (; NULL != entry; entry = hashmap_nextentry(entry))
+  {
+    ((ril_key_t*)hashmap_getdatabyentry(entry))->keymap = NULL;
+  }
+  hashmap_clear(vm->keymap);
+}
+
+static __inline bool _ispacked(ril_array_t *array)
+{
+  return !array->persistent && 0 == hashmap_count(array->map);
+}
+
+/* a leaf of a shared trie node gets its own var when the node is copied */
+static void _copyleaf(hamt_leaf_t *leaf, void *userdata)
+{
+  ril_var_t *var = ril_newvar((RILVM)userdata);
+
+  ril_copyvar((RILVM)userdata, var, (ril_var_t*)leaf->value);
+  leaf->value = var;
+  _retainkey((const char*)leaf->extra);
+}
+
+static void _releaseleaf(hamt_leaf_t *leaf, void *userdata)
+{
+  ril_deletevar((RILVM)userdata, (ril_var_t*)leaf->value);
+  _releasekey((const char*)leaf->extra);
+}
+
+static const hamt_ops_t _seqops = { _copyleaf, _releaseleaf };
+
+static ril_var_t* _getpersistent(RILVM vm, ril_array_t *array, hashmap_key_t hash)
+{
+  hamt_leaf_t *leaf = hamt_get(array->bykey, hash);
+
+  if (NULL == leaf) return NULL;
+  // the var may be written through, so its path is made unique
+  return (ril_var_t*)hamt_getunique(&array->byseq, leaf->aux, &_seqops, vm)->value;
+}
+
+static void _addpersistent(RILVM vm, ril_array_t *array, hashmap_key_t hash, const char *name, ril_var_t *var)
+{
+  hamt_leaf_t leaf;
+
+  leaf.key = array->nextseq;
+  leaf.aux = hash;
+  leaf.value = var;
+  leaf.extra = name;
+  hamt_insert(&array->byseq, &leaf, &_seqops, vm);
+
+  leaf.key = hash;
+  leaf.aux = array->nextseq++;
+  leaf.value = NULL;
+  leaf.extra = NULL;
+  hamt_insert(&array->bykey, &leaf, NULL, NULL);
+
+  ++array->count;
+}
+
+/* moves the packed vars and the map into the tries, keeping their order */
+static void _persist(RILVM vm, ril_array_t *array)
+{
+  hashmap_entry_t *entry = hashmap_firstentry(array->map);
+  hashmap_key_t hash;
+  char name[16];
+  int i;
+
+  for (i = 0; i < array->size; ++i)
+  {
+    sprintf(name, "%d", i);
+    hash = hashmap_makekey(name);
+    _addpersistent(vm, array, hash, _internkey(vm, name, hash), array->items[i]);
+  }
+  array->size = 0;
+
+  for (; NULL != entry; entry = hashmap_nextentry(entry))
+  {
+    hash = hashmap_getkeybyentry(entry);
+    if (NULL == hamt_get(array->bykey, hash))
+    {
+      _addpersistent(vm, array, hash, (const char*)hashmap_getrawkeybyentry(entry), (ril_var_t*)hashmap_getdatabyentry(entry));
+      continue;
+    }
+    ril_deletevar(vm, (ril_var_t*)hashmap_getdatabyentry(entry));
+    _releasekey((const char*)hashmap_getrawkeybyentry(entry));
+  }
+  hashmap_clear(array->map);
+
+  array->persistent = true;
+}
+
+/* moves the packed vars into the map, when a hashed key shows up */
+static void _unpack(RILVM vm, ril_array_t *array)
+{
+  int i;
+  char name[16];
+  hashmap_key_t hash;
+
+  for (i = 0; i < array->size; ++i)
+  {
+    sprintf(name, "%d", i);
+    hash = hashmap_makekey(name);
+    hashmap_add(array->map, hash, _internkey(vm, name, hash), array->items[i]);
+  }
+  array->size = 0;
+}
+
+/* a bare hash is matched against the names of the packed keys, reading leaves the array packed */
+static int _packedindex(RILVM vm, ril_array_t *array, hashmap_key_t hash)
+{
+  char name[16];
+  hashmap_key_t key;
+  intptr_t index;
+
+  // the names are hashed once per VM, up to the largest packed array looked up
+  for (; vm->indexkeysize < array->size; ++vm->indexkeysize)
+  {
+    sprintf(name, "%d", vm->indexkeysize);
+    key = hashmap_makekey(name);
+    // two names of the same hash go to the lower index
+    if (NULL == hashmap_getdata(vm->indexkeys, key)) hashmap_add(vm->indexkeys, key, NULL, (void*)(intptr_t)(vm->indexkeysize + 1));
+  }
+  index = (intptr_t)hashmap_getdata(vm->indexkeys, hash) - 1;
+
+  return index < array->size ? (int)index : -1;
+}
+
+static __inline ril_var_t* _getpacked(RILVM vm, ril_array_t *array, hashmap_key_t hash)
+{
+  int index = _packedindex(vm, array, hash);
+
+  return 0 <= index ? array->items[index] : NULL;
+}
+
+static __inline void _pushitem(ril_array_t *array, ril_var_t *var)
+{
+  if (array->size == array->capacity)
+  {
+    array->capacity = 0 < array->capacity ? array->capacity * 2 : 8;
+    array->items = (ril_var_t**)ril_realloc(array->items, sizeof(ril_var_t*) * array->capacity);
+  }
+  array->items[array->size++] = var;
+  array->nextnum = array->size;
+}
+
 ril_var_t* ril_getvar(RILVM vm, ril_var_t *parent, const char *name)
 {
+  int index = _nametoindex(name);
+
+  if (0 <= index) return ril_getvarbyindex(vm, parent, index);
   return ril_getvarbyhash(vm, parent, hashmap_makekey(name));
 }
 
 ril_var_t* ril_getvarbyhash(RILVM vm, ril_var_t *parent, hashmap_key_t namehash)
 {
+  ril_array_t *array;
+
   if (NULL == parent) parent = vm->rootvar;
   if (!ril_isarray(parent)) return NULL;
+
+  array = (ril_array_t*)parent->variant.ptr_value;
+  if (array->persistent) return _getpersistent(vm, array, namehash);
+  if (0 < array->size) return _getpacked(vm, array, namehash);
   
-  return (ril_var_t*)hashmap_getdata(((ril_array_t*)parent->variant.ptr_value)->map, namehash);
+  return (ril_var_t*)hashmap_getdata(array->map, namehash);
+}
+
+ril_var_t* ril_getvarbyindex(RILVM vm, ril_var_t *parent, int index)
+{
+  ril_array_t *array;
+  char name[16];
+
+  if (NULL == parent) parent = vm->rootvar;
+  if (!ril_isarray(parent)) return NULL;
+
+  array = (ril_array_t*)parent->variant.ptr_value;
+  if (_ispacked(array)) return index < array->size ? array->items[index] : NULL;
+
+  sprintf(name, "%d", index);
+  if (array->persistent) return _getpersistent(vm, array, hashmap_makekey(name));
+  return (ril_var_t*)hashmap_getdata(array->map, hashmap_makekey(name));
 }
 
 ril_var_t* ril_newvar(RILVM vm)
 {
-  ril_var_t *var = (ril_var_t*)ril_malloc(sizeof(ril_var_t));
+  ril_var_t *var = (ril_var_t*)slab_malloc(vm->slab, sizeof(ril_var_t));
   
   ril_initvar(vm, var);
   
@@ -30,8 +279,12 @@ ril_var_t* ril_newvar(RILVM vm)
 
 ril_var_t* ril_createvarbyhash(RILVM vm, ril_var_t *parent, const char *name, hashmap_key_t hashkey)
 {
-  ril_var_t *var = ril_getvarbyhash(vm, parent, hashkey);
-  
+  int index = _nametoindex(name);
+  ril_var_t *var;
+
+  if (0 <= index) return ril_createvarbyindex(vm, parent, index);
+
+  var = ril_getvarbyhash(vm, parent, hashkey);
   if (NULL == var)
   {
     var = ril_newvar(vm);
@@ -42,6 +295,20 @@ ril_var_t* ril_createvarbyhash(RILVM vm, ril_var_t *parent, const char *name, ha
   return var;
 }
 
+ril_var_t* ril_createvarbyindex(RILVM vm, ril_var_t *parent, int index)
+{
+  ril_var_t *var = ril_getvarbyindex(vm, parent, index);
+
+  if (NULL == var)
+  {
+    var = ril_newvar(vm);
+    ril_set2arraybyindex(vm, parent, var, index);
+    ril_deletevar(vm, var);
+  }
+
+  return var;
+}
+
 ril_var_t* ril_createvar(RILVM vm, ril_var_t *parent, const char *name)
 {
   if (NULL == name)
@@ -56,11 +323,19 @@ ril_var_t* ril_createvar(RILVM vm, ril_var_t *parent, const char *name)
 
 static __inline ril_array_t* ril_newarray(RILVM vm)
 {
-  ril_array_t *array = (ril_array_t*)ril_malloc(sizeof(ril_array_t));
+  ril_array_t *array = (ril_array_t*)slab_malloc(vm->slab, sizeof(ril_array_t));
 
   array->refcount = 1;
   array->nextnum = 0;
   array->map = hashmap_open();
+  array->items = NULL;
+  array->size = 0;
+  array->capacity = 0;
+  array->persistent = false;
+  array->bykey = NULL;
+  array->byseq = NULL;
+  array->count = 0;
+  array->nextseq = 0;
 
   return array;
 }
@@ -80,6 +355,20 @@ void ril_cleararray(RILVM vm, ril_var_t *var)
     return;
   }
 
+  if (array->persistent)
+  {
+    hamt_release(array->byseq, &_seqops, vm);
+    hamt_release(array->bykey, NULL, NULL);
+    array->byseq = NULL;
+    array->bykey = NULL;
+    array->count = 0;
+    array->nextseq = 0;
+    array->persistent = false;
+  }
+  while (0 < array->size)
+  {
+    ril_deletevar(vm, array->items[--array->size]);
+  }
   while (NULL != (mapentry = hashmap_firstentry(array->map)))
   {
     ril_unset2array(vm, var, hashmap_getkeybyentry(mapentry));
@@ -89,22 +378,14 @@ void ril_cleararray(RILVM vm, ril_var_t *var)
   hashmap_clear(array->map);
 }
 
-ril_var_t* ril_set2arraybyhash(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name, hashmap_key_t hashkey)
+/* makes the parent an array of its own, copying a shared one */
+static ril_array_t* _writablearray(RILVM vm, ril_var_t *parent)
 {
-  bool isnum;
-  const char *cur;
-  int num;
   ril_var_t *var2, *var3;
-  ril_array_t *array;
+  ril_array_t *array, *shared;
   hashmap_entry_t *mapentry;
-  
-  if (NULL == parent) parent = vm->rootvar;
-  
-  if (!(NULL == name && 0 == hashkey))
-  {
-    var2 = ril_getvarbyhash(vm, parent, hashkey);
-    if (NULL != var2) ril_deletevar(vm, var2);
-  }
+  const char *name;
+  int i;
 
   if (!ril_isarray(parent))
   {
@@ -123,42 +404,104 @@ ril_var_t* ril_set2arraybyhash(RILVM vm, ril_var_t *parent, ril_var_t *var, cons
   // copy array
   if (1 < array->refcount)
   {
-    --array->refcount;
-    mapentry = hashmap_firstentry(array->map);
+    shared = array;
+    if (!shared->persistent && RIL_ARRAY_PERSISTENTSIZE <= shared->size + (int)hashmap_count(shared->map))
+    {
+      _persist(vm, shared);
+    }
+    --shared->refcount;
+    mapentry = hashmap_firstentry(shared->map);
     
     array = ril_newarray(vm);
     
     parent->variant.ptr_value = array;
     
+    // the nodes are shared, and copied on the paths written later
+    if (shared->persistent)
+    {
+      array->persistent = true;
+      array->bykey = hamt_retain(shared->bykey);
+      array->byseq = hamt_retain(shared->byseq);
+      array->count = shared->count;
+      array->nextseq = shared->nextseq;
+      array->nextnum = shared->nextnum;
+      return array;
+    }
+    
+    for (i = 0; i < shared->size; ++i)
+    {
+      var3 = ril_newvar(vm);
+      ril_copyvar(vm, var3, shared->items[i]);
+      _pushitem(array, var3);
+    }
+    // the keys are shared, not copied
     for (; NULL != mapentry; mapentry = hashmap_nextentry(mapentry))
     {
       var2 = hashmap_getdatabyentry(mapentry);
-      var3 = ril_createvarbyhash(vm, parent, (char*)hashmap_getrawkeybyentry(mapentry), hashmap_getkeybyentry(mapentry));
+      var3 = ril_newvar(vm);
       ril_copyvar(vm, var3, var2);
+      name = (const char*)hashmap_getrawkeybyentry(mapentry);
+      _retainkey(name);
+      hashmap_add(array->map, hashmap_getkeybyentry(mapentry), name, var3);
     }
+    array->nextnum = shared->nextnum;
   }
+
+  return array;
+}
+
+static ril_var_t* _set2map(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name, hashmap_key_t hashkey)
+{
+  bool isnum;
+  const char *cur;
+  int num;
+  ril_var_t *var2;
+  ril_array_t *array;
+  hamt_leaf_t *leaf;
+  char numname[16];
+  
+  array = _writablearray(vm, parent);
+  if (!(NULL == name && 0 == hashkey) && !array->persistent)
+  {
+    var2 = ril_getvarbyhash(vm, parent, hashkey);
+    if (NULL != var2) ril_deletevar(vm, var2);
+  }
+  if (0 < array->size) _unpack(vm, array);
   
-  /* copy name */
+  /* share name */
   if (NULL != name)
   {
-    num = strlen(name) + 1;
-    cur = (char*)ril_malloc(num);
-    memcpy((char*)cur, name, num);
-    name = cur;
+    name = _internkey(vm, name, hashkey);
   }
   else
   {
     /* not specify a name */
     if (0 == hashkey)
     {
-      name = (char*)ril_malloc(16);
-      sprintf((char*)name, "%d", array->nextnum);
-      hashkey = hashmap_makekey(name);
+      sprintf(numname, "%d", array->nextnum);
+      hashkey = hashmap_makekey(numname);
+      name = _internkey(vm, numname, hashkey);
     }
   }
 
   ril_retainvar(var);
-  hashmap_add(array->map, hashkey, name, var);
+  if (!array->persistent)
+  {
+    hashmap_add(array->map, hashkey, name, var);
+  }
+  else if (NULL != (leaf = hamt_get(array->bykey, hashkey)))
+  {
+    // a replaced var keeps its place
+    leaf = hamt_getunique(&array->byseq, leaf->aux, &_seqops, vm);
+    ril_deletevar(vm, (ril_var_t*)leaf->value);
+    leaf->value = var;
+    _releasekey(name);
+    name = (const char*)leaf->extra;
+  }
+  else
+  {
+    _addpersistent(vm, array, hashkey, name, var);
+  }
 
   /* is numeric */
   if (NULL == name) return var;
@@ -181,6 +524,59 @@ ril_var_t* ril_set2arraybyhash(RILVM vm, ril_var_t *parent, ril_var_t *var, cons
   return var;
 }
 
+ril_var_t* ril_set2arraybyhash(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name, hashmap_key_t hashkey)
+{
+  int index;
+
+  if (NULL == parent) parent = vm->rootvar;
+
+  if (NULL != name)
+  {
+    index = _nametoindex(name);
+    if (0 <= index) return ril_set2arraybyindex(vm, parent, var, index);
+  }
+  else if (0 == hashkey)
+  {
+    /* not specify a name */
+    index = ril_isarray(parent) ? ((ril_array_t*)parent->variant.ptr_value)->nextnum : 0;
+    return ril_set2arraybyindex(vm, parent, var, index);
+  }
+
+  return _set2map(vm, parent, var, name, hashkey);
+}
+
+ril_var_t* ril_set2arraybyindex(RILVM vm, ril_var_t *parent, ril_var_t *var, int index)
+{
+  char name[16];
+  ril_var_t *var2;
+  ril_array_t *array;
+
+  if (NULL == parent) parent = vm->rootvar;
+
+  array = _writablearray(vm, parent);
+  if (_ispacked(array))
+  {
+    if (index < array->size)
+    {
+      var2 = array->items[index];
+      ril_retainvar(var);
+      array->items[index] = var;
+      ril_deletevar(vm, var2);
+      return var;
+    }
+    if (index == array->size && array->nextnum == array->size)
+    {
+      ril_retainvar(var);
+      _pushitem(array, var);
+      return var;
+    }
+  }
+
+  // a sparse index goes to the map
+  sprintf(name, "%d", index);
+  return _set2map(vm, parent, var, name, hashmap_makekey(name));
+}
+
 ril_var_t* ril_set2array(RILVM vm, ril_var_t *parent, ril_var_t *var, const char *name)
 {
   return ril_set2arraybyhash(vm, parent, var, name, NULL != name ? hashmap_makekey(name) : 0);
@@ -190,16 +586,46 @@ void ril_unset2array(RILVM vm, ril_var_t *parent, hashmap_key_t hashkey)
 {
   hashmap_entry_t *entry;
   ril_array_t *array = (ril_array_t*)parent->variant.ptr_value;
-  ril_var_t *var = ril_getvarbyhash(vm, parent, hashkey);
+  hamt_leaf_t *leaf;
+  ril_var_t *var;
+
+  if (ril_isarray(parent) && array->persistent)
+  {
+    leaf = hamt_get(array->bykey, hashkey);
+    if (NULL == leaf) return;
+    hamt_remove(&array->byseq, leaf->aux, &_seqops, vm);
+    hamt_remove(&array->bykey, hashkey, NULL, NULL);
+    --array->count;
+    return;
+  }
 
+  var = ril_getvarbyhash(vm, parent, hashkey);
   if (NULL == var) return;
+  if (_ispacked(array))
+  {
+    // the last one goes without a hole, any other one leaves the vector
+    if (var == array->items[array->size - 1])
+    {
+      --array->size;
+      ril_deletevar(vm, var);
+      return;
+    }
+    _unpack(vm, array);
+  }
   ril_deletevar(vm, var);
 
   entry = hashmap_getentry(array->map, hashkey);
-  ril_free(hashmap_getrawkeybyentry(entry));
+  _releasekey((const char*)hashmap_getrawkeybyentry(entry));
   hashmap_delete(array->map, hashkey);
 }
 
+void ril_unset2arraybyindex(RILVM vm, ril_var_t *parent, int index)
+{
+  char name[16];
+
+  sprintf(name, "%d", index);
+  ril_unset2array(vm, parent, hashmap_makekey(name));
+}
 void ril_initvar(RILVM vm, ril_var_t *var)
 {
   var->isconst = false;
@@ -218,7 +644,7 @@ void ril_deletevar(RILVM vm, ril_var_t *var)
   if (0 != var->refcount) return;
 
   ril_clearvar(vm, var);
-  ril_free(var);
+  slab_free(var, sizeof(ril_var_t));
 }
 
 void ril_clearvar(RILVM vm, ril_var_t *var)
@@ -234,13 +660,14 @@ void ril_clearvar(RILVM vm, ril_var_t *var)
       --string->refcount;
       break;
     }
-    free(string->ptr);
-    ril_free(var->variant.ptr_value);
+    if (string->buf != string->ptr) slab_free(string->ptr, string->size + 1);
+    slab_free(string, sizeof(ril_string_t));
     break; }
   case VARIANT_ARRAY: {
     ril_cleararray(vm, var);
     hashmap_close(((ril_array_t*)var->variant.ptr_value)->map);
-    ril_free(((ril_array_t*)var->variant.ptr_value));
+    ril_free(((ril_array_t*)var->variant.ptr_value)->items);
+    slab_free(var->variant.ptr_value, sizeof(ril_array_t));
     break; }
   case VARIANT_NULL:
     return;
@@ -267,23 +694,102 @@ void ril_setfloat(RILVM vm, ril_var_t *var, const float value)
 
 void ril_setstring(RILVM vm, ril_var_t *var, const char *value)
 {
-  ril_setstringbysize(vm, var, value, strlen(value) + 1);
+  ril_setstringbysize(vm, var, value, strlen(value));
 }
 
+static __inline ril_string_t* _newstring(RILVM vm, int size)
+{
+  ril_string_t *string = (ril_string_t*)slab_malloc(vm->slab, sizeof(ril_string_t));
+  
+  string->refcount = 1;
+  string->size = size;
+  // short strings live in the header itself
+  string->ptr = RIL_STRING_INLINE <= size ? (char*)slab_malloc(vm->slab, size + 1) : string->buf;
+  string->ptr[size] = '\0';
+
+  return string;
+}
+
+/* copies size bytes and terminates them, value may be the var's own string */
 void ril_setstringbysize(RILVM vm, ril_var_t *var, const char *value, int size)
 {
-  ril_string_t *string = (ril_string_t*)ril_malloc(sizeof(ril_string_t));
+  ril_string_t *string = _newstring(vm, size);
   
-  ril_clearvar(vm, var);
+  memcpy(string->ptr, value, size);
   
-  string->refcount = 1;
-  string->size = size+ 1;
-  string->ptr = (char*)malloc(string->size);
- 
+  ril_clearvar(vm, var);
   var->variant.type = VARIANT_STRINGOBJ;
   var->variant.ptr_value = string;
+}
+
+void ril_setstringbyparts(RILVM vm, ril_var_t *var, const char *left, int leftsize, const char *right, int rightsize)
+{
+  ril_string_t *string = _newstring(vm, leftsize + rightsize);
+  
+  memcpy(string->ptr, left, leftsize);
+  memcpy(string->ptr + leftsize, right, rightsize);
   
-  memcpy(string->ptr, value, string->size);
+  ril_clearvar(vm, var);
+  var->variant.type = VARIANT_STRINGOBJ;
+  var->variant.ptr_value = string;
+}
+
+static __inline bool _isliteral(RILVM vm, const char *ptr)
+{
+  return vm->code.hascode && ptr >= (char*)vm->code.data && ptr < (char*)vm->code.data + vm->code.datasize;
+}
+
+/* a string borrowing a literal of the code, the pool holds one reference per offset */
+static __inline ril_string_t* _getliteral(RILVM vm, const char *value)
+{
+  hashmap_key_t offset, hash;
+  ril_string_t *string;
+
+  if (!_isliteral(vm, value)) return NULL;
+  offset = (hashmap_key_t)(value - (char*)vm->code.data);
+  string = (ril_string_t*)hashmap_getdata(vm->code.literals, offset);
+  if (NULL != string) return string;
+
+  // identical literals at other offsets share the string
+  hash = hashmap_makekey(value);
+  string = (ril_string_t*)hashmap_getdata(vm->code.literaltexts, hash);
+  if (NULL == string || 0 != strcmp(string->ptr, value))
+  {
+    string = (ril_string_t*)slab_malloc(vm->slab, sizeof(ril_string_t));
+    string->refcount = 0;
+    string->size = strlen(value);
+    string->ptr = (char*)value;
+    if (NULL == hashmap_getdata(vm->code.literaltexts, hash)) hashmap_add(vm->code.literaltexts, hash, NULL, string);
+  }
+  ++string->refcount;
+  hashmap_add(vm->code.literals, offset, NULL, string);
+
+  return string;
+}
+
+void ril_releaseliterals(RILVM vm)
+{
+  hashmap_entry_t *entry = hashmap_firstentry(vm->code.literals);
+  ril_string_t *string;
+  char *ptr;
+
+  // strings still held by vars take a copy before the code goes
+  for (; NULL != entry; entry = hashmap_nextentry(entry))
+  {
+    string = (ril_string_t*)hashmap_getdatabyentry(entry);
+    if (0 < --string->refcount)
+    {
+      if (!_isliteral(vm, string->ptr)) continue;
+      ptr = RIL_STRING_INLINE <= string->size ? (char*)slab_malloc(vm->slab, string->size + 1) : string->buf;
+      memcpy(ptr, string->ptr, string->size + 1);
+      string->ptr = ptr;
+      continue;
+    }
+    if (!_isliteral(vm, string->ptr) && string->buf != string->ptr) slab_free(string->ptr, string->size + 1);
+    slab_free(string, sizeof(ril_string_t));
+  }
+  hashmap_clear(vm->code.literals);
+  hashmap_clear(vm->code.literaltexts);
 }
 
 void ril_copyvar(RILVM vm, ril_var_t *dest, ril_var_t *src)
@@ -300,6 +806,17 @@ void ril_setvariant(RILVM vm, ril_var_t *dest, variant_t *variant)
   case VARIANT_STRING:
     ril_setstring(vm, dest, variant->string_value);
     break;
+  case (VARIANT_LITERAL | VARIANT_STRING):
+    // literals of the loaded code are shared, not copied
+    dest->variant.ptr_value = _getliteral(vm, variant->string_value);
+    if (NULL == dest->variant.ptr_value)
+    {
+      ril_setstring(vm, dest, variant->string_value);
+      break;
+    }
+    ++((ril_string_t*)dest->variant.ptr_value)->refcount;
+    dest->variant.type = VARIANT_STRINGOBJ;
+    break;
   case VARIANT_STRINGOBJ:
     ++((ril_string_t*)variant->ptr_value)->refcount;
     dest->variant = *variant;
@@ -348,6 +865,30 @@ const char* ril_var2string(RILVM vm, ril_var_t *var)
   return variant.string_value;
 }
 
+/* string objects know their length, numbers get it from their conversion */
+const char* ril_var2stringlen(RILVM vm, ril_var_t *var, int *length)
+{
+  const char *str;
+  variant_t variant;
+
+  if (VARIANT_STRINGOBJ == var->variant.type)
+  {
+    *length = ((ril_string_t*)var->variant.ptr_value)->size;
+    return ((ril_string_t*)var->variant.ptr_value)->ptr;
+  }
+
+  if (NULL == vm)
+  {
+    str = ril_var2string(vm, var);
+    *length = strlen(str);
+    return str;
+  }
+
+  variant = var->variant;
+
+  return calc_caststring(vm->calc, &variant, length);
+}
+
 int ril_var2integer(RILVM vm, ril_var_t *var)
 {
   variant_t variant;
@@ -392,7 +933,10 @@ RILRESULT ril_writevar(buffer_t *dest, ril_var_t *var)
 {
   hashmap_entry_t *mapentry;
   ril_array_t *array;
+  hamt_leaf_t *leaf;
   uint32_t size;
+  int i;
+  char name[16];
   const char *str;
   calc_opcode_t type;
 
@@ -425,8 +969,8 @@ RILRESULT ril_writevar(buffer_t *dest, ril_var_t *var)
     type = VARIANT_STRING;
     buffer_write(dest, &type, sizeof(calc_opcode_t));
 
-    str = ril_var2string(NULL, var);
-    size = strlen(str) + 1;
+    str = ril_var2stringlen(NULL, var, (int*)&size);
+    ++size;
     buffer_write(dest, &size, sizeof(size));
     buffer_write(dest, str, size);
 
@@ -438,9 +982,22 @@ RILRESULT ril_writevar(buffer_t *dest, ril_var_t *var)
     buffer_write(dest, &type, sizeof(calc_opcode_t));
 
     array = (ril_array_t*)var->variant.ptr_value;
-    size = hashmap_count(array->map);
+    size = ril_countvar(var);
     buffer_write(dest, &size, sizeof(size));
-    mapentry = hashmap_firstentry(((ril_array_t*)var->variant.ptr_value)->map);
+    for (i = 0; i < array->size; ++i)
+    {
+      sprintf(name, "%d", i);
+      buffer_write(dest, name, strlen(name) + 1);
+      ril_writevar(dest, array->items[i]);
+    }
+    leaf = hamt_seek(array->byseq, 0);
+    for (; NULL != leaf; leaf = hamt_seek(array->byseq, leaf->key + 1))
+    {
+      str = (const char*)leaf->extra;
+      buffer_write(dest, str, strlen(str) + 1);
+      ril_writevar(dest, (ril_var_t*)leaf->value);
+    }
+    mapentry = hashmap_firstentry(array->map);
     for (; NULL != mapentry; mapentry = hashmap_nextentry(mapentry))
     {
       var = (ril_var_t*)hashmap_getdatabyentry(mapentry);
@@ -480,7 +1037,7 @@ int ril_readvar(RILVM vm, ril_var_t *var, const void *src)
     break;
   case VARIANT_STRING:
     src = ril_read(&size, src, sizeof(size));
-    ril_setstring(vm, var, (const char*)src);
+    ril_setstringbysize(vm, var, (const char*)src, size - 1);
     src = (int8_t*)src + size;
     break;
   case VARIANT_ARRAY:
@@ -501,7 +1058,8 @@ int ril_countvar(ril_var_t *var)
 {
   if (!ril_isarray(var)) return 0;
   
-  return hashmap_count(((ril_array_t*)var->variant.ptr_value)->map);
+  return ((ril_array_t*)var->variant.ptr_value)->size + hashmap_count(((ril_array_t*)var->variant.ptr_value)->map)
+    + ((ril_array_t*)var->variant.ptr_value)->count;
 }
 
 bool ril_isnull(ril_var_t *var)
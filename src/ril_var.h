@@ -8,6 +8,9 @@ extern "C" {
 #endif
 
 void ril_setvariant(RILVM vm, ril_var_t *var, variant_t *variant);
+void ril_setstringbyparts(RILVM vm, ril_var_t *var, const char *left, int leftsize, const char *right, int rightsize);
+void ril_detachkeys(RILVM vm);
+void ril_releaseliterals(RILVM vm);
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,8 @@
 #include "ril_var.h"
 #include "ril_api.h"
 #include "ril_utils.h"
+#include "ril_calc.h"
+#include "crc.h"
 #include "md5.h"
 
 void ril_parsecode(ril_code_t *code, const void *src)
@@ -17,21 +19,48 @@ void ril_parsecode(ril_code_t *code, const void *src)
   code->data = (void*)((int8_t*)src + code->common->data_offset);
 }
 
-void ril_freecode(RILVM vm)
+static __inline void _freecode(RILVM vm)
 {
-  if (!vm->code.hascode) return;
+  int i;
+  ril_vmcmd_t *cmd;
   
+  for (i = 0, cmd = vm->code.cmd; i < vm->code.common->cmd_size; ++i, ++cmd)
+  {
+    if (cmd == cmd->pair->first && NULL != cmd->pair->cases) hashmap_close(cmd->pair->cases);
+  }
+  
+  ril_releaseliterals(vm);
   ril_free(vm->code.common);
   ril_free(vm->code.label);
   ril_free(vm->code.cmd);
   ril_free(vm->code.arg);
-  ril_free(vm->code.data);
+  // the running command may still read its arguments, as [goto file:...] does
+  if (0 < vm->code.running) *(void**)buffer_malloc(vm->code.retired, 1) = vm->code.data;
+  else ril_free(vm->code.data);
   
   vm->code.hascode = false;
+}
+
+void ril_freecode(RILVM vm)
+{
+  if (!vm->code.hascode) return;
+  
+  _freecode(vm);
 
   ril_deletemacros(vm);
 }
 
+void ril_freeretiredcode(RILVM vm)
+{
+  int i;
+  
+  for (i = buffer_size(vm->code.retired) - 1; 0 <= i; --i)
+  {
+    ril_free(*(void**)buffer_index(vm->code.retired, i));
+  }
+  buffer_clear(vm->code.retired);
+}
+
 static __inline RILRESULT _setpaircmd(RILVM vm)
 {
   int i, k = 0;
@@ -45,6 +74,8 @@ static __inline RILRESULT _setpaircmd(RILVM vm)
     cmd->pair = &vm->paircmds[k];
     cmd->pair->first = cmd;
     cmd->pair->last = cmd;
+    cmd->pair->cases = NULL;
+    cmd->pair->other = NULL;
     while (cmd != cmd->pair->last->nextpair)
     {
       cmd->pair->last = cmd->pair->last->nextpair;
@@ -56,6 +87,64 @@ static __inline RILRESULT _setpaircmd(RILVM vm)
   return RIL_OK;
 }
 
+/* a text that an integer prints as, so "1" == 1 while "01" and "1.0" are not */
+bool ril_isintegertext(const char *text, int *value)
+{
+  char buf[16];
+  
+  *value = (int)strtol(text, NULL, 10);
+  sprintf(buf, "%d", *value);
+  
+  return 0 == strcmp(buf, text);
+}
+
+/* an integer case is its own key, a string case the hash of its text unless it is an integer text */
+hashmap_key_t ril_casekey(const calc_value_t *value)
+{
+  int number;
+  
+  if (VARIANT_INTEGER == value->type) return (hashmap_key_t)*(const int*)(value + 1);
+  
+  return ril_isintegertext((const char*)(value + 1), &number) ? (hashmap_key_t)number : hashmap_makekey((const char*)(value + 1));
+}
+
+// the jump table of each [switch], the compiler has checked that the cases are literals of distinct keys
+static void _setswitches(RILVM vm)
+{
+  int i;
+  ril_vmcmd_t *cmd, *member;
+  const calc_value_t *value;
+  
+  for (i = 0, cmd = vm->code.cmd; i < vm->code.common->cmd_size; ++i, ++cmd)
+  {
+    if (NULL == cmd->tag || RIL_CALLFUNC(switch) != cmd->tag->execute_handler) continue;
+    
+    for (member = cmd->nextpair; cmd != member; member = member->nextpair)
+    {
+      if (RIL_CALLFUNC(default) == member->tag->execute_handler) cmd->pair->other = member;
+      if (RIL_CALLFUNC(case) != member->tag->execute_handler) continue;
+      
+      if (NULL == cmd->pair->cases) cmd->pair->cases = hashmap_open();
+      value = (const calc_value_t*)((const calc_opcode_t*)member->arg[0].data + 1);
+      hashmap_add(cmd->pair->cases, ril_casekey(value), VARIANT_INTEGER == value->type ? NULL : value + 1, member);
+    }
+  }
+}
+
+static __inline bool _isleave(const ril_vmcmd_t *cmd)
+{
+  const calc_opcode_t *op;
+  const calc_value_t *value;
+
+  if (RIL_CALLFUNC(endmacro) == ril_getexecutehandler(cmd->tag)) return true;
+  if (RIL_TAG_RETURN != cmd->signature) return false;
+
+  // the default argument: a pushed null and the end
+  op = (const calc_opcode_t*)cmd->arg[0].data;
+  value = (const calc_value_t*)(op + 1);
+  return CALC_PUSH == *op && VARIANT_NULL == value->type && CALC_END == *(const calc_opcode_t*)(value + 1);
+}
+
 static __inline RILRESULT _copycode(RILVM vm, ril_code_t *code, int codesize)
 {
   int i;
@@ -68,8 +157,9 @@ static __inline RILRESULT _copycode(RILVM vm, ril_code_t *code, int codesize)
   vm->code.label = ril_malloc(sizeof(ril_label_t) * code->common->label_size);
   memcpy(vm->code.label, code->label, sizeof(ril_label_t) * code->common->label_size);
   
-  vm->code.data = ril_malloc(codesize - code->common->data_offset);
-  memcpy(vm->code.data, code->data, codesize - code->common->data_offset);
+  vm->code.datasize = codesize - code->common->data_offset;
+  vm->code.data = ril_malloc(vm->code.datasize);
+  memcpy(vm->code.data, code->data, vm->code.datasize);
   
   vm->code.arg = ril_malloc(sizeof(ril_vmarg_t) * code->common->arg_size);
   for (i = 0; i < code->common->arg_size; ++i, ++code->arg)
@@ -87,6 +177,13 @@ static __inline RILRESULT _copycode(RILVM vm, ril_code_t *code, int codesize)
     cmd->nextpair = &vm->code.cmd[code->cmd[i].pair_cmdid.id];
     cmd->parent = &vm->code.cmd[code->cmd[i].parent_cmdid.id];
     cmd->pair = NULL;
+    cmd->tailcall = false;
+  }
+  
+  // a call right before [endmacro] or a bare [return] can hand its frame over
+  for (cmd = vm->code.cmd + 1; cmd < vm->code.cmd + code->common->cmd_size; ++cmd)
+  {
+    if (_isleave(cmd)) (cmd - 1)->tailcall = true;
   }
   
   vm->code.hascode = true;
@@ -94,13 +191,33 @@ static __inline RILRESULT _copycode(RILVM vm, ril_code_t *code, int codesize)
   return RIL_OK;
 }
 
-RILRESULT ril_load(RILVM vm, const void *src, int size)
+static RILRESULT _loadcode(RILVM vm, ril_code_t *code, int size)
 {
   int i;
-  ril_code_t code;
   md5_state_t md5state;
   ril_crc_t *md5tags;
   
+  if (RIL_FAILED(_copycode(vm, code, size))) return RIL_ERROR;
+  
+  if (RIL_FAILED(_setpaircmd(vm))) return RIL_ERROR;
+  
+  _setswitches(vm);
+  
+  // md5
+  md5tags = ril_malloc(vm->code.common->cmd_size * sizeof(ril_crc_t));
+  for (i = vm->code.common->cmd_size - 1; 0 <= i; --i) md5tags[i] = vm->code.cmd[i].signature;
+  md5_init(&md5state);
+  md5_append(&md5state, (uint8_t*)md5tags, vm->code.common->cmd_size * sizeof(ril_crc_t));
+  md5_finish(&md5state, vm->hash.buf);
+  ril_free(md5tags);
+  
+  return RIL_OK;
+}
+
+RILRESULT ril_load(RILVM vm, const void *src, int size)
+{
+  ril_code_t code;
+  
   ril_freecode(vm);
   ril_parsecode(&code, src);
   
@@ -108,23 +225,314 @@ RILRESULT ril_load(RILVM vm, const void *src, int size)
   {
     return ril_error(vm, "bad endian");
   }
-
-  if (RIL_FAILED(_copycode(vm, &code, size))) return RIL_ERROR;
+  
+  if (RIL_FAILED(_loadcode(vm, &code, size))) return RIL_ERROR;
   
   vm->loadfile[0] = '\0';
   vm->state->cmd.next = vm->code.cmd;
   
-  if (RIL_FAILED(_setpaircmd(vm))) return RIL_ERROR;
+  return RIL_OK;
+}
+
+static __inline uint32_t _hasharg(uint32_t hash, const void *data)
+{
+  return hash * 31 + crc(data, calc_bytesize(data), 0);
+}
+
+static __inline bool _equalarg(const void *a, const void *b)
+{
+  int size = calc_bytesize(a);
   
-  // md5
-  md5tags = ril_malloc(vm->code.common->cmd_size * sizeof(ril_crc_t));
-  for (i = vm->code.common->cmd_size - 1; 0 <= i; --i) md5tags[i] = vm->code.cmd[i].signature;
-  md5_init(&md5state);
-  md5_append(&md5state, (uint8_t*)md5tags, vm->code.common->cmd_size * sizeof(ril_crc_t));
-  md5_finish(&md5state, vm->hash.buf);
-  ril_free(md5tags);
+  return size == calc_bytesize(b) && !memcmp(a, b, size);
+}
+
+static __inline const void* _codearg(const ril_code_t *code, int cmdid, int argid)
+{
+  return (int8_t*)code->data + code->arg[code->cmd[cmdid].arg_offset + argid].data_offset;
+}
+
+typedef struct
+{
+  uint32_t hash;
+  int32_t index;
+} _cmdhash_t;
+
+static int _comparecmdhash(const void *a, const void *b)
+{
+  const _cmdhash_t *x = (const _cmdhash_t*)a, *y = (const _cmdhash_t*)b;
   
-  return RIL_OK;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  return x->index - y->index;
+}
+
+// sorted copy of the hashes, an index is -1 when the hash is not unique
+static _cmdhash_t* _sortcmdhashes(const uint32_t *hashes, int size)
+{
+  _cmdhash_t *sorted = (_cmdhash_t*)ril_malloc(sizeof(_cmdhash_t) * (size + 1));
+  int i;
+  
+  for (i = 0; i < size; ++i)
+  {
+    sorted[i].hash = hashes[i];
+    sorted[i].index = i;
+  }
+  qsort(sorted, size, sizeof(_cmdhash_t), _comparecmdhash);
+  for (i = 0; i < size; ++i)
+  {
+    if ((0 < i && sorted[i - 1].hash == sorted[i].hash)
+        || (i + 1 < size && sorted[i + 1].hash == sorted[i].hash)) sorted[i].index = -1;
+  }
+  
+  return sorted;
+}
+
+static __inline int _finduniquecmd(const _cmdhash_t *sorted, int size, uint32_t hash)
+{
+  int low = 0, high = size - 1, mid;
+  
+  while (low <= high)
+  {
+    mid = (low + high) / 2;
+    if (sorted[mid].hash == hash) return sorted[mid].index;
+    if (sorted[mid].hash < hash) low = mid + 1;
+    else high = mid - 1;
+  }
+  
+  return -1;
+}
+
+// matches the commands of the loaded program to the new one by a patience diff,
+// a changed command goes to the command after the last unchanged one before it
+static int32_t* _mapcmds(RILVM vm, const ril_code_t *code)
+{
+  int oldsize = vm->code.common->cmd_size, newsize = code->common->cmd_size;
+  int i, k, argc, count, length, low, high, mid;
+  uint32_t *oldhashes = (uint32_t*)ril_malloc(sizeof(uint32_t) * (oldsize + 1));
+  uint32_t *newhashes = (uint32_t*)ril_malloc(sizeof(uint32_t) * (newsize + 1));
+  int32_t *cmdmap = (int32_t*)ril_malloc(sizeof(int32_t) * (oldsize + 1));
+  int32_t *newmatched = (int32_t*)ril_malloc(sizeof(int32_t) * (newsize + 1));
+  int32_t *pairs, *tails, *links;
+  _cmdhash_t *oldsorted, *newsorted;
+  const ril_vmcmd_t *cmd;
+  
+  for (i = 0, cmd = vm->code.cmd; i < oldsize; ++i, ++cmd)
+  {
+    argc = (i + 1 < oldsize ? cmd[1].arg : vm->code.arg + vm->code.common->arg_size) - cmd->arg;
+    oldhashes[i] = cmd->signature;
+    for (k = 0; k < argc; ++k) oldhashes[i] = _hasharg(oldhashes[i], cmd->arg[k].data);
+  }
+  for (i = 0; i < newsize; ++i)
+  {
+    argc = (i + 1 < newsize ? code->cmd[i + 1].arg_offset : (uint32_t)code->common->arg_size) - code->cmd[i].arg_offset;
+    newhashes[i] = code->cmd[i].signature;
+    for (k = 0; k < argc; ++k) newhashes[i] = _hasharg(newhashes[i], _codearg(code, i, k));
+  }
+  for (i = 0; i < oldsize; ++i) cmdmap[i] = -1;
+  for (i = 0; i < newsize; ++i) newmatched[i] = 0;
+  
+  // commands unique on both sides, in the order of the old program
+  oldsorted = _sortcmdhashes(oldhashes, oldsize);
+  newsorted = _sortcmdhashes(newhashes, newsize);
+  pairs = (int32_t*)ril_malloc(sizeof(int32_t) * (oldsize + 1));
+  for (i = 0; i < oldsize; ++i) pairs[i] = -1;
+  for (i = 0; i < oldsize; ++i)
+  {
+    if (0 > oldsorted[i].index) continue;
+    pairs[oldsorted[i].index] = _finduniquecmd(newsorted, newsize, oldsorted[i].hash);
+  }
+  
+  // longest increasing run of them
+  tails = (int32_t*)ril_malloc(sizeof(int32_t) * (oldsize + 1));
+  links = (int32_t*)ril_malloc(sizeof(int32_t) * (oldsize + 1));
+  for (i = 0, length = 0; i < oldsize; ++i)
+  {
+    if (0 > pairs[i]) continue;
+    for (low = 0, high = length; low < high;)
+    {
+      mid = (low + high) / 2;
+      if (pairs[tails[mid]] < pairs[i]) low = mid + 1;
+      else high = mid;
+    }
+    links[i] = 0 < low ? tails[low - 1] : -1;
+    tails[low] = i;
+    if (low == length) ++length;
+  }
+  for (i = 0 < length ? tails[length - 1] : -1; 0 <= i; i = links[i])
+  {
+    cmdmap[i] = pairs[i];
+    newmatched[pairs[i]] = 1;
+  }
+  
+  // grow the matches over equal neighbours
+  for (i = 0; i < oldsize; ++i)
+  {
+    if (0 > cmdmap[i]) continue;
+    for (k = 1; i + k < oldsize && cmdmap[i] + k < newsize && 0 > cmdmap[i + k]
+         && !newmatched[cmdmap[i] + k] && oldhashes[i + k] == newhashes[cmdmap[i] + k]; ++k)
+    {
+      cmdmap[i + k] = cmdmap[i] + k;
+      newmatched[cmdmap[i] + k] = 1;
+    }
+  }
+  for (i = oldsize - 1; 0 <= i; --i)
+  {
+    if (0 > cmdmap[i]) continue;
+    for (k = 1; i - k >= 0 && cmdmap[i] - k >= 0 && 0 > cmdmap[i - k]
+         && !newmatched[cmdmap[i] - k] && oldhashes[i - k] == newhashes[cmdmap[i] - k]; ++k)
+    {
+      cmdmap[i - k] = cmdmap[i] - k;
+      newmatched[cmdmap[i] - k] = 1;
+    }
+  }
+  for (i = 0; i < oldsize && i < newsize && 0 > cmdmap[i] && !newmatched[i] && oldhashes[i] == newhashes[i]; ++i)
+  {
+    cmdmap[i] = i;
+  }
+  
+  for (i = 0, count = 0; i < oldsize; ++i)
+  {
+    if (0 <= cmdmap[i]) count = cmdmap[i] + 1;
+    else cmdmap[i] = count < newsize ? count : newsize - 1;
+  }
+  cmdmap[oldsize] = newsize;
+  
+  ril_free(links);
+  ril_free(tails);
+  ril_free(pairs);
+  ril_free(newsorted);
+  ril_free(oldsorted);
+  ril_free(newmatched);
+  ril_free(oldhashes);
+  ril_free(newhashes);
+  
+  return cmdmap;
+}
+
+static __inline bool _ismacrocmd(RILVM vm, ril_signature_t signature)
+{
+  ril_tag_t *tag = ril_getregisteredtag2(vm, signature);
+  
+  return NULL != tag && RIL_CALLCOMPILEFUNC(macro) == tag->compile_handler;
+}
+
+// finds the definition of a running macro in the new program
+static int _findmacrocmd(RILVM vm, const ril_code_t *code, const ril_vmcmd_t *oldcmd, int cmdid)
+{
+  int i;
+  
+  for (i = -1; i < code->common->cmd_size; ++i)
+  {
+    int id = 0 > i ? cmdid : i;
+    if (!_ismacrocmd(vm, code->cmd[id].signature)) continue;
+    if (code->cmd[id].signature != oldcmd->signature) continue;
+    if (!_equalarg(oldcmd->arg[0].data, _codearg(code, id, 0))) continue;
+    if (!_equalarg(oldcmd->arg[1].data, _codearg(code, id, 1))) continue;
+    return id;
+  }
+  
+  return -1;
+}
+
+// replaces the loaded program and keeps the execution position
+RILRESULT ril_reload(RILVM vm, const void *src, int size)
+{
+  ril_code_t code;
+  buffer_t *statebuffer, *macrobuffer;
+  char loadfile[sizeof(vm->loadfile)];
+  int32_t *cmdmap, previd = -1;
+  hashmap_entry_t *entry, *next;
+  ril_tag_t *tag;
+  const ril_vmcmd_t *oldcmd;
+  int i, cmdid, cmdsize;
+  RILRESULT result;
+  
+  if (!vm->code.hascode) return ril_load(vm, src, size);
+  
+  ril_parsecode(&code, src);
+  
+  if (code.common->endian != ril_endian())
+  {
+    return ril_error(vm, "bad endian");
+  }
+  
+  cmdmap = _mapcmds(vm, &code);
+  cmdsize = vm->code.common->cmd_size;
+  
+  // save the state by the old ids
+  statebuffer = buffer_open(1, 1024);
+  if (RIL_FAILED(ril_savestate(vm, statebuffer)))
+  {
+    buffer_close(statebuffer);
+    ril_free(cmdmap);
+    return RIL_ERROR;
+  }
+  strcpy(loadfile, vm->loadfile);
+  *(char*)buffer_front(statebuffer) = '\0';
+  if (NULL != vm->state->cmd.prev && vm->state->cmd.prev >= vm->code.cmd
+      && vm->state->cmd.prev < vm->code.cmd + vm->code.common->cmd_size)
+  {
+    previd = cmdmap[vm->state->cmd.prev - vm->code.cmd];
+  }
+  ril_clearstate(vm->state);
+  
+  // running macros are bound to the new definitions, others are deleted
+  macrobuffer = buffer_open(sizeof(ril_tag_t*) + sizeof(int), 16);
+  for (entry = hashmap_firstentry(vm->tagmap); NULL != entry; entry = next)
+  {
+    next = hashmap_nextentry(entry);
+    tag = (ril_tag_t*)hashmap_getdatabyentry(entry);
+    if (tag->execute_handler != RIL_CALLFUNC(callmacro)) continue;
+    
+    oldcmd = (ril_vmcmd_t*)ril_getshareddata(tag);
+    cmdid = -1;
+    if (NULL != oldcmd && oldcmd >= vm->code.cmd && oldcmd < vm->code.cmd + vm->code.common->cmd_size)
+    {
+      cmdid = _findmacrocmd(vm, &code, oldcmd, cmdmap[oldcmd - vm->code.cmd]);
+    }
+    if (0 > cmdid)
+    {
+      hashmap_delete(vm->tagmap, hashmap_getkeybyentry(entry));
+      ril_deletetag(tag);
+      continue;
+    }
+    
+    i = buffer_size(macrobuffer);
+    buffer_malloc(macrobuffer, 1);
+    *(ril_tag_t**)buffer_index(macrobuffer, i) = tag;
+    *(int*)((ril_tag_t**)buffer_index(macrobuffer, i) + 1) = cmdid;
+  }
+  
+  _freecode(vm);
+  result = _loadcode(vm, &code, size);
+  
+  if (RIL_SUCCEEDED(result))
+  {
+    for (i = 0; i < buffer_size(macrobuffer); ++i)
+    {
+      tag = *(ril_tag_t**)buffer_index(macrobuffer, i);
+      ril_setshareddata(tag, vm->code.cmd + *(int*)((ril_tag_t**)buffer_index(macrobuffer, i) + 1));
+      // the results of the old body are dropped
+      if (NULL != tag->memo) ril_setmemo(vm, tag);
+    }
+    // and so is the output of the old [cache] bodies
+    ril_clearcache(vm);
+    
+    // restore the state through the old to new map
+    memcpy((int8_t*)buffer_front(statebuffer) + sizeof(vm->loadfile), &vm->hash, sizeof(vm->hash));
+    vm->cmdmap = cmdmap;
+    vm->cmdmap_size = cmdsize + 1;
+    result = RIL_FAILED(ril_loadstate(vm, buffer_front(statebuffer))) ? RIL_ERROR : RIL_OK;
+    vm->cmdmap = NULL;
+    
+    vm->state->cmd.prev = 0 <= previd ? vm->code.cmd + previd : NULL;
+    strcpy(vm->loadfile, loadfile);
+  }
+  
+  buffer_close(macrobuffer);
+  buffer_close(statebuffer);
+  ril_free(cmdmap);
+  
+  return result;
 }
 
 RILRESULT ril_loadfile(RILVM vm, const char *file)
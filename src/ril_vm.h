@@ -6,13 +6,18 @@
 #define RIL_DELIMITER_LENGTH 128
 
 #define LABEL_NULL 0x80000000
+#define RIL_STRING_INLINE 24
+#define RIL_ARRAY_PERSISTENTSIZE 64
+#define RIL_MEMO_SIZE 256 /* results a pure macro keeps */
+#define RIL_CACHE_BUDGET (256 * 1024) /* bytes of output [cache] keeps */
 
 enum
 {
   VAR_CALC,
   VAR_HASH,
   VAR_ADD,
-  VAR_END
+  VAR_END,
+  VAR_SLOT /* a macro local: slot, then as VAR_HASH */
 };
 
 typedef struct
@@ -33,6 +38,8 @@ typedef struct
   ril_tag_t *tag;
 } ril_childtag_t;
 
+typedef struct _ril_memo ril_memo_t;
+
 struct _ril_tag
 {
   char name[128];
@@ -46,6 +53,7 @@ struct _ril_tag
   RILLOADFUNCTION loadstate_handler;
   RILDELETEFUNCTION delete_handler;
   void *userdata;
+  ril_memo_t *memo; /* the results of a pure macro, or NULL */
   int refcount;
   bool hasparent;
   bool addstack;
@@ -99,6 +107,8 @@ typedef struct
 {
   ril_vmcmd_t *first;
   ril_vmcmd_t *last;
+  hashmap_t *cases; /* [case] commands of a [switch] by ril_casekey, or NULL */
+  ril_vmcmd_t *other; /* its [default], or NULL */
 } ril_paircmd_t;
 
 struct _ril_vmcmd {
@@ -108,6 +118,7 @@ struct _ril_vmcmd {
   ril_vmcmd_t *nextpair;
   ril_paircmd_t *pair;
   ril_vmcmd_t *parent;
+  bool tailcall; /* the next command leaves the macro without a value */
 };
 
 struct _ril_code
@@ -131,15 +142,60 @@ typedef struct
   hashmap_t *map;
   int refcount;
   int nextnum;
+  /* keys 0..size-1 are packed here while the map is empty */
+  ril_var_t **items;
+  int size, capacity;
+  /* large arrays turn persistent once shared, the copies share trie nodes */
+  bool persistent;
+  hamt_node_t *bykey; /* hash -> insertion seq */
+  hamt_node_t *byseq; /* insertion seq -> var, in order */
+  int count;
+  uint32_t nextseq;
 } ril_array_t;
 
 typedef struct
 {
-  char *ptr;
-  uint32_t size;
+  char *ptr; /* points to buf when the string fits there */
+  uint32_t size; /* without the terminating NUL, the text may contain NULs */
   int refcount;
+  char buf[RIL_STRING_INLINE];
 } ril_string_t;
 
+typedef struct _ril_memoentry ril_memoentry_t;
+
+struct _ril_memoentry
+{
+  ril_memoentry_t *prev, *next; /* from the most recently used */
+  ril_signature_t signature; /* the macro and its cache while the call runs */
+  uint32_t memoid;
+  hashmap_key_t hash;
+  ril_var_t value;
+  int size;
+  uint8_t key[1]; /* the serialized arguments */
+};
+
+typedef struct _ril_cacheentry ril_cacheentry_t;
+
+struct _ril_cacheentry
+{
+  ril_cacheentry_t *prev, *next; /* from the most recently used */
+  hashmap_key_t hash; /* of the key */
+  int keysize;
+  int size; /* the key and the output */
+  uint8_t data[1]; /* the key, then the output as int32_t lengths of text each followed by it, -1 for [r] */
+};
+
+struct _ril_memo
+{
+  RILVM vm;
+  uint32_t id;
+  const void *macro; /* the definition the results belong to */
+  hashmap_t *entries; /* by the hash of the key */
+  ril_memoentry_t *front, *back;
+  buffer_t *key; /* the arguments of the call looked up */
+  ril_memostats_t stats;
+};
+
 typedef struct
 {
   ril_tag_t *tag;
@@ -151,6 +207,7 @@ struct _ril_register
   ril_var_t *parent;
   ril_var_t *var;
   hashmap_key_t  hashkey;
+  int index; /* the integer key instead of hashkey, or -1 */
   ril_var_t temp;
 };
 
@@ -160,6 +217,28 @@ struct _ril_vm
   char loadfile[512];
   calc_t *calc;
   hashmap_t *tagmap;
+  hashmap_t *basetagmap; /* frozen registry under an overlay, or NULL */
+  hashmap_t *includecache; /* ril_fragment_t by path */
+  hashmap_t *keymap; /* interned array key names */
+  hashmap_t *indexkeys; /* index + 1 by the hash of its name, for lookups in packed arrays */
+  int indexkeysize; /* the indices hashed so far */
+  slab_t *slab; /* vars, strings, arrays and keys */
+  int32_t *cmdmap; /* old to new cmdid during ril_reload */
+  int cmdmap_size;
+  uint32_t memoid; /* the last id given to a results cache */
+  
+  struct
+  {
+    hashmap_t *entries; /* ril_cacheentry_t by the hash of the key */
+    ril_cacheentry_t *front, *back;
+    int budget; /* bytes the entries may hold */
+    ril_cachestats_t stats;
+  } cache;
+  struct
+  {
+    int level; /* RIL_OPTIMIZE_* of the compiles */
+    ril_optimizestats_t stats;
+  } optimize;
   ril_md5_t hash;
   
   void *userdata;
@@ -181,6 +260,11 @@ struct _ril_vm
     ril_vmcmd_t         *cmd;
     ril_vmarg_t         *arg;
     void *data;
+    int datasize;
+    hashmap_t *literals; /* strings borrowing the data, by offset */
+    hashmap_t *literaltexts; /* the same strings by their text */
+    int running; /* commands in progress, a string of the data may be held by any of them */
+    buffer_t *retired; /* the data of replaced code, freed once no command runs */
   } code;
 
   ril_var_t globalvar;
@@ -199,7 +283,10 @@ extern "C" {
 #endif
 
 void ril_parsecode(ril_code_t *code, const void *src);
+bool ril_isintegertext(const char *text, int *value);
+hashmap_key_t ril_casekey(const calc_value_t *value);
 void ril_freecode(RILVM vm);
+void ril_freeretiredcode(RILVM vm);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,194 @@
+/**
+ * slab - The size-class allocator for small fixed-size objects.
+ *
+ * MIT License
+ * Copyright (C) 2011 Nothan
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Nothan
+ * nothan@t-denrai.net
+ *
+ * Tsuioku Denrai
+ * http://t-denrai.net/
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/* pages are aligned to their size, so that a pointer finds its page by masking */
+#define SLAB_PAGESIZE 65536
+#define SLAB_GRAIN 16
+#define SLAB_CLASSES 16
+#define SLAB_MAXSIZE (SLAB_GRAIN * SLAB_CLASSES)
+
+struct _slab;
+
+typedef struct _slab_page
+{
+  struct _slab_page *next;
+  struct _slab_class *owner;
+} slab_page_t;
+
+typedef struct _slab_class
+{
+  int size;
+  void *freelist;
+  char *bump, *end;
+  struct _slab *slab;
+} slab_class_t;
+
+typedef struct
+{
+  unsigned int allocs; /* objects served from pages */
+  unsigned int frees;
+  unsigned int pages;
+  unsigned int large; /* larger objects passed to malloc */
+} slab_stats_t;
+
+typedef struct _slab
+{
+  slab_class_t classes[SLAB_CLASSES];
+  slab_page_t *pages;
+  slab_stats_t stats;
+} slab_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static __inline void* slab_pagealloc(void)
+{
+#ifdef _WIN32
+  return _aligned_malloc(SLAB_PAGESIZE, SLAB_PAGESIZE);
+#else
+  void *ptr;
+  return 0 == posix_memalign(&ptr, SLAB_PAGESIZE, SLAB_PAGESIZE) ? ptr : NULL;
+#endif
+}
+
+static __inline void slab_pagefree(void *ptr)
+{
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+static __inline slab_t* slab_open(void)
+{
+  slab_t *slab = (slab_t*)malloc(sizeof(slab_t));
+  int i;
+
+  if (NULL == slab) return NULL;
+  memset(slab, 0, sizeof(slab_t));
+  for (i = 0; i < SLAB_CLASSES; ++i)
+  {
+    slab->classes[i].size = (i + 1) * SLAB_GRAIN;
+    slab->classes[i].slab = slab;
+  }
+
+  return slab;
+}
+
+/* releases every page at once, objects still in use go with them */
+static __inline void slab_close(slab_t *slab)
+{
+  slab_page_t *page = slab->pages, *next;
+
+  for (; NULL != page; page = next)
+  {
+    next = page->next;
+    slab_pagefree(page);
+  }
+  free(slab);
+}
+
+static __inline void* slab_malloc(slab_t *slab, int size)
+{
+  slab_class_t *c;
+  slab_page_t *page;
+  void *ptr;
+
+  if (SLAB_MAXSIZE < size)
+  {
+    ++slab->stats.large;
+    return malloc(size);
+  }
+
+  c = &slab->classes[0 < size ? (size - 1) / SLAB_GRAIN : 0];
+  ++slab->stats.allocs;
+
+  if (NULL != c->freelist)
+  {
+    ptr = c->freelist;
+    c->freelist = *(void**)ptr;
+    return ptr;
+  }
+
+  if (c->bump + c->size > c->end)
+  {
+    page = (slab_page_t*)slab_pagealloc();
+    if (NULL == page) return NULL;
+    page->next = slab->pages;
+    page->owner = c;
+    slab->pages = page;
+    ++slab->stats.pages;
+    c->bump = (char*)page + SLAB_GRAIN;
+    c->end = (char*)page + SLAB_PAGESIZE;
+  }
+
+  ptr = c->bump;
+  c->bump += c->size;
+
+  return ptr;
+}
+
+/* the size is the one given to slab_malloc, the owner is found from the page */
+static __inline void slab_free(void *ptr, int size)
+{
+  slab_class_t *c;
+
+  if (NULL == ptr) return;
+  if (SLAB_MAXSIZE < size)
+  {
+    free(ptr);
+    return;
+  }
+
+  c = ((slab_page_t*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGESIZE - 1)))->owner;
+  ++c->slab->stats.frees;
+  *(void**)ptr = c->freelist;
+  c->freelist = ptr;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
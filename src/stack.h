@@ -67,6 +67,7 @@ static __inline stack_t* stack_open(int blocksize)
 static __inline void stack_close(stack_t *stack)
 {
   if (stack->pool != NULL) free(stack->pool);
+  free(stack);
 }
 
 static __inline void stack_clear(stack_t *stack)
@@ -0,0 +1,131 @@
+/**
+ * thread - The thread and mutex wrappers.
+ *
+ * MIT License
+ * Copyright (C) 2011 Nothan
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Nothan
+ * nothan@t-denrai.net
+ *
+ * Tsuioku Denrai
+ * http://t-denrai.net/
+ */
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+#define THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+#define THREAD_FUNC(name, arg) void* name(void *arg)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+typedef DWORD (WINAPI *thread_func_t)(LPVOID);
+#else
+typedef void* (*thread_func_t)(void*);
+#endif
+
+static __inline int thread_create(thread_t *thread, thread_func_t func, void *arg)
+{
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  return NULL != *thread ? 0 : -1;
+#else
+  return pthread_create(thread, NULL, func, arg) ? -1 : 0;
+#endif
+}
+
+static __inline void thread_join(thread_t thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+static __inline int thread_cpucount(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return 0 < count ? (int)count : 1;
+#endif
+}
+
+static __inline void mutex_init(mutex_t *mutex)
+{
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static __inline void mutex_destroy(mutex_t *mutex)
+{
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+static __inline void mutex_lock(mutex_t *mutex)
+{
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+static __inline void mutex_unlock(mutex_t *mutex)
+{
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
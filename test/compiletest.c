@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include "ril.h"
+
+/* checks the compile entry points against a plain compile of the same scripts, run in this directory */
+
+static const char *files[] = {
+  "hello.ril", "calc.ril", "loop.ril", "macro.ril", "while.ril", "string.ril", "variable.ril", "literal.ril",
+  "fibonacci.ril", "stream.ril", "cache.ril", "hoist.ril", "optimize.ril", "switch.ril", "for.ril"
+};
+
+#define FILE_COUNT (int)(sizeof(files) / sizeof(files[0]))
+
+static int failures;
+
+static void check(const char *name, int ok)
+{
+  printf("%-32s %s\n", name, ok ? "ok" : "FAILED");
+  if (!ok) ++failures;
+}
+
+static int same(ril_buffer_t *a, ril_buffer_t *b)
+{
+  return ril_buffer_size(a) == ril_buffer_size(b) && 0 == memcmp(ril_buffer_front(a), ril_buffer_front(b), ril_buffer_size(a));
+}
+
+// each file alone in a fresh vm, so no macro of another file is seen
+static RILRESULT compilealone(const char *file, ril_buffer_t *dest)
+{
+  RILVM vm = ril_open();
+  RILRESULT result = ril_compilefile(vm, file, dest);
+
+  ril_close(vm);
+
+  return result;
+}
+
+static char* readfile(const char *file)
+{
+  FILE *fp = fopen(file, "rb");
+  char *text = (char*)malloc(1 << 20);
+  size_t size = fread(text, 1, (1 << 20) - 1, fp);
+
+  text[size] = '\0';
+  fclose(fp);
+
+  return text;
+}
+
+static void writefile(const char *file, const char *text)
+{
+  FILE *fp = fopen(file, "wb");
+
+  fputs(text, fp);
+  fclose(fp);
+}
+
+typedef struct
+{
+  const char *cur;
+  int chunk;
+} reader_t;
+
+// never more than chunk bytes a call, so every token is cut somewhere
+static int readchunk(void *userdata, char *dest, int size)
+{
+  reader_t *reader = (reader_t*)userdata;
+  int len = (int)strlen(reader->cur);
+
+  if (size > reader->chunk) size = reader->chunk;
+  if (size > len) size = len;
+  memcpy(dest, reader->cur, size);
+  reader->cur += size;
+
+  return size;
+}
+
+static void test_compilestream(int chunk)
+{
+  ril_buffer_t *expected, *dest;
+  reader_t reader;
+  RILVM vm;
+  char *text, name[64];
+  int i, ok = 1;
+
+  for (i = 0; i < FILE_COUNT; ++i)
+  {
+    text = readfile(files[i]);
+    expected = ril_buffer_open(1, 256);
+    dest = ril_buffer_open(1, 256);
+    vm = ril_open();
+    ok &= RIL_OK == ril_compile(vm, text, expected);
+    ril_close(vm);
+    vm = ril_open();
+    reader.cur = text;
+    reader.chunk = chunk;
+    ok &= RIL_OK == ril_compilestream(vm, readchunk, &reader, dest) && same(expected, dest);
+    ril_close(vm);
+    ril_buffer_close(dest);
+    ril_buffer_close(expected);
+    free(text);
+  }
+
+  sprintf(name, "compilestream %d byte chunks", chunk);
+  check(name, ok);
+}
+
+// compiles src in vm, and again in a fresh vm without any cached fragment
+static int compilesame(RILVM vm, const char *src, ril_buffer_t *dest)
+{
+  ril_buffer_t *expected = ril_buffer_open(1, 256);
+  RILVM fresh = ril_open();
+  int ok;
+
+  ril_buffer_clear(dest);
+  ok = RIL_OK == ril_compile(vm, src, dest) && RIL_OK == ril_compile(fresh, src, expected) && same(expected, dest);
+  ril_close(fresh);
+  ril_buffer_close(expected);
+
+  return ok;
+}
+
+static void test_includecache(void)
+{
+  static const char *src = "[let $x = 1]head[r][include file:\"_include1.ril\"]tail[r]";
+  ril_buffer_t *first = ril_buffer_open(1, 256), *dest = ril_buffer_open(1, 256);
+  RILVM vm = ril_open();
+  int ok;
+
+  writefile("_include1.ril", "one [ch $x][r][include file:\"_include2.ril\"]");
+  writefile("_include2.ril", "two[r]");
+  ok = compilesame(vm, src, first);
+  // a cached fragment gives the same code
+  ok &= compilesame(vm, src, dest) && same(first, dest);
+  // the same size, so only the content tells the change
+  writefile("_include1.ril", "ONE [ch $x][r][include file:\"_include2.ril\"]");
+  ok &= compilesame(vm, src, dest) && !same(first, dest);
+  ril_buffer_clear(first);
+  ril_buffer_write(first, ril_buffer_front(dest), ril_buffer_size(dest));
+  // a nested include changes the fragment that includes it
+  writefile("_include2.ril", "TWO[r]");
+  ok &= compilesame(vm, src, dest) && !same(first, dest);
+  remove("_include1.ril");
+  remove("_include2.ril");
+  ril_close(vm);
+  ril_buffer_close(dest);
+  ril_buffer_close(first);
+
+  check("include cache", ok);
+}
+
+static void test_recompile(void)
+{
+  // each edit of the script, recompiled from the one before
+  static const char *edits[] = {
+    "*start\nline1[r]\n[macro name:\"m\" params:\"n\"][return $n * 2][endmacro]\n[m 3][ch $n][r]\n[goto label:*end]\n*end\nend[r]\n",
+    "; a comment above\n*start\nline1[r]\n[macro name:\"m\" params:\"n\"][return $n * 2][endmacro]\n[m 3][ch $n][r]\n[goto label:*end]\n*end\nend[r]\n",
+    "; a comment above\n*start\nline1 edited[r]\n[macro name:\"m\" params:\"n\"][return $n * 3][endmacro]\n[m 3][ch $n][r]\n[goto label:*end]\n*end\nend[r]\n",
+    "; a comment above\n*start\nline1 edited[r]\n[macro name:\"m\" params:\"n\"][return $n * 3][endmacro]\n[m 3][ch $n][r]\n*middle\n[while $i < 3][let $i = $i + 1][endwhile]\n[goto label:*end]\n*end\nend[r]\n",
+    "*start\n[macro name:\"m\" params:\"n\"][return $n * 3][endmacro]\n[m 3][ch $n][r]\n*middle\n[while $i < 3][let $i = $i + 1][endwhile]\n[goto label:*middle]\n"
+  };
+  ril_incremental_t *incremental = ril_openincremental();
+  ril_buffer_t *expected = ril_buffer_open(1, 256), *dest = ril_buffer_open(1, 256);
+  RILVM vm = ril_open(), fresh;
+  int i, ok = 1;
+
+  for (i = 0; i < (int)(sizeof(edits) / sizeof(edits[0])); ++i)
+  {
+    ril_buffer_clear(expected);
+    ril_buffer_clear(dest);
+    fresh = ril_open();
+    ok &= RIL_OK == ril_compile(fresh, edits[i], expected);
+    ril_close(fresh);
+    ok &= RIL_OK == ril_recompile(vm, incremental, edits[i], dest) && same(expected, dest);
+  }
+  ril_close(vm);
+  ril_buffer_close(dest);
+  ril_buffer_close(expected);
+  ril_closeincremental(incremental);
+
+  check("recompile", ok);
+}
+
+static char output[1024];
+
+RIL_FUNC(output_ch, vm)
+{
+  strcat(output, ril_getstring(vm, 0));
+
+  return RIL_NEXT;
+}
+
+RIL_FUNC(output_r, vm)
+{
+  strcat(output, "\n");
+
+  return RIL_NEXT;
+}
+
+// stops once, and goes on when it is run again
+RIL_FUNC(pause, vm)
+{
+  static int paused;
+
+  paused = !paused;
+
+  return paused ? RIL_STOP : RIL_NEXT;
+}
+
+static void test_reload(void)
+{
+  // every edit is loaded at a [pause], where the run goes on
+  static const char *edits[] = {
+    "[macro name:\"m\" params:\"n\"]m[ch $n]a[r][pause]m[ch $n]b[r][endmacro]\n"
+    "*start\nline1[r]\n[m 1]\nline2[r]\n"
+    "[while $i < 3][let $i = $i + 1]loop[ch $i][pause][endwhile]\nend[r]\n",
+    "; a comment added\n*extra\nextra[r]\n"
+    "[macro name:\"m\" params:\"n\"]m[ch $n]a[r][pause]m[ch $n]b[r][endmacro]\n"
+    "*start\nline1[r]\n[m 1]\nline2 edited[r]\n"
+    "[while $i < 3][let $i = $i + 1]loop[ch $i][pause][endwhile]\nend[r]\n",
+    "; a comment added\n*extra\nextra[r]\n"
+    "[macro name:\"m\" params:\"n\"]m[ch $n]a[r][pause]m[ch $n]b[r][endmacro]\n"
+    "*start\nline1[r]\n[m 1]\nline2 edited[r]\n"
+    "[while $i < 3][let $i = $i + 1]loop[ch $i][pause][endwhile]\nend edited[r]\n*more\nmore[r]\n"
+  };
+  static const int order[] = { 0, 1, 1, 2 };
+  ril_incremental_t *incremental = ril_openincremental();
+  ril_buffer_t *dest = ril_buffer_open(1, 256);
+  RILVM vm = ril_open();
+  int i, ok = 1;
+
+  ril_setexecutehandler(ril_getregisteredtag(vm, "ch", "value"), RIL_CALLFUNC(output_ch));
+  ril_setexecutehandler(ril_getregisteredtag(vm, "r", NULL), RIL_CALLFUNC(output_r));
+  RIL_REGISTERTAG(vm, pause, NULL);
+  output[0] = '\0';
+  for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); ++i)
+  {
+    ril_buffer_clear(dest);
+    ok &= RIL_OK == ril_recompile(vm, incremental, edits[order[i]], dest);
+    ok &= RIL_OK == ril_reload(vm, ril_buffer_front(dest), ril_buffer_size(dest));
+    ok &= RIL_STOP == ril_execute(vm);
+    strcat(output, "|");
+  }
+  ok &= RIL_EXIT == ril_execute(vm);
+  ok &= 0 == strcmp(output, "line1\nm1a\n|m1b\nline2 edited\nloop1|loop2|loop3|end edited\nmore\n");
+  ril_close(vm);
+  ril_buffer_close(dest);
+  ril_closeincremental(incremental);
+
+  check("reload", ok);
+}
+
+// each n misses once and comes back as a hit after that, where the plain recursion makes 1664079 calls
+static void test_memo(void)
+{
+  static const char *src =
+    "[macro name:\"fibomemo\" params:\"n\" vars:\"a, b\" pure:true]"
+    "[if 1 == $n || 2 == $n][return 1][endif]"
+    "[set $a][fibomemo $n-1][set $b][fibomemo $n-2][return $a + $b][endmacro]"
+    "[set $f][fibomemo 30][ch $f]";
+  ril_buffer_t *dest = ril_buffer_open(1, 256);
+  RILVM vm = ril_open();
+  ril_memostats_t stats;
+  int ok;
+
+  ril_setexecutehandler(ril_getregisteredtag(vm, "ch", "value"), RIL_CALLFUNC(output_ch));
+  output[0] = '\0';
+  ok = RIL_OK == ril_compile(vm, src, dest) && RIL_OK == ril_load(vm, ril_buffer_front(dest), ril_buffer_size(dest));
+  ok &= RIL_EXIT == ril_execute(vm) && 0 == strcmp(output, "832040");
+  ok &= RIL_OK == ril_getmemostats(ril_getregisteredtag(vm, "fibomemo", "n"), &stats);
+  ok &= 30 == stats.misses && 27 == stats.hits;
+  ril_close(vm);
+  ril_buffer_close(dest);
+
+  check("memo fibonacci", ok);
+}
+
+// tagnum tags registered right before the batch, which may leave the registry resizing
+static void test_compilefiles(int threadnum, int tagnum)
+{
+  const char *batch[FILE_COUNT * 4];
+  ril_buffer_t *expected[FILE_COUNT], *dests[FILE_COUNT * 4];
+  RILRESULT results[FILE_COUNT * 4];
+  RILVM vm = ril_open();
+  char name[64];
+  int i, ok = 1;
+
+  for (i = 0; i < tagnum; ++i)
+  {
+    sprintf(name, "extra%d", i);
+    ril_registertag(vm, name, NULL, RIL_CALLFUNC(output_r));
+  }
+  for (i = 0; i < FILE_COUNT; ++i)
+  {
+    expected[i] = ril_buffer_open(1, 256);
+    ok &= RIL_OK == compilealone(files[i], expected[i]);
+  }
+  // every file several times over, so the workers overlap
+  for (i = 0; i < FILE_COUNT * 4; ++i)
+  {
+    batch[i] = files[i % FILE_COUNT];
+    dests[i] = ril_buffer_open(1, 256);
+  }
+  ok &= RIL_OK == ril_compilefiles(vm, batch, dests, results, FILE_COUNT * 4, threadnum);
+  for (i = 0; i < FILE_COUNT * 4; ++i)
+  {
+    ok &= RIL_OK == results[i] && same(expected[i % FILE_COUNT], dests[i]);
+    ril_buffer_close(dests[i]);
+  }
+  for (i = 0; i < FILE_COUNT; ++i) ril_buffer_close(expected[i]);
+  ril_close(vm);
+
+  if (0 < tagnum) sprintf(name, "compilefiles %d threads %d tags", threadnum, tagnum);
+  else sprintf(name, "compilefiles %d threads", threadnum);
+  check(name, ok);
+}
+
+int main(int argc, char *argv[])
+{
+  setlocale(LC_CTYPE, "");
+
+  test_compilestream(1);
+  test_compilestream(7);
+  test_compilestream(4096);
+  test_includecache();
+  test_recompile();
+  test_reload();
+  test_memo();
+  test_compilefiles(1, 0);
+  test_compilefiles(4, 0);
+  test_compilefiles(8, 45);
+  test_compilefiles(8, 380);
+
+  return 0 < failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/crc.h"
+
+/* key hashing throughput of crc(), the hash behind ril_makecrc and hashmap_makekey */
+
+#define TOTALBYTES (256 * 1024 * 1024)
+
+int main(int argc, char *argv[])
+{
+  static const uint32_t lengths[] = { 4, 8, 12, 16, 32, 64, 256, 4096 };
+  char *buffer = (char*)malloc(8192);
+  uint32_t i, j, len, count, hash = 0;
+  clock_t start;
+  double sec;
+
+  for (i = 0; i < 8192; ++i) buffer[i] = 'a' + i % 26;
+
+  printf("%6s %12s %10s\n", "bytes", "Mkeys/s", "MB/s");
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+  {
+    len = lengths[i];
+    count = TOTALBYTES / len;
+    start = clock();
+    for (j = 0; j < count; ++j)
+    {
+      hash += crc(buffer + (j & 1023), len, hash);
+    }
+    sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (0 >= sec) sec = 1e-9;
+    printf("%6u %12.1f %10.1f\n", len, count / sec / 1e6, TOTALBYTES / sec / (1024 * 1024));
+  }
+  printf("(%08x)\n", hash);
+  free(buffer);
+
+  return 0;
+}